@@ -0,0 +1,301 @@
+#pragma once
+
+// Batched TRS transforms.
+// Turns arrays of positions, unit quaternions and scales into model matrices
+// (translate * rotate * scale, the same product the scene graph used to build with glm) and their
+// normal matrices. The normal matrix of such a transform is R * S^-1, so it comes from the rotation
+// columns times the reciprocal scale instead of from a matrix inverse.
+// There are three kernels: AVX2 (8 transforms per step), SSE2 (4 per step) and scalar. The SIMD kernels compute every matrix entry across
+// the lanes and transpose the results back into column-major glm matrices. The widest kernel the
+// CPU supports is picked the first time a batch runs. None of them uses FMA or approximate
+// reciprocals, so all three give bit-identical matrices, and the model matrices match the old glm
+// path exactly.
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define BATCH_TRANSFORM_SIMD 1	//SSE2 is part of x86-64, AVX2 is checked at runtime
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BATCH_TRANSFORM_AVX2_TARGET
+#else
+#define BATCH_TRANSFORM_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float) && sizeof(glm::quat) == 4 * sizeof(float)
+	&& sizeof(glm::mat3) == 9 * sizeof(float) && sizeof(glm::mat4) == 16 * sizeof(float), "batched transforms expect tightly packed glm types");
+
+enum TransformKernel
+{
+	TRANSFORM_SCALAR,
+	TRANSFORM_SSE2,
+	TRANSFORM_AVX2
+};
+
+static const char* TransformKernelName(TransformKernel kernel)
+{
+	return kernel == TRANSFORM_AVX2 ? "avx2" : kernel == TRANSFORM_SSE2 ? "sse2" : "scalar";
+}
+
+// Whether this CPU (and OS, for the AVX registers) can run a kernel
+static bool TransformKernelSupported(TransformKernel kernel)
+{
+#ifdef BATCH_TRANSFORM_SIMD
+	if (kernel != TRANSFORM_AVX2)
+		return true;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;	//OSXSAVE, AVX, YMM state saved
+	__cpuidex(info, 7, 0);
+	return osAvx && (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+#else
+	return kernel == TRANSFORM_SCALAR;
+#endif
+}
+
+static TransformKernel& ActiveTransformKernel()
+{
+	static TransformKernel kernel = TransformKernelSupported(TRANSFORM_AVX2) ? TRANSFORM_AVX2
+		: TransformKernelSupported(TRANSFORM_SSE2) ? TRANSFORM_SSE2 : TRANSFORM_SCALAR;
+	return kernel;
+}
+
+// Force a kernel (benchmarks), ignored if the CPU cannot run it
+static void SetTransformKernel(TransformKernel kernel)
+{
+	if (TransformKernelSupported(kernel))
+		ActiveTransformKernel() = kernel;
+}
+
+// Position of each quaternion component in memory; glm stores w last by default but can put it first
+struct QuatLayout
+{
+	int x, y, z, w;
+};
+
+static QuatLayout GetQuatLayout()
+{
+	glm::quat probe;
+	const float* base = (const float*)&probe;
+	return { (int)(&probe.x - base), (int)(&probe.y - base), (int)(&probe.z - base), (int)(&probe.w - base) };
+}
+
+static void BatchTransformsScalar(const glm::vec3* positions, const glm::quat* rotations, const glm::vec3* scales, size_t count,
+	glm::mat4* models, glm::mat3* normals)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const glm::quat& q = rotations[i];
+		float x2 = q.x + q.x, y2 = q.y + q.y, z2 = q.z + q.z;
+		float xx = q.x * x2, yy = q.y * y2, zz = q.z * z2;
+		float xy = q.x * y2, xz = q.x * z2, yz = q.y * z2;
+		float wx = q.w * x2, wy = q.w * y2, wz = q.w * z2;
+		glm::vec3 r0(1.0f - (yy + zz), xy + wz, xz - wy);
+		glm::vec3 r1(xy - wz, 1.0f - (xx + zz), yz + wx);
+		glm::vec3 r2(xz + wy, yz - wx, 1.0f - (xx + yy));
+
+		const glm::vec3& s = scales[i];
+		glm::mat4& model = models[i];
+		model[0] = glm::vec4(r0 * s.x, 0.0f);
+		model[1] = glm::vec4(r1 * s.y, 0.0f);
+		model[2] = glm::vec4(r2 * s.z, 0.0f);
+		model[3] = glm::vec4(positions[i], 1.0f);
+		if (normals)
+		{
+			normals[i][0] = r0 * (1.0f / s.x);
+			normals[i][1] = r1 * (1.0f / s.y);
+			normals[i][2] = r2 * (1.0f / s.z);
+		}
+	}
+}
+
+#ifdef BATCH_TRANSFORM_SIMD
+
+// Deinterleave four packed vec3 into x, y and z lanes
+static inline void LoadVec3x4(const glm::vec3* v, __m128& x, __m128& y, __m128& z)
+{
+	const float* f = &v[0].x;
+	__m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f + 4), c = _mm_loadu_ps(f + 8);	//x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+	x = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 0)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+	y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+// Transpose four lanes of rows into four transforms' 4 consecutive floats, starting offset floats
+// into each transform
+template<typename Matrix>
+static inline void StoreTransposed4(Matrix* matrices, int offset, __m128 r0, __m128 r1, __m128 r2, __m128 r3)
+{
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(&matrices[0][0][0] + offset, r0);
+	_mm_storeu_ps(&matrices[1][0][0] + offset, r1);
+	_mm_storeu_ps(&matrices[2][0][0] + offset, r2);
+	_mm_storeu_ps(&matrices[3][0][0] + offset, r3);
+}
+
+static void BatchTransformsSse2(const glm::vec3* positions, const glm::quat* rotations, const glm::vec3* scales, size_t count,
+	glm::mat4* models, glm::mat3* normals)
+{
+	QuatLayout layout = GetQuatLayout();
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 q[4] = { _mm_loadu_ps((const float*)&rotations[i]), _mm_loadu_ps((const float*)&rotations[i + 1]),
+			_mm_loadu_ps((const float*)&rotations[i + 2]), _mm_loadu_ps((const float*)&rotations[i + 3]) };
+		_MM_TRANSPOSE4_PS(q[0], q[1], q[2], q[3]);
+		__m128 x = q[layout.x], y = q[layout.y], z = q[layout.z], w = q[layout.w];
+
+		__m128 x2 = _mm_add_ps(x, x), y2 = _mm_add_ps(y, y), z2 = _mm_add_ps(z, z);
+		__m128 xx = _mm_mul_ps(x, x2), yy = _mm_mul_ps(y, y2), zz = _mm_mul_ps(z, z2);
+		__m128 xy = _mm_mul_ps(x, y2), xz = _mm_mul_ps(x, z2), yz = _mm_mul_ps(y, z2);
+		__m128 wx = _mm_mul_ps(w, x2), wy = _mm_mul_ps(w, y2), wz = _mm_mul_ps(w, z2);
+		__m128 r[9] = {
+			_mm_sub_ps(one, _mm_add_ps(yy, zz)), _mm_add_ps(xy, wz), _mm_sub_ps(xz, wy),
+			_mm_sub_ps(xy, wz), _mm_sub_ps(one, _mm_add_ps(xx, zz)), _mm_add_ps(yz, wx),
+			_mm_add_ps(xz, wy), _mm_sub_ps(yz, wx), _mm_sub_ps(one, _mm_add_ps(xx, yy)) };
+
+		__m128 sx, sy, sz, px, py, pz;
+		LoadVec3x4(&scales[i], sx, sy, sz);
+		LoadVec3x4(&positions[i], px, py, pz);
+		StoreTransposed4(&models[i], 0, _mm_mul_ps(r[0], sx), _mm_mul_ps(r[1], sx), _mm_mul_ps(r[2], sx), zero);
+		StoreTransposed4(&models[i], 4, _mm_mul_ps(r[3], sy), _mm_mul_ps(r[4], sy), _mm_mul_ps(r[5], sy), zero);
+		StoreTransposed4(&models[i], 8, _mm_mul_ps(r[6], sz), _mm_mul_ps(r[7], sz), _mm_mul_ps(r[8], sz), zero);
+		StoreTransposed4(&models[i], 12, px, py, pz, one);
+		if (!normals)
+			continue;
+
+		//Each 3x3 is 9 floats: the first 8 go out as two transposed groups of 4, the last one alone
+		__m128 ix = _mm_div_ps(one, sx), iy = _mm_div_ps(one, sy), iz = _mm_div_ps(one, sz);
+		StoreTransposed4(&normals[i], 0, _mm_mul_ps(r[0], ix), _mm_mul_ps(r[1], ix), _mm_mul_ps(r[2], ix), _mm_mul_ps(r[3], iy));
+		StoreTransposed4(&normals[i], 4, _mm_mul_ps(r[4], iy), _mm_mul_ps(r[5], iy), _mm_mul_ps(r[6], iz), _mm_mul_ps(r[7], iz));
+		float last[4];
+		_mm_storeu_ps(last, _mm_mul_ps(r[8], iz));
+		for (int k = 0; k < 4; k++)
+			normals[i + k][2][2] = last[k];
+	}
+	BatchTransformsScalar(positions + i, rotations + i, scales + i, count - i, models + i, normals ? normals + i : nullptr);
+}
+
+// Transpose the 4x4 blocks in both 128-bit halves: afterwards rk holds element k of rows r0..r3,
+// i.e. transform k in the low half and transform k + 4 in the high half
+BATCH_TRANSFORM_AVX2_TARGET
+static inline void TransposeHalves(__m256& r0, __m256& r1, __m256& r2, __m256& r3)
+{
+	__m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+	__m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+	r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// Deinterleave eight packed vec3: every component sits at a different position in each of the three
+// loads, so two blends and one lane permute collect it
+BATCH_TRANSFORM_AVX2_TARGET
+static inline void LoadVec3x8(const glm::vec3* v, __m256& x, __m256& y, __m256& z)
+{
+	const float* f = &v[0].x;
+	__m256 a = _mm256_loadu_ps(f), b = _mm256_loadu_ps(f + 8), c = _mm256_loadu_ps(f + 16);
+	x = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(a, b, 0x92), c, 0x24), _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5));
+	y = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(a, b, 0x24), c, 0x49), _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6));
+	z = _mm256_permutevar8x32_ps(_mm256_blend_ps(_mm256_blend_ps(a, b, 0x49), c, 0x92), _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7));
+}
+
+// Transpose two groups of four rows for eight transforms and store them as 8 consecutive floats of
+// each transform (the first group's 4 then the second's), starting offset floats into it
+template<typename Matrix>
+BATCH_TRANSFORM_AVX2_TARGET
+static inline void StoreTransposed8(Matrix* matrices, int offset, __m256 a0, __m256 a1, __m256 a2, __m256 a3,
+	__m256 b0, __m256 b1, __m256 b2, __m256 b3)
+{
+	TransposeHalves(a0, a1, a2, a3);
+	TransposeHalves(b0, b1, b2, b3);
+	//Low halves belong to transforms 0-3, high halves to 4-7
+	_mm256_storeu_ps(&matrices[0][0][0] + offset, _mm256_permute2f128_ps(a0, b0, 0x20));
+	_mm256_storeu_ps(&matrices[1][0][0] + offset, _mm256_permute2f128_ps(a1, b1, 0x20));
+	_mm256_storeu_ps(&matrices[2][0][0] + offset, _mm256_permute2f128_ps(a2, b2, 0x20));
+	_mm256_storeu_ps(&matrices[3][0][0] + offset, _mm256_permute2f128_ps(a3, b3, 0x20));
+	_mm256_storeu_ps(&matrices[4][0][0] + offset, _mm256_permute2f128_ps(a0, b0, 0x31));
+	_mm256_storeu_ps(&matrices[5][0][0] + offset, _mm256_permute2f128_ps(a1, b1, 0x31));
+	_mm256_storeu_ps(&matrices[6][0][0] + offset, _mm256_permute2f128_ps(a2, b2, 0x31));
+	_mm256_storeu_ps(&matrices[7][0][0] + offset, _mm256_permute2f128_ps(a3, b3, 0x31));
+}
+
+BATCH_TRANSFORM_AVX2_TARGET
+static void BatchTransformsAvx2(const glm::vec3* positions, const glm::quat* rotations, const glm::vec3* scales, size_t count,
+	glm::mat4* models, glm::mat3* normals)
+{
+	QuatLayout layout = GetQuatLayout();
+	__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		//Quaternions k and k + 4 share a register, so the transpose leaves the lanes in transform order
+		const float* qf = (const float*)&rotations[i];
+		__m256 q[4];
+		for (int k = 0; k < 4; k++)
+			q[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(qf + k * 4)), _mm_loadu_ps(qf + k * 4 + 16), 1);
+		TransposeHalves(q[0], q[1], q[2], q[3]);
+		__m256 x = q[layout.x], y = q[layout.y], z = q[layout.z], w = q[layout.w];
+
+		__m256 x2 = _mm256_add_ps(x, x), y2 = _mm256_add_ps(y, y), z2 = _mm256_add_ps(z, z);
+		__m256 xx = _mm256_mul_ps(x, x2), yy = _mm256_mul_ps(y, y2), zz = _mm256_mul_ps(z, z2);
+		__m256 xy = _mm256_mul_ps(x, y2), xz = _mm256_mul_ps(x, z2), yz = _mm256_mul_ps(y, z2);
+		__m256 wx = _mm256_mul_ps(w, x2), wy = _mm256_mul_ps(w, y2), wz = _mm256_mul_ps(w, z2);
+		__m256 r[9] = {
+			_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), _mm256_add_ps(xy, wz), _mm256_sub_ps(xz, wy),
+			_mm256_sub_ps(xy, wz), _mm256_sub_ps(one, _mm256_add_ps(xx, zz)), _mm256_add_ps(yz, wx),
+			_mm256_add_ps(xz, wy), _mm256_sub_ps(yz, wx), _mm256_sub_ps(one, _mm256_add_ps(xx, yy)) };
+
+		__m256 sx, sy, sz, px, py, pz;
+		LoadVec3x8(&scales[i], sx, sy, sz);
+		LoadVec3x8(&positions[i], px, py, pz);
+		StoreTransposed8(&models[i], 0, _mm256_mul_ps(r[0], sx), _mm256_mul_ps(r[1], sx), _mm256_mul_ps(r[2], sx), zero,
+			_mm256_mul_ps(r[3], sy), _mm256_mul_ps(r[4], sy), _mm256_mul_ps(r[5], sy), zero);
+		StoreTransposed8(&models[i], 8, _mm256_mul_ps(r[6], sz), _mm256_mul_ps(r[7], sz), _mm256_mul_ps(r[8], sz), zero,
+			px, py, pz, one);
+		if (!normals)
+			continue;
+
+		//Each 3x3 is 9 floats: the first 8 go out transposed, the last one alone
+		__m256 ix = _mm256_div_ps(one, sx), iy = _mm256_div_ps(one, sy), iz = _mm256_div_ps(one, sz);
+		StoreTransposed8(&normals[i], 0, _mm256_mul_ps(r[0], ix), _mm256_mul_ps(r[1], ix), _mm256_mul_ps(r[2], ix), _mm256_mul_ps(r[3], iy),
+			_mm256_mul_ps(r[4], iy), _mm256_mul_ps(r[5], iy), _mm256_mul_ps(r[6], iz), _mm256_mul_ps(r[7], iz));
+		float last[8];
+		_mm256_storeu_ps(last, _mm256_mul_ps(r[8], iz));
+		for (int k = 0; k < 8; k++)
+			normals[i + k][2][2] = last[k];
+	}
+	BatchTransformsSse2(positions + i, rotations + i, scales + i, count - i, models + i, normals ? normals + i : nullptr);
+}
+
+#endif
+
+// Build count model matrices, and normal matrices unless normals is null, with the given kernel
+static void BatchTransformsWith(TransformKernel kernel, const glm::vec3* positions, const glm::quat* rotations, const glm::vec3* scales,
+	size_t count, glm::mat4* models, glm::mat3* normals)
+{
+#ifdef BATCH_TRANSFORM_SIMD
+	if (kernel == TRANSFORM_AVX2)
+		return BatchTransformsAvx2(positions, rotations, scales, count, models, normals);
+	if (kernel == TRANSFORM_SSE2)
+		return BatchTransformsSse2(positions, rotations, scales, count, models, normals);
+#endif
+	BatchTransformsScalar(positions, rotations, scales, count, models, normals);
+}
+
+// Same with the active kernel
+static void BatchTransforms(const glm::vec3* positions, const glm::quat* rotations, const glm::vec3* scales, size_t count,
+	glm::mat4* models, glm::mat3* normals)
+{
+	BatchTransformsWith(ActiveTransformKernel(), positions, rotations, scales, count, models, normals);
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+// Clustered forward lighting.
+// The view frustum is split into screen tiles and logarithmic depth slices. Each frame the CPU
+// finds which clusters every light's sphere of influence touches (spread over a JobPool) and
+// uploads three texture buffers the fragment shader reads with texelFetch (GL 3.3):
+//   lights   RGBA32F  two texels per light: position + radius, color
+//   ranges   RG32UI   per cluster: first entry in the index list, light count
+//   indices  R32UI    light indices, grouped by cluster
+// A fragment then shades only the lights listed for its cluster. Lights with radius 0 have no
+// falloff and are listed in every cluster.
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "JobPool.h"
+
+const int CLUSTER_TILE_SIZE = 64;		//pixels per tile side
+const int CLUSTER_DEPTH_SLICES = 16;
+const int MAX_CLUSTERED_LIGHTS = 4096;
+
+//Texture units the cluster buffers are bound to (unit 0 is the material)
+const GLint CLUSTER_LIGHT_UNIT = 1;
+const GLint CLUSTER_RANGE_UNIT = 2;
+const GLint CLUSTER_INDEX_UNIT = 3;
+
+//Clusters one light touches, an empty slice range means it is outside the frustum
+struct LightClusterBounds
+{
+	int tileX0, tileY0, tileX1, tileY1;
+	int slice0, slice1;
+};
+
+struct LightClusters
+{
+	int tilesX = 0, tilesY = 0, slices = CLUSTER_DEPTH_SLICES;
+	GLfloat nearPlane = 0.1f, farPlane = 100.0f;
+	GLfloat sliceScale = 0.0f, sliceBias = 0.0f;	//slice = log(depth) * sliceScale + sliceBias
+
+	GLuint lightBuffer = 0, lightTexture = 0;
+	GLuint rangeBuffer = 0, rangeTexture = 0;
+	GLuint indexBuffer = 0, indexTexture = 0;
+
+	//CPU side, kept between frames to avoid reallocating
+	std::vector<LightClusterBounds> bounds;
+	std::vector<std::vector<GLuint>> sliceIndices;	//light indices of each depth slice's clusters
+	std::vector<std::vector<GLuint>> cursors;		//per-worker fill positions
+	std::vector<GLuint> ranges;						//first, count per cluster
+
+	double binMs = 0.0;			//CPU time of the last UpdateLightClusters
+	size_t lightReferences = 0;	//total entries in the index list last frame
+};
+
+static void CreateBufferTexture(GLuint& buffer, GLuint& texture, GLenum format)
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+static void InitLightClusters(LightClusters& clusters, GLfloat nearPlane, GLfloat farPlane)
+{
+	clusters.nearPlane = nearPlane;
+	clusters.farPlane = farPlane;
+	clusters.sliceScale = (GLfloat)clusters.slices / logf(farPlane / nearPlane);
+	clusters.sliceBias = -logf(nearPlane) * clusters.sliceScale;
+	clusters.sliceIndices.resize(clusters.slices);
+
+	CreateBufferTexture(clusters.lightBuffer, clusters.lightTexture, GL_RGBA32F);
+	CreateBufferTexture(clusters.rangeBuffer, clusters.rangeTexture, GL_RG32UI);
+	CreateBufferTexture(clusters.indexBuffer, clusters.indexTexture, GL_R32UI);
+}
+
+static int ClusterSlice(const LightClusters& clusters, GLfloat depth)
+{
+	int slice = (int)floorf(logf(depth) * clusters.sliceScale + clusters.sliceBias);
+	return std::min(clusters.slices - 1, std::max(0, slice));
+}
+
+// Clusters covered by a light's sphere: slices from its depth range, tiles from the screen
+// rectangle of its view-space bounding box (the whole screen if it crosses the near plane)
+static LightClusterBounds ComputeLightClusterBounds(const LightClusters& clusters, const glm::vec4& positionRadius,
+	const glm::mat4& view, const glm::mat4& projection, int fbWidth, int fbHeight)
+{
+	LightClusterBounds bounds = { 0, 0, clusters.tilesX - 1, clusters.tilesY - 1, 0, clusters.slices - 1 };
+	GLfloat radius = positionRadius.w;
+	if (radius <= 0.0f)
+		return bounds;
+
+	glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(positionRadius), 1.0f));
+	GLfloat depth = -center.z;
+	GLfloat nearest = depth - radius, farthest = depth + radius;
+	if (farthest < clusters.nearPlane || nearest > clusters.farPlane)
+	{
+		bounds.slice0 = 1;
+		bounds.slice1 = 0;
+		return bounds;
+	}
+	bounds.slice0 = ClusterSlice(clusters, std::max(nearest, clusters.nearPlane));
+	bounds.slice1 = ClusterSlice(clusters, std::min(farthest, clusters.farPlane));
+	if (nearest <= clusters.nearPlane)
+		return bounds;
+
+	glm::vec2 low(1e30f), high(-1e30f);
+	for (int corner = 0; corner < 8; corner++)
+	{
+		glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius, (corner & 4) ? radius : -radius);
+		glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+		glm::vec2 ndc = glm::vec2(clip) / clip.w;
+		low = glm::min(low, ndc);
+		high = glm::max(high, ndc);
+	}
+	if (high.x < -1.0f || high.y < -1.0f || low.x > 1.0f || low.y > 1.0f)
+	{
+		bounds.slice0 = 1;
+		bounds.slice1 = 0;
+		return bounds;
+	}
+
+	//NDC to tiles, y counts from the bottom like gl_FragCoord
+	bounds.tileX0 = std::max(0, (int)floorf((low.x * 0.5f + 0.5f) * fbWidth / CLUSTER_TILE_SIZE));
+	bounds.tileY0 = std::max(0, (int)floorf((low.y * 0.5f + 0.5f) * fbHeight / CLUSTER_TILE_SIZE));
+	bounds.tileX1 = std::min(clusters.tilesX - 1, (int)floorf((high.x * 0.5f + 0.5f) * fbWidth / CLUSTER_TILE_SIZE));
+	bounds.tileY1 = std::min(clusters.tilesY - 1, (int)floorf((high.y * 0.5f + 0.5f) * fbHeight / CLUSTER_TILE_SIZE));
+	return bounds;
+}
+
+// Bin the lights into clusters and upload all three buffers.
+// lightData holds two vec4 per light: position with radius in w, then color.
+static void UpdateLightClusters(LightClusters& clusters, JobPool& pool, const std::vector<glm::vec4>& lightData,
+	const glm::mat4& view, const glm::mat4& projection, int fbWidth, int fbHeight)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	size_t lightCount = std::min(lightData.size() / 2, (size_t)MAX_CLUSTERED_LIGHTS);
+	clusters.tilesX = (fbWidth + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE;
+	clusters.tilesY = (fbHeight + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE;
+	int tilesPerSlice = clusters.tilesX * clusters.tilesY;
+	clusters.ranges.resize((size_t)tilesPerSlice * clusters.slices * 2);
+	clusters.bounds.resize(lightCount);
+	clusters.cursors.resize(JobPoolThreadCount(pool));
+
+	//Each light's cluster range, in chunks so small light counts do not pay for the hand-off
+	const size_t lightsPerJob = 64;
+	ParallelFor(pool, (lightCount + lightsPerJob - 1) / lightsPerJob, [&](size_t job, unsigned)
+	{
+		size_t end = std::min(lightCount, (job + 1) * lightsPerJob);
+		for (size_t i = job * lightsPerJob; i < end; i++)
+			clusters.bounds[i] = ComputeLightClusterBounds(clusters, lightData[i * 2], view, projection, fbWidth, fbHeight);
+	});
+
+	//One depth slice per job: count the lights of every cluster in it, then list them
+	ParallelFor(pool, clusters.slices, [&](size_t slice, unsigned worker)
+	{
+		GLuint* ranges = &clusters.ranges[slice * tilesPerSlice * 2];
+		std::vector<GLuint>& cursor = clusters.cursors[worker];
+		std::vector<GLuint>& list = clusters.sliceIndices[slice];
+		cursor.assign(tilesPerSlice, 0);
+
+		for (size_t i = 0; i < lightCount; i++)
+		{
+			const LightClusterBounds& b = clusters.bounds[i];
+			if ((int)slice < b.slice0 || (int)slice > b.slice1)
+				continue;
+			for (int y = b.tileY0; y <= b.tileY1; y++)
+				for (int x = b.tileX0; x <= b.tileX1; x++)
+					cursor[y * clusters.tilesX + x]++;
+		}
+
+		GLuint total = 0;
+		for (int tile = 0; tile < tilesPerSlice; tile++)
+		{
+			ranges[tile * 2] = total;
+			ranges[tile * 2 + 1] = cursor[tile];
+			cursor[tile] = total;
+			total += ranges[tile * 2 + 1];
+		}
+
+		list.resize(total);
+		for (size_t i = 0; i < lightCount; i++)
+		{
+			const LightClusterBounds& b = clusters.bounds[i];
+			if ((int)slice < b.slice0 || (int)slice > b.slice1)
+				continue;
+			for (int y = b.tileY0; y <= b.tileY1; y++)
+				for (int x = b.tileX0; x <= b.tileX1; x++)
+					list[cursor[y * clusters.tilesX + x]++] = (GLuint)i;
+		}
+	});
+
+	//Slices were listed independently, shift each one's ranges to its place in the shared list
+	size_t total = 0;
+	for (int slice = 0; slice < clusters.slices; slice++)
+	{
+		GLuint* ranges = &clusters.ranges[(size_t)slice * tilesPerSlice * 2];
+		for (int tile = 0; tile < tilesPerSlice; tile++)
+			ranges[tile * 2] += (GLuint)total;
+		total += clusters.sliceIndices[slice].size();
+	}
+	clusters.lightReferences = total;
+
+	//Orphan and refill; buffer textures keep pointing at the same buffer objects
+	glBindBuffer(GL_TEXTURE_BUFFER, clusters.lightBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(16, lightCount * 2 * sizeof(glm::vec4)), nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, lightCount * 2 * sizeof(glm::vec4), lightData.data());
+
+	glBindBuffer(GL_TEXTURE_BUFFER, clusters.rangeBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, clusters.ranges.size() * sizeof(GLuint), clusters.ranges.data(), GL_STREAM_DRAW);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, clusters.indexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(16, total * sizeof(GLuint)), nullptr, GL_STREAM_DRAW);
+	size_t offset = 0;
+	for (int slice = 0; slice < clusters.slices; slice++)
+	{
+		const std::vector<GLuint>& list = clusters.sliceIndices[slice];
+		if (!list.empty())
+			glBufferSubData(GL_TEXTURE_BUFFER, offset * sizeof(GLuint), list.size() * sizeof(GLuint), list.data());
+		offset += list.size();
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	auto end = std::chrono::high_resolution_clock::now();
+	clusters.binMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Bind the three buffers to their texture units, leaves unit 0 active
+static void BindLightClusters(const LightClusters& clusters)
+{
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_LIGHT_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, clusters.lightTexture);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_RANGE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, clusters.rangeTexture);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_INDEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, clusters.indexTexture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+static void DestroyLightClusters(LightClusters& clusters)
+{
+	GLuint textures[] = { clusters.lightTexture, clusters.rangeTexture, clusters.indexTexture };
+	GLuint buffers[] = { clusters.lightBuffer, clusters.rangeBuffer, clusters.indexBuffer };
+	glDeleteTextures(3, textures);
+	glDeleteBuffers(3, buffers);
+	clusters = LightClusters();
+}
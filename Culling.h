@@ -0,0 +1,272 @@
+#pragma once
+
+// View frustum culling over a bounding volume hierarchy.
+// Scene objects are boxed in world space and sorted into a binary BVH (median split along the
+// longest axis). Each frame the six frustum planes are taken from projection * view and the tree
+// is walked from the root: a node outside any plane drops its whole subtree, a node inside all of
+// them accepts its whole subtree without testing further, and only boxes straddling a plane are
+// opened up.
+// The walk can be split into independent subtrees (SplitBvhTasks) and those walked on several
+// threads at once, each handing its visible objects to its own callback.
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "MeshRegistry.h"
+
+const uint32_t BVH_LEAF_OBJECTS = 2;	//objects per leaf before a node is split
+
+struct Frustum
+{
+	glm::vec4 planes[6];	//xyz normal pointing inside, w distance
+};
+
+struct BvhNode
+{
+	Aabb bounds;
+	uint32_t first;	//leaf: first entry in objectOrder, inner: index of the left child (right is left + 1)
+	uint32_t count;	//objects in a leaf, 0 for inner nodes
+};
+
+//Subtree to walk: root node and whether it is already known to be fully inside the frustum
+struct BvhTask
+{
+	uint32_t node;
+	bool inside;
+};
+
+struct Bvh
+{
+	std::vector<BvhNode> nodes;
+	std::vector<uint32_t> objectOrder;	//object indices, each leaf owns a contiguous run
+	std::vector<BvhTask> stack;			//traversal scratch for whole-tree walks (the shadow pass)
+};
+
+struct CullStats
+{
+	uint32_t visible = 0, culled = 0;
+	uint32_t nodesTested = 0;	//boxes tested against the frustum
+};
+
+// Box around a mesh-space box after transforming it (Arvo's method, no corner loop)
+static Aabb TransformAabb(const Aabb& box, const glm::mat4& matrix)
+{
+	Aabb result;
+	result.min = result.max = glm::vec3(matrix[3]);
+	for (int column = 0; column < 3; column++)
+		for (int row = 0; row < 3; row++)
+		{
+			float a = matrix[column][row] * box.min[column];
+			float b = matrix[column][row] * box.max[column];
+			result.min[row] += std::min(a, b);
+			result.max[row] += std::max(a, b);
+		}
+	return result;
+}
+
+static Aabb MergeAabb(const Aabb& a, const Aabb& b)
+{
+	Aabb result;
+	result.min = glm::min(a.min, b.min);
+	result.max = glm::max(a.max, b.max);
+	return result;
+}
+
+// Planes of the clip volume of viewProjection = projection * view (Gribb/Hartmann)
+static Frustum ExtractFrustum(const glm::mat4& viewProjection)
+{
+	glm::vec4 rows[4];
+	for (int row = 0; row < 4; row++)
+		rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+
+	Frustum frustum;
+	frustum.planes[0] = rows[3] + rows[0];	//left
+	frustum.planes[1] = rows[3] - rows[0];	//right
+	frustum.planes[2] = rows[3] + rows[1];	//bottom
+	frustum.planes[3] = rows[3] - rows[1];	//top
+	frustum.planes[4] = rows[3] + rows[2];	//near
+	frustum.planes[5] = rows[3] - rows[2];	//far
+	return frustum;
+}
+
+enum FrustumTest
+{
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECTS,
+	FRUSTUM_INSIDE
+};
+
+// Test the box corner furthest along each plane normal (and the nearest one for full containment)
+static FrustumTest TestFrustumAabb(const Frustum& frustum, const Aabb& box)
+{
+	FrustumTest result = FRUSTUM_INSIDE;
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		glm::vec3 farCorner(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y, plane.z >= 0.0f ? box.max.z : box.min.z);
+		if (glm::dot(glm::vec3(plane), farCorner) + plane.w < 0.0f)
+			return FRUSTUM_OUTSIDE;
+
+		glm::vec3 nearCorner(plane.x >= 0.0f ? box.min.x : box.max.x, plane.y >= 0.0f ? box.min.y : box.max.y, plane.z >= 0.0f ? box.min.z : box.max.z);
+		if (glm::dot(glm::vec3(plane), nearCorner) + plane.w < 0.0f)
+			result = FRUSTUM_INTERSECTS;
+	}
+	return result;
+}
+
+// Split objectOrder[first, first + count) into a subtree rooted at nodes[nodeIndex]
+static void BuildBvhNode(Bvh& bvh, const std::vector<Aabb>& objectBounds, uint32_t nodeIndex, uint32_t first, uint32_t count)
+{
+	Aabb bounds = objectBounds[bvh.objectOrder[first]];
+	Aabb centers = { (bounds.min + bounds.max) * 0.5f, (bounds.min + bounds.max) * 0.5f };
+	for (uint32_t i = first + 1; i < first + count; i++)
+	{
+		const Aabb& box = objectBounds[bvh.objectOrder[i]];
+		bounds = MergeAabb(bounds, box);
+		glm::vec3 center = (box.min + box.max) * 0.5f;
+		centers.min = glm::min(centers.min, center);
+		centers.max = glm::max(centers.max, center);
+	}
+	bvh.nodes[nodeIndex].bounds = bounds;
+
+	if (count <= BVH_LEAF_OBJECTS)
+	{
+		bvh.nodes[nodeIndex].first = first;
+		bvh.nodes[nodeIndex].count = count;
+		return;
+	}
+
+	//Median split along the axis the object centers spread furthest on
+	glm::vec3 extent = centers.max - centers.min;
+	int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	uint32_t half = count / 2;
+	std::nth_element(bvh.objectOrder.begin() + first, bvh.objectOrder.begin() + first + half, bvh.objectOrder.begin() + first + count,
+		[&](uint32_t a, uint32_t b)
+		{
+			return objectBounds[a].min[axis] + objectBounds[a].max[axis] < objectBounds[b].min[axis] + objectBounds[b].max[axis];
+		});
+
+	uint32_t left = (uint32_t)bvh.nodes.size();
+	bvh.nodes.resize(bvh.nodes.size() + 2);
+	bvh.nodes[nodeIndex].first = left;
+	bvh.nodes[nodeIndex].count = 0;
+	BuildBvhNode(bvh, objectBounds, left, first, half);
+	BuildBvhNode(bvh, objectBounds, left + 1, first + half, count - half);
+}
+
+// Rebuild the hierarchy over world-space object boxes
+static void BuildBvh(Bvh& bvh, const std::vector<Aabb>& objectBounds)
+{
+	bvh.nodes.clear();
+	bvh.objectOrder.resize(objectBounds.size());
+	for (uint32_t i = 0; i < (uint32_t)objectBounds.size(); i++)
+		bvh.objectOrder[i] = i;
+	if (objectBounds.empty())
+		return;
+
+	bvh.nodes.reserve(objectBounds.size() * 2);
+	bvh.nodes.resize(1);
+	BuildBvhNode(bvh, objectBounds, 0, 0, (uint32_t)objectBounds.size());
+}
+
+// Recompute node boxes after objects moved, keeping the tree's shape. Children are always stored
+// after their parent, so walking the nodes backwards finishes children first.
+static void RefitBvh(Bvh& bvh, const std::vector<Aabb>& objectBounds)
+{
+	for (size_t i = bvh.nodes.size(); i-- > 0;)
+	{
+		BvhNode& node = bvh.nodes[i];
+		if (node.count)
+		{
+			node.bounds = objectBounds[bvh.objectOrder[node.first]];
+			for (uint32_t j = node.first + 1; j < node.first + node.count; j++)
+				node.bounds = MergeAabb(node.bounds, objectBounds[bvh.objectOrder[j]]);
+		}
+		else
+			node.bounds = MergeAabb(bvh.nodes[node.first].bounds, bvh.nodes[node.first + 1].bounds);
+	}
+}
+
+// Open the top of the tree breadth first until there are at least minTasks subtrees to hand out
+// (or nothing left to open). Subtrees outside the frustum are dropped on the way.
+static void SplitBvhTasks(const Bvh& bvh, const Frustum& frustum, size_t minTasks, std::vector<BvhTask>& tasks, CullStats& stats)
+{
+	tasks.clear();
+	if (bvh.nodes.empty())
+		return;
+
+	//Tasks are a FIFO: take the oldest, queue its children (or the leaf itself) at the back
+	tasks.push_back({ 0u, false });
+	size_t head = 0, leavesInARow = 0;
+	while (tasks.size() - head < minTasks && leavesInARow < tasks.size() - head)
+	{
+		BvhTask task = tasks[head++];
+		const BvhNode& node = bvh.nodes[task.node];
+		if (node.count)
+		{
+			tasks.push_back(task);
+			leavesInARow++;
+			continue;
+		}
+		leavesInARow = 0;
+
+		if (!task.inside)
+		{
+			stats.nodesTested++;
+			FrustumTest test = TestFrustumAabb(frustum, node.bounds);
+			if (test == FRUSTUM_OUTSIDE)
+				continue;
+			task.inside = test == FRUSTUM_INSIDE;
+		}
+		tasks.push_back({ node.first, task.inside });
+		tasks.push_back({ node.first + 1, task.inside });
+	}
+	tasks.erase(tasks.begin(), tasks.begin() + head);
+}
+
+// Walk one subtree and call visit(object) for every object in or touching the frustum
+template<typename Visit>
+static void WalkBvh(const Bvh& bvh, const std::vector<Aabb>& objectBounds, const Frustum& frustum, BvhTask root,
+	std::vector<BvhTask>& stack, CullStats& stats, Visit visit)
+{
+	stack.clear();
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		BvhTask task = stack.back();
+		stack.pop_back();
+		const BvhNode& node = bvh.nodes[task.node];
+
+		if (!task.inside)
+		{
+			stats.nodesTested++;
+			FrustumTest test = TestFrustumAabb(frustum, node.bounds);
+			if (test == FRUSTUM_OUTSIDE)
+				continue;
+			task.inside = test == FRUSTUM_INSIDE;
+		}
+
+		if (node.count)
+		{
+			//Objects in a leaf that straddles a plane get their own test
+			for (uint32_t i = node.first; i < node.first + node.count; i++)
+			{
+				uint32_t object = bvh.objectOrder[i];
+				if (!task.inside && node.count > 1)
+				{
+					stats.nodesTested++;
+					if (TestFrustumAabb(frustum, objectBounds[object]) == FRUSTUM_OUTSIDE)
+						continue;
+				}
+				stats.visible++;
+				visit(object);
+			}
+		}
+		else
+		{
+			stack.push_back({ node.first + 1, task.inside });
+			stack.push_back({ node.first, task.inside });
+		}
+	}
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+// Dynamic resolution.
+// The scene is drawn into an offscreen color + depth target at a fraction of the output size (the
+// render scale) and then stretched over the output, either with a linear glBlitFramebuffer or a
+// full-screen pass that samples bilinearly and sharpens (an unsharp mask clamped to the local
+// neighbourhood so edges do not ring). The target is allocated at the full output size once, so
+// changing the scale only changes the viewport and never reallocates.
+// The scale follows the GPU time of the scene, measured with GL_TIMESTAMP pairs (they nest inside
+// other timer queries) read back a few frames later without waiting. The controller has hysteresis:
+// a few frames over budget scale down at once, proportionally to how far over they were, while
+// scaling up takes a long run of frames comfortably under budget, and times in between change
+// nothing. This keeps the scale from oscillating around the budget.
+
+#include <GLEW/glew.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+const int RESOLUTION_QUERY_FRAMES = 4;		//GPU times are read this many frames later
+const int RESOLUTION_DOWN_FRAMES = 3;		//frames over budget before scaling down
+const int RESOLUTION_UP_FRAMES = 30;		//frames under the lower threshold before scaling up
+const float RESOLUTION_UP_THRESHOLD = 0.8f;	//fraction of the budget a frame must stay under to count towards scaling up
+const float RESOLUTION_UP_STEP = 0.05f;
+const float RESOLUTION_MAX_DOWN_STEP = 0.2f;
+
+enum UpscaleMode
+{
+	UPSCALE_BLIT,		//glBlitFramebuffer with GL_LINEAR
+	UPSCALE_SHARPEN		//bilinear sample plus a clamped unsharp mask
+};
+
+struct DynamicResolution
+{
+	bool enabled = false;
+	double targetMs = 16.0;		//GPU time budget of the scene
+	float scale = 1.0f, minScale = 0.5f, maxScale = 1.0f;
+	UpscaleMode upscale = UPSCALE_SHARPEN;
+	float sharpness = 0.5f;
+
+	//Offscreen target at the output size, only the scaled corner is drawn into
+	GLuint fbo = 0, colorTexture = 0, depthBuffer = 0;
+	int width = 0, height = 0;
+	int renderWidth = 0, renderHeight = 0;	//of the frame being drawn
+
+	//Upscale pass
+	GLuint program = 0, vao = 0;
+	GLint renderScaleLoc = -1, texelSizeLoc = -1, sharpnessLoc = -1;
+
+	//Timestamp pairs of the last RESOLUTION_QUERY_FRAMES frames
+	GLuint queries[RESOLUTION_QUERY_FRAMES * 2];
+	uint64_t frame = 0;
+	double gpuMs = 0.0;		//latest measured scene time
+	int overFrames = 0, underFrames = 0;
+	uint32_t scaleChanges = 0;
+};
+
+// program is the sharpen pass (empty vertex input, "sceneColor", "renderScale", "texelSize" and
+// "sharpness" uniforms), 0 to upscale with a blit
+static void InitDynamicResolution(DynamicResolution& resolution, double targetMs, float minScale, GLuint program, float sharpness)
+{
+	resolution.enabled = true;
+	resolution.targetMs = targetMs;
+	resolution.minScale = minScale;
+	resolution.scale = 1.0f;
+	resolution.upscale = program ? UPSCALE_SHARPEN : UPSCALE_BLIT;
+	resolution.sharpness = sharpness;
+	resolution.program = program;
+	glGenQueries(RESOLUTION_QUERY_FRAMES * 2, resolution.queries);
+	if (program)
+	{
+		resolution.renderScaleLoc = glGetUniformLocation(program, "renderScale");
+		resolution.texelSizeLoc = glGetUniformLocation(program, "texelSize");
+		resolution.sharpnessLoc = glGetUniformLocation(program, "sharpness");
+		glUseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "sceneColor"), 0);
+		glUseProgram(0);
+		glGenVertexArrays(1, &resolution.vao); //core profile draws need a VAO even without attributes
+	}
+}
+
+// (Re)allocate the offscreen target when the output size changes
+static bool ResizeDynamicResolution(DynamicResolution& resolution, int width, int height)
+{
+	if (resolution.fbo && resolution.width == width && resolution.height == height)
+		return true;
+
+	if (!resolution.fbo)
+	{
+		glGenFramebuffers(1, &resolution.fbo);
+		glGenTextures(1, &resolution.colorTexture);
+		glGenRenderbuffers(1, &resolution.depthBuffer);
+	}
+	resolution.width = width;
+	resolution.height = height;
+
+	glBindTexture(GL_TEXTURE_2D, resolution.colorTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindRenderbuffer(GL_RENDERBUFFER, resolution.depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	GLint previousFramebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, resolution.colorTexture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, resolution.depthBuffer);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	return complete;
+}
+
+// Move the scale towards the budget, with hysteresis (see the top of the file)
+static void UpdateRenderScale(DynamicResolution& resolution, double gpuMs)
+{
+	float previous = resolution.scale;
+	if (gpuMs > resolution.targetMs)
+	{
+		resolution.underFrames = 0;
+		if (++resolution.overFrames >= RESOLUTION_DOWN_FRAMES)
+		{
+			//GPU time goes with the pixel count, the square of the scale
+			float wanted = resolution.scale * (float)std::sqrt(resolution.targetMs / gpuMs);
+			resolution.scale = std::max(wanted, resolution.scale - RESOLUTION_MAX_DOWN_STEP);
+			resolution.overFrames = 0;
+		}
+	}
+	else if (gpuMs < resolution.targetMs * RESOLUTION_UP_THRESHOLD)
+	{
+		resolution.overFrames = 0;
+		if (++resolution.underFrames >= RESOLUTION_UP_FRAMES)
+		{
+			resolution.scale += RESOLUTION_UP_STEP;
+			resolution.underFrames = 0;
+		}
+	}
+	else
+		resolution.overFrames = resolution.underFrames = 0;
+
+	resolution.scale = std::min(std::max(resolution.scale, resolution.minScale), resolution.maxScale);
+	if (resolution.scale != previous)
+		resolution.scaleChanges++;
+}
+
+// Start a frame: read back the GPU time of an earlier frame if it is ready, adjust the scale,
+// bind the offscreen target and return the size to draw the scene at
+static void BeginDynamicResolutionFrame(DynamicResolution& resolution, int& renderWidth, int& renderHeight)
+{
+	uint32_t slot = (uint32_t)(resolution.frame % RESOLUTION_QUERY_FRAMES);
+	if (resolution.frame >= RESOLUTION_QUERY_FRAMES)
+	{
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(resolution.queries[slot * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(resolution.queries[slot * 2], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(resolution.queries[slot * 2 + 1], GL_QUERY_RESULT, &end);
+			resolution.gpuMs = (double)(end - begin) / 1.0e6;
+			UpdateRenderScale(resolution, resolution.gpuMs);
+		}
+	}
+
+	resolution.renderWidth = renderWidth = std::max(1, (int)(resolution.width * resolution.scale + 0.5f));
+	resolution.renderHeight = renderHeight = std::max(1, (int)(resolution.height * resolution.scale + 0.5f));
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution.fbo);
+	glQueryCounter(resolution.queries[slot * 2], GL_TIMESTAMP);
+}
+
+// Finish a frame: stop timing and stretch the drawn corner over the output framebuffer
+static void EndDynamicResolutionFrame(DynamicResolution& resolution, GLuint outputFramebuffer)
+{
+	uint32_t slot = (uint32_t)(resolution.frame % RESOLUTION_QUERY_FRAMES);
+	glQueryCounter(resolution.queries[slot * 2 + 1], GL_TIMESTAMP);
+	resolution.frame++;
+
+	//At full scale the blit is an exact copy, so the frame looks the same as without dynamic resolution
+	bool fullSize = resolution.renderWidth == resolution.width && resolution.renderHeight == resolution.height;
+	if (resolution.upscale == UPSCALE_BLIT || fullSize)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, resolution.fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, outputFramebuffer);
+		glBlitFramebuffer(0, 0, resolution.renderWidth, resolution.renderHeight, 0, 0, resolution.width, resolution.height,
+			GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, outputFramebuffer);
+		return;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, outputFramebuffer);
+	glViewport(0, 0, resolution.width, resolution.height);
+	glDisable(GL_DEPTH_TEST);
+	glUseProgram(resolution.program);
+	glUniform2f(resolution.renderScaleLoc, (float)resolution.renderWidth / resolution.width, (float)resolution.renderHeight / resolution.height);
+	glUniform2f(resolution.texelSizeLoc, 1.0f / resolution.width, 1.0f / resolution.height);
+	glUniform1f(resolution.sharpnessLoc, resolution.sharpness);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, resolution.colorTexture);
+	glBindVertexArray(resolution.vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+	glEnable(GL_DEPTH_TEST);
+}
+
+static void DestroyDynamicResolution(DynamicResolution& resolution)
+{
+	if (resolution.enabled)
+		glDeleteQueries(RESOLUTION_QUERY_FRAMES * 2, resolution.queries);
+	if (resolution.fbo)
+	{
+		glDeleteFramebuffers(1, &resolution.fbo);
+		glDeleteTextures(1, &resolution.colorTexture);
+		glDeleteRenderbuffers(1, &resolution.depthBuffer);
+	}
+	if (resolution.program)
+	{
+		glDeleteProgram(resolution.program);
+		glDeleteVertexArrays(1, &resolution.vao);
+	}
+	resolution = DynamicResolution();
+}
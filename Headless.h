@@ -0,0 +1,260 @@
+#pragma once
+
+// Headless (offscreen) rendering support.
+// Creates an OpenGL context without a window so the scene can be rendered and benchmarked
+// on machines with no display or GPU (e.g. Mesa llvmpipe on CI boxes and render servers).
+//
+// Backends:
+//   HEADLESS_OSMESA defined -> OSMesa (software, no display server needed)
+//   _WIN32                  -> hidden GLFW window (EGL is not generally available on Windows)
+//   otherwise               -> EGL with the surfaceless/pbuffer platform
+
+#include <GLEW/glew.h>
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(HEADLESS_OSMESA)
+#include <GL/osmesa.h>
+#elif !defined(_WIN32)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+//Offscreen context handles for whichever backend was compiled in
+struct HeadlessContext
+{
+#if defined(HEADLESS_OSMESA)
+	OSMesaContext context = nullptr;
+	std::vector<unsigned char> colorBuffer; //OSMesa needs client memory to bind, the scene renders to the FBO
+#elif defined(_WIN32)
+	GLFWwindow* window = nullptr;
+#else
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+#endif
+	const char* backend = "none";
+};
+
+//Framebuffer object the headless frames are drawn into
+struct OffscreenTarget
+{
+	GLuint fbo = 0, colorRBO = 0, depthRBO = 0;
+	int width = 0, height = 0;
+};
+
+//min/avg/p99 summary of a series of frame times (milliseconds)
+struct FrameTimeSummary
+{
+	double min = 0.0, avg = 0.0, p99 = 0.0;
+};
+
+// Create a context with no visible window and make it current
+static bool CreateHeadlessContext(HeadlessContext& ctx)
+{
+#if defined(HEADLESS_OSMESA)
+	const int attribs[] = {
+		OSMESA_FORMAT, OSMESA_RGBA,
+		OSMESA_DEPTH_BITS, 24,
+		OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+		OSMESA_CONTEXT_MAJOR_VERSION, 3,
+		OSMESA_CONTEXT_MINOR_VERSION, 3,
+		0
+	};
+	ctx.context = OSMesaCreateContextAttribs(attribs, NULL);
+	if (!ctx.context)
+		return false;
+
+	//the default framebuffer is never presented, so a 1x1 buffer is enough
+	ctx.colorBuffer.resize(4);
+	if (!OSMesaMakeCurrent(ctx.context, ctx.colorBuffer.data(), GL_UNSIGNED_BYTE, 1, 1))
+		return false;
+
+	ctx.backend = "osmesa";
+	return true;
+#elif defined(_WIN32)
+	if (!glfwInit())
+		return false;
+
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	ctx.window = glfwCreateWindow(1, 1, "Headless", NULL, NULL);
+	if (!ctx.window)
+		return false;
+
+	glfwMakeContextCurrent(ctx.window);
+	ctx.backend = "glfw-hidden";
+	return true;
+#else
+	//Prefer the Mesa surfaceless platform, it works with no X server and no GPU
+#if defined(EGL_PLATFORM_SURFACELESS_MESA)
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+	if (ctx.display == EGL_NO_DISPLAY)
+		ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, NULL, NULL))
+		return false;
+
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	if (!eglChooseConfig(ctx.display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+		return false;
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+		return false;
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, contextAttribs);
+	if (ctx.context == EGL_NO_CONTEXT)
+		return false;
+
+	//Scene renders into an FBO, a pbuffer is only needed when surfaceless contexts are unsupported
+	if (!eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx.context))
+	{
+		const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		ctx.surface = eglCreatePbufferSurface(ctx.display, config, pbufferAttribs);
+		if (ctx.surface == EGL_NO_SURFACE || !eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context))
+			return false;
+	}
+
+	ctx.backend = "egl";
+	return true;
+#endif
+}
+
+static void DestroyHeadlessContext(HeadlessContext& ctx)
+{
+#if defined(HEADLESS_OSMESA)
+	if (ctx.context)
+		OSMesaDestroyContext(ctx.context);
+	ctx.context = nullptr;
+#elif defined(_WIN32)
+	if (ctx.window)
+		glfwDestroyWindow(ctx.window);
+	ctx.window = nullptr;
+	glfwTerminate();
+#else
+	if (ctx.display != EGL_NO_DISPLAY)
+	{
+		eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (ctx.surface != EGL_NO_SURFACE)
+			eglDestroySurface(ctx.display, ctx.surface);
+		if (ctx.context != EGL_NO_CONTEXT)
+			eglDestroyContext(ctx.display, ctx.context);
+		eglTerminate(ctx.display);
+	}
+	ctx.display = EGL_NO_DISPLAY;
+	ctx.context = EGL_NO_CONTEXT;
+	ctx.surface = EGL_NO_SURFACE;
+#endif
+}
+
+// Create color and depth renderbuffers at the requested resolution and attach them to an FBO
+static bool CreateOffscreenTarget(OffscreenTarget& target, int targetWidth, int targetHeight)
+{
+	target.width = targetWidth;
+	target.height = targetHeight;
+
+	glGenRenderbuffers(1, &target.colorRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.colorRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, targetWidth, targetHeight);
+
+	glGenRenderbuffers(1, &target.depthRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.depthRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, targetWidth, targetHeight);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &target.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.colorRBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depthRBO);
+
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	return complete; //left bound so the scene draws into it
+}
+
+static void DestroyOffscreenTarget(OffscreenTarget& target)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &target.fbo);
+	glDeleteRenderbuffers(1, &target.colorRBO);
+	glDeleteRenderbuffers(1, &target.depthRBO);
+	target = OffscreenTarget();
+}
+
+// Reduce a series of frame times to min/avg/p99
+static FrameTimeSummary SummarizeFrameTimes(std::vector<double> samples)
+{
+	FrameTimeSummary summary;
+	if (samples.empty())
+		return summary;
+
+	std::sort(samples.begin(), samples.end());
+	double total = 0.0;
+	for (double s : samples)
+		total += s;
+
+	//nearest-rank percentile
+	size_t p99Index = (size_t)(0.99 * (double)(samples.size() - 1) + 0.5);
+
+	summary.min = samples.front();
+	summary.avg = total / (double)samples.size();
+	summary.p99 = samples[p99Index];
+	return summary;
+}
+
+static std::string FrameTimeSummaryJson(const FrameTimeSummary& summary)
+{
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "{\"min\":%.4f,\"avg\":%.4f,\"p99\":%.4f}", summary.min, summary.avg, summary.p99);
+	return buffer;
+}
+
+// Read back the bound framebuffer and write it as a binary PPM (bottom-up rows flipped)
+static bool SaveFramebufferPPM(const std::string& path, int imageWidth, int imageHeight)
+{
+	std::vector<unsigned char> pixels((size_t)imageWidth * imageHeight * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, imageWidth, imageHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "P6\n%d %d\n255\n", imageWidth, imageHeight);
+	for (int row = imageHeight - 1; row >= 0; row--)
+		fwrite(&pixels[(size_t)row * imageWidth * 3], 1, (size_t)imageWidth * 3, file);
+	fclose(file);
+	return true;
+}
+
+// Escape a driver string for embedding in JSON output
+static std::string JsonEscape(const char* text)
+{
+	std::string escaped;
+	for (const char* c = text ? text : ""; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			escaped += '\\';
+		if ((unsigned char)*c >= 0x20)
+			escaped += *c;
+	}
+	return escaped;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// Input events passed from the window thread to the render thread.
+// GLFW delivers input on the thread that polls for events; the callbacks only stamp each event
+// with the time it arrived and push it into a single-producer single-consumer ring, so neither
+// side ever holds a lock over the ring. The render thread drains the ring and hands the events to
+// the camera simulation, which replays them in fixed time steps. When the render thread has
+// nothing to draw it can sleep until the next event arrives; the producer only touches the mutex
+// when the consumer has said it is sleeping.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+enum InputEventType
+{
+	INPUT_KEY,			//code = key, action = GLFW_PRESS/RELEASE/REPEAT
+	INPUT_MOUSE_BUTTON,	//code = button, action
+	INPUT_CURSOR,		//x, y = cursor position
+	INPUT_SCROLL,		//x, y = scroll offsets
+	INPUT_RESIZE,		//code, action = new framebuffer width and height
+	INPUT_REFRESH		//window contents need drawing again
+};
+
+struct InputEvent
+{
+	InputEventType type;
+	double time;	//glfwGetTime() when the event arrived
+	int code, action;
+	double x, y;
+};
+
+const size_t INPUT_QUEUE_CAPACITY = 1024;	//power of two, events beyond it are dropped
+
+struct InputQueue
+{
+	InputEvent events[INPUT_QUEUE_CAPACITY];
+	alignas(64) std::atomic<size_t> head;	//next event to read, written by the consumer only
+	alignas(64) std::atomic<size_t> tail;	//next slot to write, written by the producer only
+	std::atomic<uint32_t> dropped;			//events lost to a full ring
+	std::atomic<bool> closed;				//the producer has stopped, consumers should not wait
+	std::atomic<bool> sleeping;				//the consumer is in (or entering) WaitForInput
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+};
+
+static void InitInputQueue(InputQueue& queue)
+{
+	queue.head = 0;
+	queue.tail = 0;
+	queue.dropped = 0;
+	queue.closed = false;
+	queue.sleeping = false;
+}
+
+// Producer side, never waits for the consumer: a full ring drops the event
+static bool PushInputEvent(InputQueue& queue, const InputEvent& event)
+{
+	size_t tail = queue.tail.load(std::memory_order_relaxed);
+	if (tail - queue.head.load(std::memory_order_acquire) >= INPUT_QUEUE_CAPACITY)
+	{
+		queue.dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	queue.events[tail & (INPUT_QUEUE_CAPACITY - 1)] = event;
+	queue.tail.store(tail + 1, std::memory_order_release);
+
+	//Either the consumer's check after raising sleeping sees this event, or this sees sleeping set.
+	//Taking the lock then orders the wake-up after the consumer started waiting.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue.sleeping.load(std::memory_order_relaxed))
+	{
+		{
+			std::lock_guard<std::mutex> lock(queue.sleepMutex);
+		}
+		queue.wake.notify_one();
+	}
+	return true;
+}
+
+// Consumer side, returns false when the ring is empty
+static bool PopInputEvent(InputQueue& queue, InputEvent& event)
+{
+	size_t head = queue.head.load(std::memory_order_relaxed);
+	if (head == queue.tail.load(std::memory_order_acquire))
+		return false;
+	event = queue.events[head & (INPUT_QUEUE_CAPACITY - 1)];
+	queue.head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+static bool InputQueueEmpty(const InputQueue& queue)
+{
+	return queue.head.load(std::memory_order_relaxed) == queue.tail.load(std::memory_order_acquire);
+}
+
+// Consumer side: sleep until an event is queued, the queue is closed or seconds pass
+static void WaitForInput(InputQueue& queue, double seconds)
+{
+	std::unique_lock<std::mutex> lock(queue.sleepMutex);
+	queue.sleeping.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	queue.wake.wait_for(lock, std::chrono::duration<double>(seconds), [&] { return queue.closed || !InputQueueEmpty(queue); });
+	queue.sleeping.store(false, std::memory_order_relaxed);
+}
+
+// Producer side: no more events will come, wake the consumer if it is sleeping
+static void CloseInputQueue(InputQueue& queue)
+{
+	std::lock_guard<std::mutex> lock(queue.sleepMutex);
+	queue.closed = true;
+	queue.wake.notify_one();
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+// Instanced stress scene.
+// Several meshes are each drawn with a single glDrawElementsInstancedBaseVertex, however many
+// copies of them there are. Every instance's model matrix, normal matrix and material selector come
+// from one static instance buffer: per mesh it holds an array of model matrices, one of normal
+// matrices and one of selectors, and the mesh's VAO points per-instance attributes (divisor 1) at
+// its three arrays. The matrices are built by the batched transform kernels in chunks, written
+// straight into the mapped buffer. A selector indexes a small table of texture array layers the
+// instanced program gets every frame, so any instance can use any scene texture without a draw of
+// its own. Instances fill a lattice over the desk, mixing the meshes cell by cell; they are not
+// culled, animated or drawn into the shadow maps.
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "BatchTransform.h"
+#include "MeshRegistry.h"
+#include "VertexFormat.h"
+
+const size_t INSTANCE_BUILD_CHUNK = 4096;	//instances placed and transformed per batch kernel call
+const size_t INSTANCE_BYTES = sizeof(glm::mat4) + sizeof(glm::mat3) + sizeof(GLuint);
+const glm::vec3 INSTANCE_REGION_MIN(-15.0f, -2.0f, -15.0f);	//box the lattice fills
+const glm::vec3 INSTANCE_REGION_SIZE(30.0f, 6.0f, 30.0f);
+const GLfloat INSTANCE_CELL_FILL = 0.8f;	//fraction of a lattice cell an instance's longest side takes
+
+//One instanced mesh; its instances' arrays follow each other in the instance buffer
+struct InstanceBatch
+{
+	MeshHandle mesh;
+	glm::vec3 shape;	//non-uniform scale applied before the mesh is fitted into its cell
+	GLuint vao = 0;
+	size_t firstByte = 0;
+};
+
+struct InstanceBatches
+{
+	GLuint buffer = 0;
+	std::vector<InstanceBatch> batches;
+	size_t perBatch = 0;	//instances of every mesh
+	size_t bufferBytes = 0;
+	double buildMs = 0.0;	//placing, transforming and uploading the last build
+};
+
+static void AddInstanceBatch(InstanceBatches& instances, MeshHandle mesh, const glm::vec3& shape)
+{
+	InstanceBatch batch;
+	batch.mesh = mesh;
+	batch.shape = shape;
+	instances.batches.push_back(batch);
+}
+
+static size_t InstanceCount(const InstanceBatches& instances)
+{
+	return instances.perBatch * instances.batches.size();
+}
+
+// Triangles drawn per frame by all instances
+static size_t InstanceTriangles(const InstanceBatches& instances, const MeshRegistry& registry)
+{
+	size_t triangles = 0;
+	for (const InstanceBatch& batch : instances.batches)
+		triangles += (size_t)registry.meshes[batch.mesh].indexCount / 3;
+	return triangles * instances.perBatch;
+}
+
+// Cell c of the lattice holds instance c / batchCount of batch c % batchCount, so the meshes mix
+// evenly at any count. Cells are as close to cubes as the region allows.
+static void InstanceLattice(size_t total, size_t cells[3], glm::vec3& step)
+{
+	GLfloat side = std::cbrt(INSTANCE_REGION_SIZE.x * INSTANCE_REGION_SIZE.y * INSTANCE_REGION_SIZE.z / (GLfloat)std::max(total, (size_t)1));
+	for (int axis = 0; axis < 3; axis++)
+		cells[axis] = std::max((size_t)1, (size_t)std::ceil(INSTANCE_REGION_SIZE[axis] / side));
+	while (cells[0] * cells[1] * cells[2] < total)
+		cells[0]++; //rounding
+	step = INSTANCE_REGION_SIZE / glm::vec3((GLfloat)cells[0], (GLfloat)cells[1], (GLfloat)cells[2]);
+}
+
+// Free the buffer and VAOs, keeping the batch list for the next build
+static void ReleaseInstanceBuffers(InstanceBatches& instances)
+{
+	for (InstanceBatch& batch : instances.batches)
+	{
+		if (batch.vao)
+			glDeleteVertexArrays(1, &batch.vao);
+		batch.vao = 0;
+	}
+	if (instances.buffer)
+		glDeleteBuffers(1, &instances.buffer);
+	instances.buffer = 0;
+	instances.perBatch = 0;
+	instances.bufferBytes = 0;
+}
+
+// (Re)build perBatch instances of every batch. Selectors run 0..materialCount-1. The VAOs read
+// the meshes from the registry's buffers. Returns false if the buffer could not be allocated, in
+// which case no instances are left.
+static bool BuildInstances(InstanceBatches& instances, const MeshRegistry& registry, size_t perBatch, GLuint materialCount)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	ReleaseInstanceBuffers(instances);
+	if (perBatch == 0 || instances.batches.empty())
+		return true;
+
+	size_t batchCount = instances.batches.size();
+	size_t total = perBatch * batchCount;
+	instances.bufferBytes = total * INSTANCE_BYTES;
+	glGenBuffers(1, &instances.buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instances.buffer);
+	glGetError();
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)instances.bufferBytes, nullptr, GL_STATIC_DRAW);
+	unsigned char* mapped = glGetError() == GL_NO_ERROR ? (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+		(GLsizeiptr)instances.bufferBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT) : nullptr;
+	if (!mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		ReleaseInstanceBuffers(instances);
+		return false;
+	}
+	instances.perBatch = perBatch;
+
+	size_t cells[3];
+	glm::vec3 step;
+	InstanceLattice(total, cells, step);
+	GLfloat cellSide = std::min(step.x, std::min(step.y, step.z));
+
+	std::vector<glm::vec3> positions(INSTANCE_BUILD_CHUNK), scales(INSTANCE_BUILD_CHUNK);
+	std::vector<glm::quat> rotations(INSTANCE_BUILD_CHUNK);
+	for (size_t b = 0; b < batchCount; b++)
+	{
+		InstanceBatch& batch = instances.batches[b];
+		batch.firstByte = b * perBatch * INSTANCE_BYTES;
+		glm::mat4* models = (glm::mat4*)(mapped + batch.firstByte);
+		glm::mat3* normals = (glm::mat3*)(mapped + batch.firstByte + perBatch * sizeof(glm::mat4));
+		GLuint* selectors = (GLuint*)(mapped + batch.firstByte + perBatch * (sizeof(glm::mat4) + sizeof(glm::mat3)));
+
+		//Fit the shaped mesh into a cell and centre it there
+		const Aabb& bounds = registry.bounds[batch.mesh];
+		glm::vec3 extent = (bounds.max - bounds.min) * batch.shape;
+		glm::vec3 scale = batch.shape * (cellSide * INSTANCE_CELL_FILL / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f)));
+		glm::vec3 center = (bounds.min + bounds.max) * 0.5f * scale;
+
+		for (size_t first = 0; first < perBatch; first += INSTANCE_BUILD_CHUNK)
+		{
+			size_t count = std::min(INSTANCE_BUILD_CHUNK, perBatch - first);
+			for (size_t i = 0; i < count; i++)
+			{
+				size_t cell = (first + i) * batchCount + b;
+				glm::vec3 cellCenter = INSTANCE_REGION_MIN + step * (glm::vec3((GLfloat)(cell % cells[0]),
+					(GLfloat)(cell / (cells[0] * cells[2])), (GLfloat)(cell / cells[0] % cells[2])) + 0.5f);
+				//Golden angle turns, so neighbours never face the same way
+				rotations[i] = glm::angleAxis(std::fmod((GLfloat)cell * 2.39996323f, 6.28318531f), glm::vec3(0.0f, 1.0f, 0.0f));
+				positions[i] = cellCenter - rotations[i] * center;
+				scales[i] = scale;
+				selectors[first + i] = (GLuint)(((uint32_t)cell * 2654435761u) >> 16) % materialCount;
+			}
+			BatchTransforms(positions.data(), rotations.data(), scales.data(), count, models + first, normals + first);
+		}
+	}
+	bool uploaded = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE; //false if the store was lost while mapped
+
+	//Mesh vertices per vertex, instance arrays per instance from this batch's part of the buffer
+	for (InstanceBatch& batch : instances.batches)
+	{
+		glGenVertexArrays(1, &batch.vao);
+		glBindVertexArray(batch.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, registry.vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, registry.ebo);
+		ApplyVertexLayout(packedVertexLayout);
+		glBindBuffer(GL_ARRAY_BUFFER, instances.buffer);
+		ApplyVertexLayout(instanceModelLayout, batch.firstByte);
+		ApplyVertexLayout(instanceNormalLayout, batch.firstByte + perBatch * sizeof(glm::mat4));
+		ApplyVertexLayout(instanceMaterialLayout, batch.firstByte + perBatch * (sizeof(glm::mat4) + sizeof(glm::mat3)));
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	instances.buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	if (!uploaded)
+		ReleaseInstanceBuffers(instances);
+	return uploaded;
+}
+
+static void DestroyInstanceBatches(InstanceBatches& instances)
+{
+	ReleaseInstanceBuffers(instances);
+	instances = InstanceBatches();
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+// Persistent worker threads for data-parallel loops.
+// ParallelFor hands out indices to the workers and the calling thread (which always takes part
+// as worker 0) and returns once every index has run, so per-frame work can be split across cores
+// without creating threads each frame. The loop body is passed to the workers as a plain function
+// pointer and a pointer to the caller's lambda, so starting a batch never allocates.
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct JobPool
+{
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	void (*task)(const void* body, size_t index, unsigned worker) = nullptr;	//runs one index of the batch
+	const void* taskBody = nullptr;	//the ParallelFor caller's loop body
+	size_t taskCount = 0;
+	std::atomic<size_t> nextTask;
+	unsigned generation = 0;	//bumped once per batch so sleeping workers know there is new work
+	unsigned running = 0;		//workers that have not finished the current batch
+	bool stopping = false;
+};
+
+// Take indices from the current batch until it is exhausted
+static void RunJobs(JobPool& pool, unsigned worker)
+{
+	for (;;)
+	{
+		size_t index = pool.nextTask.fetch_add(1);
+		if (index >= pool.taskCount)
+			return;
+		pool.task(pool.taskBody, index, worker);
+	}
+}
+
+static void JobPoolWorker(JobPool* pool, unsigned worker)
+{
+	unsigned seenGeneration = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [&] { return pool->stopping || pool->generation != seenGeneration; });
+			if (pool->stopping)
+				return;
+			seenGeneration = pool->generation;
+		}
+
+		RunJobs(*pool, worker);
+
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		if (--pool->running == 0)
+			pool->finished.notify_one();
+	}
+}
+
+// Start threadCount - 1 workers; the thread calling ParallelFor is the last one
+static void InitJobPool(JobPool& pool, unsigned threadCount)
+{
+	pool.nextTask = 0;
+	pool.generation = 0; //new workers start out having seen generation 0, also after a DestroyJobPool
+	pool.running = 0;
+	for (unsigned i = 1; i < threadCount; i++)
+		pool.workers.push_back(std::thread(JobPoolWorker, &pool, i));
+}
+
+// Threads a batch is spread over, for sizing per-worker scratch data
+static unsigned JobPoolThreadCount(const JobPool& pool)
+{
+	return (unsigned)pool.workers.size() + 1;
+}
+
+template <typename Body>
+static void RunParallelForBody(const void* body, size_t index, unsigned worker)
+{
+	(*(const Body*)body)(index, worker);
+}
+
+// Run task(index, worker) for every index in [0, count) and wait for all of them
+template <typename Body>
+static void ParallelFor(JobPool& pool, size_t count, const Body& task)
+{
+	if (pool.workers.empty() || count <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.task = RunParallelForBody<Body>;
+		pool.taskBody = &task;
+		pool.taskCount = count;
+		pool.nextTask = 0;
+		pool.running = (unsigned)pool.workers.size();
+		pool.generation++;
+	}
+	pool.wake.notify_all();
+
+	RunJobs(pool, 0);
+
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.finished.wait(lock, [&] { return pool.running == 0; });
+	pool.task = nullptr;
+	pool.taskBody = nullptr;
+}
+
+static void DestroyJobPool(JobPool& pool)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.stopping = true;
+	}
+	pool.wake.notify_all();
+	for (std::thread& worker : pool.workers)
+		worker.join();
+	pool.workers.clear();
+	pool.stopping = false;
+}
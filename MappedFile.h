@@ -0,0 +1,143 @@
+#pragma once
+
+// Read-only memory-mapped files.
+// The OS pages file contents in on demand, so cached assets can be handed straight to GL
+// (or read in place) without first copying them into a heap buffer. Cache files are written
+// through WriteFileReplacing, so a file that can be mapped is never a half-written one.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct MappedFile
+{
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+#if defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+};
+
+// Map a whole file for reading, returns false (and leaves file empty) if it cannot be opened
+static bool MapFile(const std::string& path, MappedFile& file)
+{
+	file = MappedFile();
+#if defined(_WIN32)
+	file.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file.file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file.file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file.file);
+		file = MappedFile();
+		return false;
+	}
+
+	file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (file.mapping)
+		file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!file.data)
+	{
+		if (file.mapping)
+			CloseHandle(file.mapping);
+		CloseHandle(file.file);
+		file = MappedFile();
+		return false;
+	}
+	file.size = (size_t)fileSize.QuadPart;
+	return true;
+#else
+	int descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(descriptor, &info) != 0 || info.st_size == 0)
+	{
+		close(descriptor);
+		return false;
+	}
+
+	void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor); //the mapping keeps its own reference to the file
+	if (data == MAP_FAILED)
+		return false;
+
+	file.data = (const unsigned char*)data;
+	file.size = (size_t)info.st_size;
+	return true;
+#endif
+}
+
+static void UnmapFile(MappedFile& file)
+{
+#if defined(_WIN32)
+	if (file.data)
+		UnmapViewOfFile(file.data);
+	if (file.mapping)
+		CloseHandle(file.mapping);
+	if (file.file != INVALID_HANDLE_VALUE)
+		CloseHandle(file.file);
+#else
+	if (file.data)
+		munmap((void*)file.data, file.size);
+#endif
+	file = MappedFile();
+}
+
+// 64-bit FNV-1a, used to key cached assets on the exact bytes of their source file
+static uint64_t HashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hash a file's contents, returns false if it cannot be read
+static bool HashFile(const std::string& path, uint64_t& hash)
+{
+	MappedFile file;
+	if (!MapFile(path, file))
+		return false;
+	hash = HashBytes(file.data, file.size);
+	UnmapFile(file);
+	return true;
+}
+
+// Write size bytes to a temporary file next to path and move it over path, so a failed or
+// interrupted write never leaves a truncated file behind; returns false if anything failed
+static bool WriteFileReplacing(const std::string& path, const void* data, size_t size)
+{
+	std::string temporaryPath = path + ".tmp";
+	FILE* output = fopen(temporaryPath.c_str(), "wb");
+	if (!output)
+		return false;
+	bool written = fwrite(data, 1, size, output) == size;
+	written = fclose(output) == 0 && written;
+
+	remove(path.c_str()); //rename does not replace an existing file on Windows
+	if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+	{
+		remove(temporaryPath.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+// Binary mesh files.
+// A ".mesh" file holds one mesh ready for the GPU: a fixed-size header (format version, vertex
+// layout, counts, index type and bounds) followed by the vertex and index blobs, each starting
+// on a MESH_FILE_ALIGNMENT boundary. Vertices are PackedVertex and indices are 16-bit unless the
+// mesh has more than 65536 vertices, exactly as the mesh registry stores them, so loading maps
+// the file and uploads both blobs straight from the mapping with no parsing or copying.
+// Files are written by the OBJ converter (--convert-obj).
+
+#include <GLEW/glew.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+#include "MeshRegistry.h"
+#include "VertexFormat.h"
+
+const uint32_t MESH_FILE_MAGIC = 0x4853454D; //"MESH"
+const uint32_t MESH_FILE_VERSION = 1;
+const uint32_t MESH_FILE_MAX_ATTRIBUTES = 4;
+const size_t MESH_FILE_ALIGNMENT = 64;
+
+struct MeshFileAttribute
+{
+	uint32_t location, size, type, normalized, offset;
+};
+
+//Fixed-size header at the start of every mesh file
+struct MeshFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexStride;
+	uint32_t attributeCount;
+	MeshFileAttribute attributes[MESH_FILE_MAX_ATTRIBUTES];
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t indexType;		//GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	uint32_t reserved;
+	float boundsMin[3], boundsMax[3];
+	uint64_t vertexOffset, vertexBytes;	//from the start of the file
+	uint64_t indexOffset, indexBytes;
+};
+
+static size_t AlignMeshOffset(size_t offset)
+{
+	return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+}
+
+// Whether the file's vertex layout is the one the mesh registry draws with
+static bool MeshFileLayoutMatches(const MeshFileHeader& header)
+{
+	if (header.vertexStride != sizeof(PackedVertex) || header.attributeCount != packedVertexLayout.attributeCount)
+		return false;
+	for (uint32_t i = 0; i < header.attributeCount; i++)
+	{
+		const MeshFileAttribute& stored = header.attributes[i];
+		const VertexAttribute& expected = packedVertexLayout.attributes[i];
+		if (stored.location != expected.location || stored.size != (uint32_t)expected.size || stored.type != expected.type
+			|| stored.normalized != expected.normalized || stored.offset != expected.offset)
+			return false;
+	}
+	return true;
+}
+
+// Write vertices and indices as a mesh file, replacing any earlier one only once it is complete
+static bool WriteMeshFile(const std::string& path, const std::vector<PackedVertex>& vertices, const std::vector<GLuint>& indices)
+{
+	MeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MESH_FILE_MAGIC;
+	header.version = MESH_FILE_VERSION;
+	header.vertexStride = sizeof(PackedVertex);
+	header.attributeCount = packedVertexLayout.attributeCount;
+	for (uint32_t i = 0; i < packedVertexLayout.attributeCount; i++)
+	{
+		const VertexAttribute& attribute = packedVertexLayout.attributes[i];
+		header.attributes[i] = { attribute.location, (uint32_t)attribute.size, attribute.type, attribute.normalized, attribute.offset };
+	}
+	header.vertexCount = (uint32_t)vertices.size();
+	header.indexCount = (uint32_t)indices.size();
+	header.indexType = MeshIndexType(vertices.size());
+
+	Aabb bounds = ComputeMeshBounds(vertices.data(), vertices.size());
+	memcpy(header.boundsMin, &bounds.min[0], sizeof(header.boundsMin));
+	memcpy(header.boundsMax, &bounds.max[0], sizeof(header.boundsMax));
+
+	header.vertexOffset = AlignMeshOffset(sizeof(MeshFileHeader));
+	header.vertexBytes = vertices.size() * sizeof(PackedVertex);
+	header.indexOffset = AlignMeshOffset(header.vertexOffset + header.vertexBytes);
+	header.indexBytes = indices.size() * IndexTypeSize(header.indexType);
+
+	std::vector<unsigned char> image(header.indexOffset + header.indexBytes);
+	memcpy(image.data(), &header, sizeof(header));
+	if (!vertices.empty())
+		memcpy(&image[header.vertexOffset], vertices.data(), header.vertexBytes);
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		if (header.indexType == GL_UNSIGNED_INT)
+			memcpy(&image[header.indexOffset + i * 4], &indices[i], 4);
+		else
+		{
+			GLushort index = (GLushort)indices[i];
+			memcpy(&image[header.indexOffset + i * 2], &index, 2);
+		}
+	}
+
+	return WriteFileReplacing(path, image.data(), image.size());
+}
+
+// Check that every blob lies inside the file and every index names a vertex
+static bool ValidateMeshFile(const MappedFile& file)
+{
+	if (file.size < sizeof(MeshFileHeader))
+		return false;
+	const MeshFileHeader* header = (const MeshFileHeader*)file.data;
+	if (header->magic != MESH_FILE_MAGIC || header->version != MESH_FILE_VERSION || !MeshFileLayoutMatches(*header))
+		return false;
+	if (header->indexType != MeshIndexType(header->vertexCount) || header->indexCount % 3 != 0)
+		return false;
+	if (header->vertexBytes != (uint64_t)header->vertexCount * sizeof(PackedVertex)
+		|| header->indexBytes != (uint64_t)header->indexCount * IndexTypeSize(header->indexType))
+		return false;
+	if (header->vertexOffset % MESH_FILE_ALIGNMENT || header->indexOffset % MESH_FILE_ALIGNMENT
+		|| header->vertexOffset + header->vertexBytes > file.size || header->indexOffset + header->indexBytes > file.size)
+		return false;
+
+	//An out of range index would read past the mesh on the GPU
+	const unsigned char* indices = file.data + header->indexOffset;
+	uint32_t largest = 0;
+	for (uint32_t i = 0; i < header->indexCount; i++)
+	{
+		uint32_t index = header->indexType == GL_UNSIGNED_INT ? ((const uint32_t*)indices)[i] : ((const uint16_t*)indices)[i];
+		largest = index > largest ? index : largest;
+	}
+	return header->indexCount == 0 || largest < header->vertexCount;
+}
+
+// Map a mesh file and upload it into the registry straight from the mapping.
+// Returns false, registering nothing, if the file is missing, from another version or damaged.
+static bool LoadMeshFile(MeshRegistry& registry, const std::string& path, MeshHandle& mesh)
+{
+	MappedFile file;
+	if (!MapFile(path, file))
+		return false;
+	if (!ValidateMeshFile(file))
+	{
+		UnmapFile(file);
+		return false;
+	}
+
+	const MeshFileHeader* header = (const MeshFileHeader*)file.data;
+	Aabb bounds;
+	bounds.min = glm::vec3(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]);
+	bounds.max = glm::vec3(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]);
+	mesh = UploadMeshDirect(registry, file.data + header->vertexOffset, header->vertexCount,
+		file.data + header->indexOffset, header->indexCount, header->indexType, bounds);
+	UnmapFile(file);
+	return true;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+// Mesh registry.
+// Every mesh is suballocated from one shared vertex buffer and one shared index buffer, so the
+// whole scene draws from a single VAO. Each mesh keeps its own draw descriptor (index count,
+// first index, base vertex, index type), and indices are 16-bit unless a mesh has more than
+// 65536 vertices, in which case it gets 32-bit indices.
+// Each mesh also keeps the axis-aligned box around its vertices, for culling.
+// Meshes whose data is already in GPU layout (mapped mesh files) skip the staging copy and are
+// uploaded straight from the caller's memory.
+// With optimizeMeshes set, registered meshes are welded and reordered first (MeshOptimizer.h).
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <cstring>
+#include <vector>
+
+#include "MeshOptimizer.h"
+#include "VertexFormat.h"
+
+//How to draw one mesh out of the shared buffers
+struct MeshDraw
+{
+	GLsizei indexCount;
+	GLuint firstIndex;	//in units of indexType from the start of the index buffer
+	GLint baseVertex;	//added to every index
+	GLenum indexType;	//GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+};
+
+//Axis-aligned bounding box
+struct Aabb
+{
+	glm::vec3 min, max;
+};
+
+typedef GLuint MeshHandle;
+
+struct MeshRegistry
+{
+	GLuint vbo = 0, ebo = 0, vao = 0;
+	std::vector<MeshDraw> meshes;
+	std::vector<Aabb> bounds;	//per mesh, in mesh space
+
+	//Data registered since the last upload
+	std::vector<PackedVertex> pendingVertices;
+	std::vector<unsigned char> pendingIndices;
+
+	//Bytes used on the GPU and allocated buffer sizes
+	size_t vertexBytes = 0, indexBytes = 0;
+	size_t vertexCapacity = 0, indexCapacity = 0;
+
+	bool optimizeMeshes = false;		//weld and reorder meshes as they are registered
+	MeshOptimizeStats optimizeStats;	//totals over every mesh optimized so far
+};
+
+static GLsizei IndexTypeSize(GLenum indexType)
+{
+	return indexType == GL_UNSIGNED_INT ? 4 : 2;
+}
+
+// Meshes with more vertices than 16-bit indices can address use 32-bit indices
+static GLenum MeshIndexType(size_t vertexCount)
+{
+	return vertexCount > 65536 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+}
+
+static Aabb ComputeMeshBounds(const PackedVertex* vertices, size_t vertexCount)
+{
+	Aabb bounds;
+	bounds.min = bounds.max = vertexCount ? glm::vec3(vertices[0].position[0], vertices[0].position[1], vertices[0].position[2]) : glm::vec3(0.0f);
+	for (size_t i = 1; i < vertexCount; i++)
+	{
+		glm::vec3 position(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2]);
+		bounds.min = glm::min(bounds.min, position);
+		bounds.max = glm::max(bounds.max, position);
+	}
+	return bounds;
+}
+
+// Stage a mesh exactly as given
+static MeshHandle StageMesh(MeshRegistry& registry, const PackedVertex* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount)
+{
+	MeshDraw draw;
+	draw.indexCount = (GLsizei)indexCount;
+	draw.indexType = MeshIndexType(vertexCount);
+	draw.baseVertex = (GLint)(registry.vertexBytes / sizeof(PackedVertex) + registry.pendingVertices.size());
+
+	//Keep each mesh's indices aligned to their own size inside the shared buffer
+	GLsizei indexSize = IndexTypeSize(draw.indexType);
+	size_t indexOffset = registry.indexBytes + registry.pendingIndices.size();
+	size_t padding = (indexSize - indexOffset % indexSize) % indexSize;
+	registry.pendingIndices.resize(registry.pendingIndices.size() + padding);
+	indexOffset += padding;
+	draw.firstIndex = (GLuint)(indexOffset / indexSize);
+
+	registry.pendingVertices.insert(registry.pendingVertices.end(), vertices, vertices + vertexCount);
+
+	size_t start = registry.pendingIndices.size();
+	registry.pendingIndices.resize(start + indexCount * indexSize);
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		if (draw.indexType == GL_UNSIGNED_INT)
+			memcpy(&registry.pendingIndices[start + i * 4], &indices[i], 4);
+		else
+		{
+			GLushort index = (GLushort)indices[i];
+			memcpy(&registry.pendingIndices[start + i * 2], &index, 2);
+		}
+	}
+
+	registry.meshes.push_back(draw);
+	registry.bounds.push_back(ComputeMeshBounds(vertices, vertexCount));
+	return (MeshHandle)(registry.meshes.size() - 1);
+}
+
+// Add a mesh to the registry; data reaches the GPU on the next UploadMeshRegistry
+static MeshHandle RegisterMesh(MeshRegistry& registry, const PackedVertex* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount)
+{
+	if (!registry.optimizeMeshes)
+		return StageMesh(registry, vertices, vertexCount, indices, indexCount);
+
+	std::vector<PackedVertex> optimizedVertices(vertices, vertices + vertexCount);
+	std::vector<GLuint> optimizedIndices(indices, indices + indexCount);
+	AddMeshOptimizeStats(registry.optimizeStats, OptimizeMesh(optimizedVertices, optimizedIndices));
+	return StageMesh(registry, optimizedVertices.data(), optimizedVertices.size(), optimizedIndices.data(), optimizedIndices.size());
+}
+
+// Authored meshes use byte indices
+static MeshHandle RegisterMesh(MeshRegistry& registry, const std::vector<PackedVertex>& vertices, const GLubyte* indices, size_t indexCount)
+{
+	std::vector<GLuint> wideIndices(indices, indices + indexCount);
+	return RegisterMesh(registry, vertices.data(), vertices.size(), wideIndices.data(), wideIndices.size());
+}
+
+static MeshHandle RegisterMesh(MeshRegistry& registry, const std::vector<PackedVertex>& vertices, const std::vector<GLuint>& indices)
+{
+	return RegisterMesh(registry, vertices.data(), vertices.size(), indices.data(), indices.size());
+}
+
+// Grow a buffer to hold at least required bytes, keeping the first usedBytes
+static void GrowBuffer(GLuint& buffer, size_t& capacity, size_t usedBytes, size_t required)
+{
+	if (required <= capacity)
+		return;
+
+	size_t newCapacity = capacity ? capacity : 64 * 1024;
+	while (newCapacity < required)
+		newCapacity *= 2;
+
+	GLuint newBuffer;
+	glGenBuffers(1, &newBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, nullptr, GL_STATIC_DRAW);
+	if (buffer && usedBytes)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedBytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	if (buffer)
+		glDeleteBuffers(1, &buffer);
+	buffer = newBuffer;
+	capacity = newCapacity;
+}
+
+// Point the shared VAO at the (possibly reallocated) shared buffers
+static void BindMeshRegistryArrays(MeshRegistry& registry)
+{
+	if (!registry.vao)
+		glGenVertexArrays(1, &registry.vao);
+
+	// VBO and EBO Placed in the shared VAO
+	glBindVertexArray(registry.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, registry.vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, registry.ebo);
+	ApplyVertexLayout(packedVertexLayout);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Copy pending meshes into the shared buffers and (re)build the shared VAO.
+// VAOs other than registry.vao that reference the buffers must be rebuilt if they grew.
+static void UploadMeshRegistry(MeshRegistry& registry)
+{
+	size_t newVertexBytes = registry.pendingVertices.size() * sizeof(PackedVertex);
+	size_t newIndexBytes = registry.pendingIndices.size();
+
+	GrowBuffer(registry.vbo, registry.vertexCapacity, registry.vertexBytes, registry.vertexBytes + newVertexBytes);
+	GrowBuffer(registry.ebo, registry.indexCapacity, registry.indexBytes, registry.indexBytes + newIndexBytes);
+
+	if (newVertexBytes)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, registry.vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, registry.vertexBytes, newVertexBytes, registry.pendingVertices.data());
+	}
+	if (newIndexBytes)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, registry.ebo);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, registry.indexBytes, newIndexBytes, registry.pendingIndices.data());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+
+	registry.vertexBytes += newVertexBytes;
+	registry.indexBytes += newIndexBytes;
+	registry.pendingVertices.clear();
+	registry.pendingVertices.shrink_to_fit();
+	registry.pendingIndices.clear();
+	registry.pendingIndices.shrink_to_fit();
+	BindMeshRegistryArrays(registry);
+}
+
+// Register a mesh whose vertices are PackedVertex and whose indices are already indexType, and
+// upload both directly from the given memory (a mapped mesh file) without staging a copy.
+// Meshes registered earlier but not yet uploaded are uploaded first so offsets stay in order.
+static MeshHandle UploadMeshDirect(MeshRegistry& registry, const void* vertices, size_t vertexCount,
+	const void* indices, size_t indexCount, GLenum indexType, const Aabb& bounds)
+{
+	if (!registry.pendingVertices.empty() || !registry.pendingIndices.empty())
+		UploadMeshRegistry(registry);
+
+	GLsizei indexSize = IndexTypeSize(indexType);
+	size_t indexOffset = (registry.indexBytes + indexSize - 1) / indexSize * indexSize;
+	size_t vertexBytes = vertexCount * sizeof(PackedVertex);
+	size_t indexBytes = indexCount * indexSize;
+
+	MeshDraw draw;
+	draw.indexCount = (GLsizei)indexCount;
+	draw.indexType = indexType;
+	draw.baseVertex = (GLint)(registry.vertexBytes / sizeof(PackedVertex));
+	draw.firstIndex = (GLuint)(indexOffset / indexSize);
+
+	GrowBuffer(registry.vbo, registry.vertexCapacity, registry.vertexBytes, registry.vertexBytes + vertexBytes);
+	GrowBuffer(registry.ebo, registry.indexCapacity, registry.indexBytes, indexOffset + indexBytes);
+
+	glBindBuffer(GL_ARRAY_BUFFER, registry.vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, registry.vertexBytes, vertexBytes, vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, registry.ebo);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset, indexBytes, indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	registry.vertexBytes += vertexBytes;
+	registry.indexBytes = indexOffset + indexBytes;
+	registry.meshes.push_back(draw);
+	registry.bounds.push_back(bounds);
+	BindMeshRegistryArrays(registry);
+	return (MeshHandle)(registry.meshes.size() - 1);
+}
+
+// Draw a mesh out of the shared buffers, the registry VAO (or one built on its buffers) must be bound
+static void DrawMesh(const MeshRegistry& registry, MeshHandle mesh)
+{
+	const MeshDraw& draw = registry.meshes[mesh];
+	GLsizei indexSize = IndexTypeSize(draw.indexType);
+	glDrawElementsBaseVertex(GL_TRIANGLES, draw.indexCount, draw.indexType,
+		(GLvoid*)((size_t)draw.firstIndex * indexSize), draw.baseVertex);
+}
+
+static void DrawMeshInstanced(const MeshRegistry& registry, MeshHandle mesh, GLsizei instanceCount)
+{
+	const MeshDraw& draw = registry.meshes[mesh];
+	GLsizei indexSize = IndexTypeSize(draw.indexType);
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, draw.indexCount, draw.indexType,
+		(GLvoid*)((size_t)draw.firstIndex * indexSize), instanceCount, draw.baseVertex);
+}
+
+static void DestroyMeshRegistry(MeshRegistry& registry)
+{
+	glDeleteVertexArrays(1, &registry.vao);
+	glDeleteBuffers(1, &registry.vbo);
+	glDeleteBuffers(1, &registry.ebo);
+	registry = MeshRegistry();
+}
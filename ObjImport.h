@@ -0,0 +1,222 @@
+#pragma once
+
+// Wavefront OBJ import for the mesh converter.
+// Reads positions, texture coordinates, normals and faces; polygons are fanned into triangles and
+// negative indices count back from the latest element, as the format allows. Every distinct
+// position/uv/normal combination becomes one packed vertex. Faces without normals get smooth
+// normals averaged from the faces around each vertex. OBJ puts v = 0 at the bottom of the image
+// while the scene's textures are uploaded top row first, so v is flipped. Packed uvs only hold
+// 0..1, so files with tiled or wrapped texture coordinates are refused. Materials, groups, lines
+// and everything else are ignored.
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "VertexFormat.h"
+
+//Position, uv and normal numbers of one face corner, 0 when the corner has none
+struct ObjCorner
+{
+	uint32_t position, uv, normal;
+
+	bool operator==(const ObjCorner& other) const
+	{
+		return position == other.position && uv == other.uv && normal == other.normal;
+	}
+};
+
+struct ObjCornerHash
+{
+	size_t operator()(const ObjCorner& corner) const
+	{
+		uint64_t hash = corner.position * 0x9E3779B97F4A7C15ull;
+		hash ^= (corner.uv + 0x632BE59BD9B4E019ull) + (hash << 6) + (hash >> 2);
+		hash ^= (corner.normal + 0x85157AF5ull) + (hash << 6) + (hash >> 2);
+		return (size_t)hash;
+	}
+};
+
+// Turn an OBJ index (1-based, or negative from the end) into a 1-based one, 0 if out of range
+static uint32_t ResolveObjIndex(long index, size_t count)
+{
+	if (index < 0)
+		index += (long)count + 1;
+	return index >= 1 && (size_t)index <= count ? (uint32_t)index : 0;
+}
+
+static const char* SkipObjSpaces(const char* cursor)
+{
+	while (*cursor == ' ' || *cursor == '\t')
+		cursor++;
+	return cursor;
+}
+
+// Parse an OBJ file into packed vertices and triangle indices; returns false if it cannot be read
+// or has no faces. error describes what went wrong.
+static bool ImportObj(const std::string& path, std::vector<PackedVertex>& vertices, std::vector<GLuint>& indices, std::string& error)
+{
+	vertices.clear();
+	indices.clear();
+
+	FILE* input = fopen(path.c_str(), "rb");
+	if (!input)
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+	std::vector<char> text;
+	char chunk[65536];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), input)) > 0)
+		text.insert(text.end(), chunk, chunk + read);
+	fclose(input);
+	text.push_back('\0'); //strtof and strtol stop here at the latest
+
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<ObjCorner> corners;	//three per triangle
+	std::vector<ObjCorner> face;
+
+	const char* cursor = text.data();
+	while (*cursor)
+	{
+		cursor = SkipObjSpaces(cursor);
+		const char* line = cursor;
+		while (*cursor && *cursor != '\n')
+			cursor++;
+		const char* lineEnd = cursor;
+		if (*cursor)
+			cursor++;
+
+		char* next;
+		if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			glm::vec3 position;
+			const char* field = line + 2;
+			for (int i = 0; i < 3; i++, field = next)
+				position[i] = strtof(field, &next);
+			positions.push_back(position);
+		}
+		else if (line[0] == 'v' && line[1] == 't')
+		{
+			glm::vec2 uv;
+			uv.x = strtof(line + 2, &next);
+			uv.y = strtof(next, &next);
+			uvs.push_back(glm::vec2(uv.x, 1.0f - uv.y));
+		}
+		else if (line[0] == 'v' && line[1] == 'n')
+		{
+			glm::vec3 normal;
+			const char* field = line + 2;
+			for (int i = 0; i < 3; i++, field = next)
+				normal[i] = strtof(field, &next);
+			normals.push_back(normal);
+		}
+		else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			//Corners are v, v/vt, v//vn or v/vt/vn
+			face.clear();
+			const char* field = SkipObjSpaces(line + 1);
+			while (field < lineEnd && *field != '\r' && *field != '#')
+			{
+				ObjCorner corner = { 0, 0, 0 };
+				corner.position = ResolveObjIndex(strtol(field, &next, 10), positions.size());
+				if (next == field)
+					break;
+				field = next;
+				if (*field == '/')
+				{
+					field++;
+					if (*field != '/')
+					{
+						corner.uv = ResolveObjIndex(strtol(field, &next, 10), uvs.size());
+						field = next;
+					}
+					if (*field == '/')
+					{
+						corner.normal = ResolveObjIndex(strtol(field + 1, &next, 10), normals.size());
+						field = next;
+					}
+				}
+				if (corner.position == 0)
+				{
+					error = "face refers to a missing vertex";
+					return false;
+				}
+				face.push_back(corner);
+				field = SkipObjSpaces(field);
+			}
+
+			for (size_t i = 2; i < face.size(); i++)
+			{
+				corners.push_back(face[0]);
+				corners.push_back(face[i - 1]);
+				corners.push_back(face[i]);
+			}
+		}
+	}
+
+	if (corners.empty())
+	{
+		error = "no faces in " + path;
+		return false;
+	}
+
+	for (const ObjCorner& corner : corners)
+	{
+		if (corner.uv == 0)
+			continue;
+		const glm::vec2& uv = uvs[corner.uv - 1];
+		if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f || uv.y > 1.0f)
+		{
+			error = "texture coordinates outside 0..1 (tiled or wrapped uvs) are not supported";
+			return false;
+		}
+	}
+
+	//One vertex per distinct corner, smooth normals summed up where the file has none
+	std::unordered_map<ObjCorner, GLuint, ObjCornerHash> vertexOf;
+	std::vector<glm::vec3> vertexPositions, vertexNormals;
+	std::vector<glm::vec2> vertexUvs;
+	indices.reserve(corners.size());
+	for (size_t i = 0; i < corners.size(); i++)
+	{
+		ObjCorner key = corners[i];
+		auto found = vertexOf.find(key);
+		GLuint index;
+		if (found != vertexOf.end())
+			index = found->second;
+		else
+		{
+			index = (GLuint)vertexPositions.size();
+			vertexOf.emplace(key, index);
+			vertexPositions.push_back(positions[key.position - 1]);
+			vertexUvs.push_back(key.uv ? uvs[key.uv - 1] : glm::vec2(0.0f));
+			vertexNormals.push_back(key.normal ? normals[key.normal - 1] : glm::vec3(0.0f));
+		}
+		indices.push_back(index);
+	}
+
+	for (size_t i = 0; i < corners.size(); i += 3)
+	{
+		glm::vec3 faceNormal = glm::cross(positions[corners[i + 1].position - 1] - positions[corners[i].position - 1],
+			positions[corners[i + 2].position - 1] - positions[corners[i].position - 1]);
+		for (size_t j = i; j < i + 3; j++)
+			if (corners[j].normal == 0)
+				vertexNormals[indices[j]] += faceNormal; //area weighted, the cross product is twice the area
+	}
+
+	vertices.resize(vertexPositions.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		glm::vec3 normal = vertexNormals[i];
+		GLfloat length = glm::length(normal);
+		vertices[i] = MakePackedVertex(vertexPositions[i], vertexUvs[i], length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f));
+	}
+	return true;
+}
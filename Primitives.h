@@ -0,0 +1,171 @@
+#pragma once
+
+// Procedural primitives and screen-size level of detail.
+// GenerateCylinder builds a capped cylinder with any number of segments, real radial normals
+// and uvs; a LodChain holds several segment counts of the same shape and SelectLodLevel picks
+// the coarsest one whose silhouette error stays under a pixel budget.
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "MeshRegistry.h"
+#include "VertexFormat.h"
+
+//Shape of a generated cylinder, the axis runs along +y from baseCenter
+struct CylinderParams
+{
+	GLuint segments = 24;
+	GLfloat radius = 0.5f;
+	GLfloat height = 2.0f;
+	glm::vec3 baseCenter = glm::vec3(0.0f, 0.0f, 0.0f);
+	GLuint uvWraps = 1;		//times the texture repeats around the body, segments are rounded up to a multiple of this
+	bool topCap = true;
+	bool bottomCap = true;
+};
+
+//Same shape at decreasing detail, levels[0] is the finest
+struct LodChain
+{
+	std::vector<MeshHandle> levels;
+	std::vector<GLuint> segmentCounts;	//segments each level was built with, after rounding to uvWraps
+	GLfloat boundingRadius = 0.0f;	//local-space bounding sphere
+	glm::vec3 boundingCenter = glm::vec3(0.0f, 0.0f, 0.0f);
+};
+
+//Largest distance the chord of one segment may sit inside the true circle, in pixels
+const GLfloat LOD_PIXEL_ERROR = 0.5f;
+
+// Flat cap fan at height y facing direction normalY (+1 top, -1 bottom)
+static void AppendCylinderCap(const CylinderParams& params, GLuint segments, GLfloat y, GLfloat normalY,
+	std::vector<PackedVertex>& vertices, std::vector<GLuint>& indices)
+{
+	const GLfloat twoPi = 2.0f * 3.14159265f;
+	glm::vec3 normal(0.0f, normalY, 0.0f);
+	GLuint center = (GLuint)vertices.size();
+	vertices.push_back(MakePackedVertex(params.baseCenter + glm::vec3(0.0f, y, 0.0f), glm::vec2(0.5f, 0.5f), normal));
+
+	for (GLuint i = 0; i < segments; i++)
+	{
+		GLfloat angle = twoPi * (GLfloat)i / (GLfloat)segments;
+		GLfloat c = cosf(angle), s = sinf(angle);
+		glm::vec3 position = params.baseCenter + glm::vec3(params.radius * c, y, params.radius * s);
+		vertices.push_back(MakePackedVertex(position, glm::vec2(0.5f + 0.5f * c, 0.5f + 0.5f * s), normal));
+	}
+
+	for (GLuint i = 0; i < segments; i++)
+	{
+		GLuint a = center + 1 + i;
+		GLuint b = center + 1 + (i + 1) % segments;
+		//counter-clockwise seen from outside
+		if (normalY > 0.0f)
+		{
+			indices.push_back(center); indices.push_back(b); indices.push_back(a);
+		}
+		else
+		{
+			indices.push_back(center); indices.push_back(a); indices.push_back(b);
+		}
+	}
+}
+
+// Build a cylinder body (and optional caps) as triangles; returns the segment count it used
+static GLuint GenerateCylinder(const CylinderParams& params, std::vector<PackedVertex>& vertices, std::vector<GLuint>& indices)
+{
+	const GLfloat twoPi = 2.0f * 3.14159265f;
+	GLuint wraps = params.uvWraps ? params.uvWraps : 1;
+	GLuint segmentsPerWrap = (params.segments + wraps - 1) / wraps;
+	if (segmentsPerWrap < 1)
+		segmentsPerWrap = 1;
+	GLuint segments = segmentsPerWrap * wraps;
+
+	vertices.clear();
+	indices.clear();
+
+	//Each wrap gets its own column of seam vertices so u can run 0..1 every time
+	for (GLuint w = 0; w < wraps; w++)
+	{
+		GLuint firstColumn = (GLuint)vertices.size();
+		for (GLuint j = 0; j <= segmentsPerWrap; j++)
+		{
+			GLuint i = w * segmentsPerWrap + j;
+			GLfloat angle = twoPi * (GLfloat)i / (GLfloat)segments;
+			glm::vec3 normal(cosf(angle), 0.0f, sinf(angle));
+			GLfloat u = (GLfloat)j / (GLfloat)segmentsPerWrap;
+			glm::vec3 bottom = params.baseCenter + normal * params.radius;
+			glm::vec3 top = bottom + glm::vec3(0.0f, params.height, 0.0f);
+			vertices.push_back(MakePackedVertex(bottom, glm::vec2(u, 0.0f), normal));
+			vertices.push_back(MakePackedVertex(top, glm::vec2(u, 1.0f), normal));
+		}
+
+		for (GLuint j = 0; j < segmentsPerWrap; j++)
+		{
+			GLuint bottomLeft = firstColumn + j * 2, topLeft = bottomLeft + 1;
+			GLuint bottomRight = bottomLeft + 2, topRight = bottomLeft + 3;
+			indices.push_back(bottomLeft); indices.push_back(topLeft); indices.push_back(bottomRight);
+			indices.push_back(bottomRight); indices.push_back(topLeft); indices.push_back(topRight);
+		}
+	}
+
+	if (params.topCap)
+		AppendCylinderCap(params, segments, params.height, 1.0f, vertices, indices);
+	if (params.bottomCap)
+		AppendCylinderCap(params, segments, 0.0f, -1.0f, vertices, indices);
+	return segments;
+}
+
+// Register one mesh per segment count, finest first
+static LodChain RegisterCylinderLods(MeshRegistry& registry, CylinderParams params, const std::vector<GLuint>& segmentCounts)
+{
+	LodChain chain;
+	std::vector<PackedVertex> vertices;
+	std::vector<GLuint> indices;
+
+	for (GLuint segments : segmentCounts)
+	{
+		params.segments = segments;
+		GLuint built = GenerateCylinder(params, vertices, indices);
+		chain.levels.push_back(RegisterMesh(registry, vertices, indices));
+		chain.segmentCounts.push_back(built);
+	}
+
+	GLfloat halfHeight = params.height * 0.5f;
+	chain.boundingCenter = params.baseCenter + glm::vec3(0.0f, halfHeight, 0.0f);
+	chain.boundingRadius = sqrtf(params.radius * params.radius + halfHeight * halfHeight);
+	return chain;
+}
+
+// Radius in pixels of a local bounding sphere after model, view and projection
+static GLfloat ProjectedRadiusPixels(const glm::vec3& localCenter, GLfloat localRadius, const glm::mat4& model,
+	const glm::mat4& view, const glm::mat4& projection, int viewportHeight)
+{
+	glm::vec3 viewCenter = glm::vec3(view * model * glm::vec4(localCenter, 1.0f));
+	GLfloat maxScale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+	GLfloat radius = localRadius * maxScale;
+
+	GLfloat pixelsPerUnit = projection[1][1] * (GLfloat)viewportHeight * 0.5f;
+	bool perspective = projection[2][3] != 0.0f;
+	if (perspective)
+	{
+		GLfloat depth = -viewCenter.z;
+		if (depth <= radius)
+			return (GLfloat)viewportHeight; //camera is inside or touching the sphere, use full detail
+		return radius * pixelsPerUnit / depth;
+	}
+	return radius * pixelsPerUnit;
+}
+
+// Coarsest level whose chord error (r * (1 - cos(pi / n))) stays under LOD_PIXEL_ERROR
+static MeshHandle SelectLodLevel(const LodChain& chain, GLfloat radiusPixels)
+{
+	const GLfloat pi = 3.14159265f;
+	for (size_t i = chain.levels.size(); i-- > 0;)
+	{
+		GLfloat error = fabsf(radiusPixels) * (1.0f - cosf(pi / (GLfloat)chain.segmentCounts[i]));
+		if (error <= LOD_PIXEL_ERROR)
+			return chain.levels[i];
+	}
+	return chain.levels.front();
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+// Frame profiler with Chrome trace output.
+// Scopes (BeginProfileScope/EndProfileScope, or ProfileScope around a block) record when they
+// start and end on the CPU, per thread (the GL thread plus every job pool worker, each into its
+// own list), and scopes marked for the GPU also put a pair of GL_TIMESTAMP queries into the
+// command stream. Timestamp pairs are used instead of GL_TIME_ELAPSED because elapsed-time
+// queries cannot nest, and the headless benchmark already times every whole frame with one.
+// GPU queries are double-buffered: the queries of one frame are read back when the same set comes
+// round again two frames later, and only if the driver says they are available, so reading them
+// never waits for the GPU. GPU times are moved onto the CPU clock with an offset taken at start-up.
+// The last PROFILER_KEEP_FRAMES frames or more are kept and can be written as a Chrome trace_event
+// JSON file, which chrome://tracing and Perfetto open directly.
+
+#include <GLEW/glew.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+const uint32_t PROFILER_KEEP_FRAMES = 600;
+const uint32_t PROFILER_GPU_THREAD = 1000;	//trace track the GPU scopes are drawn on
+
+//One finished scope, times in microseconds since the profiler started
+struct ProfileEvent
+{
+	const char* name;	//string literal, never copied
+	double startUs, durationUs;
+	uint64_t frame;
+};
+
+//GPU scope waiting for its queries to be read back
+struct GpuScopeRecord
+{
+	const char* name;
+	uint32_t beginQuery, endQuery;	//indices into the set's queries
+};
+
+//Queries of one frame
+struct GpuQuerySet
+{
+	std::vector<GLuint> queries;
+	uint32_t used = 0;
+	std::vector<GpuScopeRecord> scopes;
+	uint64_t frame = 0;
+};
+
+struct FrameProfiler
+{
+	bool enabled = false;
+	std::chrono::high_resolution_clock::time_point epoch;
+	int64_t gpuToCpuNs = 0;		//added to a GPU timestamp to get nanoseconds since epoch
+	std::vector<std::vector<ProfileEvent>> threads;	//CPU scopes, [0] is the GL thread
+	std::vector<ProfileEvent> gpuEvents;
+	GpuQuerySet sets[2];
+	uint64_t frame = 0;
+	uint32_t droppedGpuFrames = 0;	//GPU results that were not ready in time and were skipped
+};
+
+static double ProfilerNowUs(const FrameProfiler& profiler)
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - profiler.epoch).count();
+}
+
+// threadCount is the number of job pool threads that record scopes, including the GL thread
+static void InitProfiler(FrameProfiler& profiler, bool enabled, unsigned threadCount)
+{
+	profiler = FrameProfiler();
+	profiler.enabled = enabled;
+	profiler.threads.resize(threadCount > 0 ? threadCount : 1);
+	profiler.epoch = std::chrono::high_resolution_clock::now();
+	if (!enabled)
+		return;
+
+	GLint64 gpuNow = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+	profiler.gpuToCpuNs = (int64_t)(ProfilerNowUs(profiler) * 1000.0) - gpuNow;
+}
+
+// Call between frames only, workers index their own list without locking
+static void SetProfilerThreads(FrameProfiler& profiler, unsigned threadCount)
+{
+	if (threadCount > profiler.threads.size())
+		profiler.threads.resize(threadCount);
+}
+
+// Turn a finished query set into GPU events, waiting for the results only when asked to
+static bool ReadGpuQuerySet(FrameProfiler& profiler, GpuQuerySet& set, bool wait)
+{
+	if (set.scopes.empty())
+		return true;
+
+	//Queries finish in order, so the last one being ready means they all are
+	GLuint available = GL_FALSE;
+	if (!wait)
+		glGetQueryObjectuiv(set.queries[set.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!wait && !available)
+	{
+		profiler.droppedGpuFrames++;
+		set.scopes.clear();
+		set.used = 0;
+		return false;
+	}
+
+	for (const GpuScopeRecord& scope : set.scopes)
+	{
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(set.queries[scope.beginQuery], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(set.queries[scope.endQuery], GL_QUERY_RESULT, &end);
+		double startUs = (double)((int64_t)begin + profiler.gpuToCpuNs) / 1000.0;
+		profiler.gpuEvents.push_back({ scope.name, startUs, (double)(end - begin) / 1000.0, set.frame });
+	}
+	set.scopes.clear();
+	set.used = 0;
+	return true;
+}
+
+// Drop events from frames older than the ones being kept
+static void TrimProfileEvents(std::vector<ProfileEvent>& events, uint64_t oldestFrame)
+{
+	size_t keep = 0;
+	while (keep < events.size() && events[keep].frame < oldestFrame)
+		keep++;
+	events.erase(events.begin(), events.begin() + keep);
+}
+
+// Start a new frame: collect the GPU times of the frame that used this query set before
+static void BeginProfilerFrame(FrameProfiler& profiler)
+{
+	if (!profiler.enabled)
+		return;
+
+	profiler.frame++;
+	GpuQuerySet& set = profiler.sets[profiler.frame % 2];
+	ReadGpuQuerySet(profiler, set, false);
+	set.frame = profiler.frame;
+
+	//Trimming once every PROFILER_KEEP_FRAMES frames keeps between one and two windows of events
+	if (profiler.frame % PROFILER_KEEP_FRAMES == 0)
+	{
+		uint64_t oldestFrame = profiler.frame - PROFILER_KEEP_FRAMES;
+		for (std::vector<ProfileEvent>& events : profiler.threads)
+			TrimProfileEvents(events, oldestFrame);
+		TrimProfileEvents(profiler.gpuEvents, oldestFrame);
+	}
+}
+
+// Next free query of the current frame's set, created on first use
+static uint32_t AllocateGpuQuery(GpuQuerySet& set)
+{
+	if (set.used == set.queries.size())
+	{
+		size_t first = set.queries.size();
+		set.queries.resize(first + 16);
+		glGenQueries(16, &set.queries[first]);
+	}
+	return set.used++;
+}
+
+//Open scope, returned by BeginProfileScope and handed back to EndProfileScope
+struct ProfileMark
+{
+	const char* name;
+	unsigned thread;
+	double startUs;
+	int gpuScope;	//index into the frame's GPU scopes, -1 for CPU only
+};
+
+// Start timing a scope on the CPU of the given job pool thread (0 is the GL thread), and on the
+// GPU as well when gpu is set; GPU scopes may only be opened on the GL thread
+static ProfileMark BeginProfileScope(FrameProfiler& profiler, const char* name, bool gpu = false, unsigned thread = 0)
+{
+	ProfileMark mark = { name, thread, 0.0, -1 };
+	if (!profiler.enabled)
+		return mark;
+	if (gpu)
+	{
+		GpuQuerySet& set = profiler.sets[profiler.frame % 2];
+		uint32_t query = AllocateGpuQuery(set);
+		glQueryCounter(set.queries[query], GL_TIMESTAMP);
+		mark.gpuScope = (int)set.scopes.size();
+		set.scopes.push_back({ name, query, query });
+	}
+	mark.startUs = ProfilerNowUs(profiler);
+	return mark;
+}
+
+static void EndProfileScope(FrameProfiler& profiler, const ProfileMark& mark)
+{
+	if (!profiler.enabled)
+		return;
+	double endUs = ProfilerNowUs(profiler);
+	profiler.threads[mark.thread].push_back({ mark.name, mark.startUs, endUs - mark.startUs, profiler.frame });
+	if (mark.gpuScope >= 0)
+	{
+		GpuQuerySet& set = profiler.sets[profiler.frame % 2];
+		uint32_t query = AllocateGpuQuery(set);
+		glQueryCounter(set.queries[query], GL_TIMESTAMP);
+		set.scopes[mark.gpuScope].endQuery = query;
+	}
+}
+
+// Times the enclosing block, or up to End() when that comes first
+struct ProfileScope
+{
+	FrameProfiler& profiler;
+	ProfileMark mark;
+	bool open;
+
+	ProfileScope(FrameProfiler& owner, const char* name, bool gpu = false, unsigned thread = 0)
+		: profiler(owner), mark(BeginProfileScope(owner, name, gpu, thread)), open(true)
+	{
+	}
+
+	void End()
+	{
+		if (open)
+			EndProfileScope(profiler, mark);
+		open = false;
+	}
+
+	~ProfileScope()
+	{
+		End();
+	}
+};
+
+// Wait for the GPU scopes still in flight so a trace written now has them
+static void FinishProfiler(FrameProfiler& profiler)
+{
+	if (!profiler.enabled)
+		return;
+	ReadGpuQuerySet(profiler, profiler.sets[(profiler.frame + 1) % 2], true);
+	ReadGpuQuerySet(profiler, profiler.sets[profiler.frame % 2], true);
+}
+
+static void WriteTraceEvents(FILE* output, const std::vector<ProfileEvent>& events, uint32_t thread, const char* category, bool& first)
+{
+	for (const ProfileEvent& event : events)
+	{
+		fprintf(output, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"frame\":%llu}}",
+			first ? "" : ",", event.name, category, event.startUs, event.durationUs, thread, (unsigned long long)event.frame);
+		first = false;
+	}
+}
+
+// Write every kept event as a Chrome trace_event file, one track per thread plus one for the GPU
+static bool WriteChromeTrace(const FrameProfiler& profiler, const char* path)
+{
+	FILE* output = fopen(path, "w");
+	if (!output)
+		return false;
+
+	fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	bool first = true;
+	for (uint32_t thread = 0; thread < profiler.threads.size(); thread++)
+	{
+		fprintf(output, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+			first ? "" : ",", thread, thread == 0 ? "GL thread / worker" : "Worker", thread);
+		first = false;
+		WriteTraceEvents(output, profiler.threads[thread], thread, "cpu", first);
+	}
+	fprintf(output, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}",
+		first ? "" : ",", PROFILER_GPU_THREAD);
+	WriteTraceEvents(output, profiler.gpuEvents, PROFILER_GPU_THREAD, "gpu", first);
+	fprintf(output, "\n]}\n");
+	return fclose(output) == 0;
+}
+
+static void DestroyProfiler(FrameProfiler& profiler)
+{
+	for (GpuQuerySet& set : profiler.sets)
+		if (!set.queries.empty())
+			glDeleteQueries((GLsizei)set.queries.size(), set.queries.data());
+	profiler = FrameProfiler();
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+// Linked shader program cache.
+// After a program is compiled and linked from source its driver binary (glGetProgramBinary) is
+// written to "program.<key>.progcache", where the key hashes the vertex and fragment source
+// together with the GL vendor, renderer and version strings. Later launches hand that binary
+// back with glProgramBinary and skip compiling entirely. Drivers may reject a binary at any time
+// (after an update, or for reasons of their own), in which case the caller compiles from source
+// and stores a fresh one.
+
+#include <GLEW/glew.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+const uint32_t PROGRAM_CACHE_MAGIC = 0x48434750; //"PGCH"
+const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+struct ProgramCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;			//hash of the sources and driver strings, repeated from the file name
+	uint32_t binaryFormat;	//format glGetProgramBinary returned
+	uint32_t binarySize;
+};
+
+struct ProgramCache
+{
+	bool enabled = false;	//off, or the driver offers no binary formats
+	uint64_t driverHash = 0;
+	int hits = 0, misses = 0, rejected = 0;
+	double buildMs = 0.0;	//time spent loading, compiling and linking programs
+};
+
+// Programs built by this driver can only be reused by the same driver
+static void InitProgramCache(ProgramCache& cache, bool enabled)
+{
+	cache = ProgramCache();
+
+	GLint formatCount = 0;
+	if (GLEW_ARB_get_program_binary || GLEW_VERSION_4_1)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+	cache.enabled = enabled && formatCount > 0;
+
+	const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+	uint64_t hash = HashBytes(nullptr, 0);
+	for (GLenum name : driverStrings)
+	{
+		const char* value = (const char*)glGetString(name);
+		if (value)
+			hash = HashBytes((const unsigned char*)value, strlen(value) + 1, hash);
+	}
+	cache.driverHash = hash;
+}
+
+static uint64_t ProgramCacheKey(const ProgramCache& cache, const std::string& vertexSource, const std::string& fragmentSource)
+{
+	uint64_t hash = HashBytes((const unsigned char*)vertexSource.c_str(), vertexSource.size() + 1, cache.driverHash);
+	return HashBytes((const unsigned char*)fragmentSource.c_str(), fragmentSource.size() + 1, hash);
+}
+
+static std::string ProgramCachePath(uint64_t key)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "program.%016llx.progcache", (unsigned long long)key);
+	return name;
+}
+
+// Create a program from its cached binary, returns 0 if there is none or the driver rejects it
+static GLuint LoadCachedProgram(ProgramCache& cache, uint64_t key)
+{
+	if (!cache.enabled)
+		return 0;
+
+	MappedFile file;
+	if (!MapFile(ProgramCachePath(key), file))
+		return 0; //not cached yet, StoreCachedProgram counts the miss
+
+	const ProgramCacheHeader* header = (const ProgramCacheHeader*)file.data;
+	bool valid = file.size >= sizeof(ProgramCacheHeader)
+		&& header->magic == PROGRAM_CACHE_MAGIC
+		&& header->version == PROGRAM_CACHE_VERSION
+		&& header->key == key
+		&& sizeof(ProgramCacheHeader) + header->binarySize <= file.size;
+
+	GLuint program = 0;
+	if (valid)
+	{
+		program = glCreateProgram();
+		glProgramBinary(program, header->binaryFormat, file.data + sizeof(ProgramCacheHeader), (GLsizei)header->binarySize);
+
+		GLint linked = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+	UnmapFile(file);
+
+	//Only a well-formed binary the driver refused counts as rejected, a stale or truncated file is just a miss
+	if (program)
+		cache.hits++;
+	else if (valid)
+		cache.rejected++;
+	return program;
+}
+
+// Ask the driver to keep a program's binary around; call before linking it
+static void PrepareCachedProgram(const ProgramCache& cache, GLuint program)
+{
+	if (cache.enabled)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+// Write a freshly linked program's binary
+static bool StoreCachedProgram(ProgramCache& cache, GLuint program, uint64_t key)
+{
+	if (!cache.enabled)
+		return false;
+	cache.misses++;
+
+	GLint binarySize = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+	if (binarySize <= 0)
+		return false;
+
+	std::vector<unsigned char> image(sizeof(ProgramCacheHeader) + (size_t)binarySize);
+	GLenum binaryFormat = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, binarySize, &written, &binaryFormat, &image[sizeof(ProgramCacheHeader)]);
+	if (written <= 0)
+		return false;
+
+	ProgramCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PROGRAM_CACHE_MAGIC;
+	header.version = PROGRAM_CACHE_VERSION;
+	header.key = key;
+	header.binaryFormat = binaryFormat;
+	header.binarySize = (uint32_t)written;
+	memcpy(image.data(), &header, sizeof(header));
+	image.resize(sizeof(ProgramCacheHeader) + (size_t)written);
+
+	return WriteFileReplacing(ProgramCachePath(key), image.data(), image.size());
+}
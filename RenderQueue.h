@@ -0,0 +1,166 @@
+#pragma once
+
+// Sorted render queue.
+// Each draw is recorded as a 16-byte command: a 64-bit sort key and the index of its draw item
+// (GL program, VAO, mesh, texture, model matrix). Sorting the keys groups draws by program, then
+// VAO, then texture, so the executor only changes state when the key says it must, and orders
+// opaque draws front to back within a state group (cheap early depth rejection) while
+// transparent draws come last, back to front, for correct blending.
+// Commands and items for a frame are carved out of a linear arena that is reset every frame, so
+// building the queue never allocates once the arena has grown to the scene's size.
+// Queues can also be filled on several threads at once, one bucket (and arena) per thread, and
+// appended into the frame's queue on the GL thread before sorting.
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "MeshRegistry.h"
+
+// Linear allocator for data that lives for one frame. When a frame needs more than the current
+// block, extra blocks are chained on; the next reset replaces them with one block big enough for
+// the whole frame, so steady-state frames make no heap allocations.
+struct FrameArena
+{
+	std::vector<std::vector<unsigned char>> blocks;
+	size_t used = 0;			//bytes used in the last block
+	size_t frameBytes = 0;		//bytes handed out since the last reset
+	uint32_t grows = 0;			//blocks added since the last reset
+};
+
+const size_t FRAME_ARENA_ALIGNMENT = 16;
+
+static void InitFrameArena(FrameArena& arena, size_t capacity)
+{
+	arena = FrameArena();
+	arena.blocks.push_back(std::vector<unsigned char>(capacity));
+}
+
+// Start a new frame, everything allocated during the last one is released
+static void ResetFrameArena(FrameArena& arena)
+{
+	if (arena.blocks.size() > 1)
+	{
+		size_t total = 0;
+		for (const std::vector<unsigned char>& block : arena.blocks)
+			total += block.size();
+		arena.blocks.clear();
+		arena.blocks.push_back(std::vector<unsigned char>(total));
+	}
+	arena.used = 0;
+	arena.frameBytes = 0;
+	arena.grows = 0;
+}
+
+static void* ArenaAllocate(FrameArena& arena, size_t bytes)
+{
+	bytes = (bytes + FRAME_ARENA_ALIGNMENT - 1) & ~(FRAME_ARENA_ALIGNMENT - 1);
+	if (arena.blocks.empty() || arena.used + bytes > arena.blocks.back().size())
+	{
+		size_t blockSize = std::max(bytes, arena.blocks.empty() ? (size_t)4096 : arena.blocks.back().size() * 2);
+		arena.blocks.push_back(std::vector<unsigned char>(blockSize));
+		arena.used = 0;
+		arena.grows++;
+	}
+	void* memory = &arena.blocks.back()[arena.used];
+	arena.used += bytes;
+	arena.frameBytes += bytes;
+	return memory;
+}
+
+// Uninitialized array of count plain-data elements
+template<typename T>
+static T* ArenaArray(FrameArena& arena, size_t count)
+{
+	return (T*)ArenaAllocate(arena, count * sizeof(T));
+}
+
+const GLuint NO_QUEUE_TEXTURE = 0xFFFFFFFFu;
+
+//Everything needed to issue one draw
+struct DrawItem
+{
+	GLuint program;
+	GLuint vao;
+	MeshHandle mesh;
+	GLuint texture;				//texture handle for the material, NO_QUEUE_TEXTURE for none
+	GLsizei instanceCount;		//0 draws once with model as the model matrix
+	const glm::mat4* model;
+	glm::mat3 normalMatrix;		//inverse transpose of model, computed while recording
+};
+
+struct RenderCommand
+{
+	uint64_t key;
+	uint32_t item;	//index into the queue's items
+};
+
+struct RenderQueue
+{
+	RenderCommand* commands = nullptr;
+	DrawItem* items = nullptr;
+	uint32_t count = 0, capacity = 0;
+};
+
+// Key layout, most significant bits first:
+//   opaque:      0 | program 8 | vao 8 | texture 16 | depth 24 | 7 unused
+//   transparent: 1 | inverted depth 24 | program 8 | vao 8 | texture 16 | 7 unused
+// Program, VAO and texture are small sort ids chosen by the caller, not GL names.
+const int RENDER_KEY_DEPTH_BITS = 24;
+
+static uint64_t MakeRenderKey(bool transparent, uint32_t program, uint32_t vao, uint32_t texture, float depth01)
+{
+	uint64_t depth = (uint64_t)(std::min(std::max(depth01, 0.0f), 1.0f) * (float)((1 << RENDER_KEY_DEPTH_BITS) - 1));
+	uint64_t state = ((uint64_t)(program & 0xFF) << 24) | ((uint64_t)(vao & 0xFF) << 16) | (uint64_t)(texture & 0xFFFF);
+	if (!transparent)
+		return (state << 31) | (depth << 7);
+	uint64_t farFirst = ((1 << RENDER_KEY_DEPTH_BITS) - 1) - depth;
+	return (1ull << 63) | (farFirst << 39) | (state << 7);
+}
+
+static bool IsTransparentKey(uint64_t key)
+{
+	return (key >> 63) != 0;
+}
+
+// Make room for up to capacity draws this frame
+static void BeginRenderQueue(RenderQueue& queue, FrameArena& arena, uint32_t capacity)
+{
+	queue.commands = ArenaArray<RenderCommand>(arena, capacity);
+	queue.items = ArenaArray<DrawItem>(arena, capacity);
+	queue.count = 0;
+	queue.capacity = capacity;
+}
+
+static void PushDraw(RenderQueue& queue, uint64_t key, const DrawItem& item)
+{
+	if (queue.count >= queue.capacity)
+		return;
+	queue.items[queue.count] = item;
+	queue.commands[queue.count].key = key;
+	queue.commands[queue.count].item = queue.count;
+	queue.count++;
+}
+
+// Copy a bucket's draws to the end of queue
+static void AppendRenderQueue(RenderQueue& queue, const RenderQueue& bucket)
+{
+	uint32_t count = std::min(bucket.count, queue.capacity - queue.count);
+	memcpy(queue.items + queue.count, bucket.items, count * sizeof(DrawItem));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		queue.commands[queue.count + i].key = bucket.commands[i].key;
+		queue.commands[queue.count + i].item = queue.count + bucket.commands[i].item;
+	}
+	queue.count += count;
+}
+
+static void SortRenderQueue(RenderQueue& queue)
+{
+	std::sort(queue.commands, queue.commands + queue.count,
+		[](const RenderCommand& a, const RenderCommand& b) { return a.key < b.key || (a.key == b.key && a.item < b.item); });
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+// Flat transform hierarchy.
+// Nodes are stored as parallel arrays (parent index, local position/rotation/scale, world matrix,
+// dirty flag) instead of as objects that point at each other. A parent is always added before
+// its children, so a single forward pass over the arrays sees every parent's world matrix before
+// its children need it. Only nodes that were changed, or whose parent was recomputed, get a new
+// world matrix, and a scene where nothing moved skips the pass altogether.
+// Local matrices of changed nodes are built first, in runs of consecutive nodes, by the batched
+// transform kernels (BatchTransform.h). Every node also keeps a normal matrix next to its world
+// matrix: the parent's times its own local one, so no matrix is ever inverted.
+// Large updates can be spread over a job pool one depth level at a time: every parent is then
+// finished before any of its children are started.
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <vector>
+
+#include "BatchTransform.h"
+#include "JobPool.h"
+
+typedef uint32_t SceneNode;
+const SceneNode SCENE_NO_PARENT = 0xFFFFFFFFu;
+
+struct SceneGraph
+{
+	std::vector<SceneNode> parents;	//always a lower index than the node itself
+	std::vector<glm::vec3> positions;
+	std::vector<glm::quat> rotations;
+	std::vector<glm::vec3> scales;
+	std::vector<glm::mat4> localMatrices;	//translate * rotate * scale
+	std::vector<glm::mat3> localNormals;
+	std::vector<glm::mat4> worldMatrices;
+	std::vector<glm::mat3> normalMatrices;	//inverse transpose of the world matrix's upper 3x3
+	std::vector<uint8_t> dirty;		//local transform changed since the last update
+	std::vector<uint32_t> depths;	//0 for nodes without a parent
+	std::vector<SceneNode> levelOrder;	//nodes sorted by depth, for parallel updates
+	std::vector<size_t> levelStarts;	//where each depth begins in levelOrder, plus the end
+	bool levelsValid = false;
+	size_t firstDirty = 0;			//lowest dirty index, equal to the node count when clean
+	size_t updatedCount = 0;		//world matrices recomputed by the last update
+};
+
+static size_t SceneNodeCount(const SceneGraph& graph)
+{
+	return graph.parents.size();
+}
+
+static void MarkNodeDirty(SceneGraph& graph, SceneNode node)
+{
+	graph.dirty[node] = 1;
+	graph.firstDirty = std::min(graph.firstDirty, (size_t)node);
+}
+
+// Append a node, its world matrix is computed by the next UpdateWorldMatrices
+static SceneNode AddSceneNode(SceneGraph& graph, SceneNode parent, const glm::vec3& position,
+	const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f), const glm::vec3& scale = glm::vec3(1.0f))
+{
+	SceneNode node = (SceneNode)SceneNodeCount(graph);
+	graph.parents.push_back(parent);
+	graph.positions.push_back(position);
+	graph.rotations.push_back(rotation);
+	graph.scales.push_back(scale);
+	graph.localMatrices.push_back(glm::mat4(1.0f));
+	graph.localNormals.push_back(glm::mat3(1.0f));
+	graph.worldMatrices.push_back(glm::mat4(1.0f));
+	graph.normalMatrices.push_back(glm::mat3(1.0f));
+	graph.dirty.push_back(0);
+	graph.depths.push_back(parent == SCENE_NO_PARENT ? 0 : graph.depths[parent] + 1);
+	graph.levelsValid = false;
+	MarkNodeDirty(graph, node);
+	return node;
+}
+
+static void SetNodeRotation(SceneGraph& graph, SceneNode node, const glm::quat& rotation)
+{
+	graph.rotations[node] = rotation;
+	MarkNodeDirty(graph, node);
+}
+
+// Rebuild the local matrices of the changed nodes in [first, last), one batch per run of
+// consecutive changed nodes. Must run before UpdateWorldMatrix spreads the flags to children.
+static void UpdateLocalMatrices(SceneGraph& graph, size_t first, size_t last)
+{
+	size_t runStart = first;
+	while (runStart < last)
+	{
+		if (!graph.dirty[runStart])
+		{
+			runStart++;
+			continue;
+		}
+		size_t runEnd = runStart + 1;
+		while (runEnd < last && graph.dirty[runEnd])
+			runEnd++;
+		BatchTransforms(&graph.positions[runStart], &graph.rotations[runStart], &graph.scales[runStart], runEnd - runStart,
+			&graph.localMatrices[runStart], &graph.localNormals[runStart]);
+		runStart = runEnd;
+	}
+}
+
+// world = parent world * local, if the node or its parent changed, and the normal matrix likewise.
+// The parent must already be up to date; returns whether the node was rebuilt.
+static bool UpdateWorldMatrix(SceneGraph& graph, size_t node)
+{
+	SceneNode parent = graph.parents[node];
+	if (parent != SCENE_NO_PARENT && graph.dirty[parent])
+		graph.dirty[node] = 1; //a moved parent moves the whole subtree
+	if (!graph.dirty[node])
+		return false;
+
+	if (parent == SCENE_NO_PARENT)
+	{
+		graph.worldMatrices[node] = graph.localMatrices[node];
+		graph.normalMatrices[node] = graph.localNormals[node];
+	}
+	else
+	{
+		graph.worldMatrices[node] = graph.worldMatrices[parent] * graph.localMatrices[node];
+		graph.normalMatrices[node] = graph.normalMatrices[parent] * graph.localNormals[node];
+	}
+	return true;
+}
+
+// Recompute the world matrix of every dirty node and everything below it, returns how many
+// matrices were rebuilt
+static size_t UpdateWorldMatrices(SceneGraph& graph)
+{
+	size_t count = SceneNodeCount(graph);
+	graph.updatedCount = 0;
+	if (graph.firstDirty >= count)
+		return 0;
+
+	UpdateLocalMatrices(graph, graph.firstDirty, count);
+	for (size_t i = graph.firstDirty; i < count; i++)
+		graph.updatedCount += UpdateWorldMatrix(graph, i);
+
+	//Children read their parent's flag above, so flags are only cleared once the pass is done
+	memset(&graph.dirty[graph.firstDirty], 0, count - graph.firstDirty);
+	graph.firstDirty = count;
+	return graph.updatedCount;
+}
+
+// Group nodes by depth (counting sort, node order is kept within a level)
+static void BuildSceneLevels(SceneGraph& graph)
+{
+	uint32_t levels = 0;
+	for (uint32_t depth : graph.depths)
+		levels = std::max(levels, depth + 1);
+
+	graph.levelStarts.assign(levels + 1, 0);
+	for (uint32_t depth : graph.depths)
+		graph.levelStarts[depth + 1]++;
+	for (uint32_t level = 0; level < levels; level++)
+		graph.levelStarts[level + 1] += graph.levelStarts[level];
+
+	std::vector<size_t> cursors(graph.levelStarts.begin(), graph.levelStarts.end() - 1);
+	graph.levelOrder.resize(SceneNodeCount(graph));
+	for (size_t i = 0; i < graph.depths.size(); i++)
+		graph.levelOrder[cursors[graph.depths[i]]++] = (SceneNode)i;
+	graph.levelsValid = true;
+}
+
+const size_t SCENE_PARALLEL_MIN_NODES = 4096;	//smaller updates are not worth waking the workers for
+const size_t SCENE_PARALLEL_CHUNK = 1024;		//nodes per job
+
+// Same result as UpdateWorldMatrices, with each depth level split into jobs on the pool
+static size_t UpdateWorldMatricesParallel(SceneGraph& graph, JobPool& pool)
+{
+	size_t count = SceneNodeCount(graph);
+	if (count - std::min(graph.firstDirty, count) < SCENE_PARALLEL_MIN_NODES || JobPoolThreadCount(pool) < 2)
+		return UpdateWorldMatrices(graph);
+
+	if (!graph.levelsValid)
+		BuildSceneLevels(graph);
+
+	//Local matrices do not depend on each other, so they are split by node index rather than by level
+	size_t firstDirty = graph.firstDirty;
+	ParallelFor(pool, (count - firstDirty + SCENE_PARALLEL_CHUNK - 1) / SCENE_PARALLEL_CHUNK, [&](size_t chunk, unsigned)
+	{
+		size_t first = firstDirty + chunk * SCENE_PARALLEL_CHUNK;
+		UpdateLocalMatrices(graph, first, std::min(first + SCENE_PARALLEL_CHUNK, count));
+	});
+
+	std::atomic<size_t> updated(0);
+	for (size_t level = 0; level + 1 < graph.levelStarts.size(); level++)
+	{
+		size_t levelStart = graph.levelStarts[level], levelEnd = graph.levelStarts[level + 1];
+		size_t chunks = (levelEnd - levelStart + SCENE_PARALLEL_CHUNK - 1) / SCENE_PARALLEL_CHUNK;
+		ParallelFor(pool, chunks, [&](size_t chunk, unsigned)
+		{
+			size_t first = levelStart + chunk * SCENE_PARALLEL_CHUNK;
+			size_t last = std::min(first + SCENE_PARALLEL_CHUNK, levelEnd);
+			size_t chunkUpdated = 0;
+			for (size_t i = first; i < last; i++)
+				chunkUpdated += UpdateWorldMatrix(graph, graph.levelOrder[i]);
+			updated += chunkUpdated;
+		});
+	}
+
+	memset(&graph.dirty[0], 0, count);
+	graph.firstDirty = count;
+	graph.updatedCount = updated;
+	return graph.updatedCount;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+// Cached omnidirectional shadow maps.
+// The first MAX_SHADOWED_LIGHTS lights each get a depth cube map, rendered face by face with a
+// depth-only program from the light's position out to its radius (SHADOW_UNBOUNDED_RANGE for
+// lights without one). Faces are only re-rendered when they are out of date: all six when their
+// light moves or changes range, and otherwise only the faces whose frustum a moved caster's box
+// touches, either where it was or where it is now. A still scene renders no shadow faces at all.
+// The lighting shader compares against the maps with hardware depth comparison (each lookup is a
+// bilinear 2x2 PCF) and averages a pcfKernel^3 grid of lookups around the fragment's direction.
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <vector>
+
+#include "Culling.h"
+#include "MeshRegistry.h"
+
+const int MAX_SHADOWED_LIGHTS = 4;
+const GLint SHADOW_MAP_FIRST_UNIT = 4;			//texture units 4.. (0 is the material, 1-3 the light clusters)
+const GLfloat SHADOW_NEAR_PLANE = 0.05f;
+const GLfloat SHADOW_UNBOUNDED_RANGE = 25.0f;	//shadow distance of lights whose radius is 0
+
+//One light's cube map and what it was last rendered from
+struct ShadowMap
+{
+	GLuint texture = 0;
+	glm::vec3 position;
+	GLfloat range = 0.0f;
+	bool faceDirty[6] = { true, true, true, true, true, true };
+	glm::mat4 faceViewProjection[6];
+	Frustum faceFrusta[6];
+};
+
+struct ShadowMaps
+{
+	bool enabled = false;
+	GLsizei size = 512;		//texels per cube face side
+	int pcfKernel = 2;		//lookups per axis
+	GLuint fbo = 0, program = 0;
+	GLint modelLoc = -1, viewProjectionLoc = -1;
+	std::vector<ShadowMap> maps;
+	std::vector<Aabb> casterBounds;	//object boxes the maps are up to date with
+
+	uint32_t facesRebuilt = 0;		//by the last RenderShadowMaps
+	uint64_t totalFacesRebuilt = 0;
+};
+
+// Shadow distance of a light with the given falloff radius
+static GLfloat ShadowRange(GLfloat radius)
+{
+	return radius > 0.0f ? radius : SHADOW_UNBOUNDED_RANGE;
+}
+
+// depthProgram is the depth-only program, with "model" and "lightViewProjection" uniforms
+static void InitShadowMaps(ShadowMaps& shadows, size_t lightCount, GLsizei size, int pcfKernel, GLuint depthProgram)
+{
+	shadows.enabled = true;
+	shadows.size = size;
+	shadows.pcfKernel = pcfKernel;
+	shadows.program = depthProgram;
+	shadows.modelLoc = glGetUniformLocation(depthProgram, "model");
+	shadows.viewProjectionLoc = glGetUniformLocation(depthProgram, "lightViewProjection");
+	shadows.maps.resize(lightCount < (size_t)MAX_SHADOWED_LIGHTS ? lightCount : MAX_SHADOWED_LIGHTS);
+
+	//Lookups near a face edge filter across into the next face
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	for (size_t i = 0; i < shadows.maps.size(); i++)
+	{
+		ShadowMap& map = shadows.maps[i];
+		glGenTextures(1, &map.texture);
+		glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_FIRST_UNIT + (GLenum)i);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, map.texture);
+		for (GLenum face = 0; face < 6; face++)
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		map.range = -1.0f; //nothing rendered yet
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	//Depth only, no color buffer to draw to or read from; the caller's framebuffer stays bound
+	GLint previousFramebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGenFramebuffers(1, &shadows.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, shadows.fbo);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+}
+
+// Point every map at its light; a light that moved or changed radius dirties its whole map
+static void UpdateShadowLights(ShadowMaps& shadows, size_t light, const glm::vec3& position, GLfloat radius)
+{
+	ShadowMap& map = shadows.maps[light];
+	GLfloat range = ShadowRange(radius);
+	if (map.position == position && map.range == range)
+		return;
+	map.position = position;
+	map.range = range;
+
+	//Cube map face order +X, -X, +Y, -Y, +Z, -Z with the up vectors the cube map convention expects
+	static const glm::vec3 directions[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+	static const glm::vec3 ups[6] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+	//90 degree square frustum, spelled out because glm::perspective takes degrees or radians depending on its version
+	glm::mat4 projection = glm::frustum(-SHADOW_NEAR_PLANE, SHADOW_NEAR_PLANE, -SHADOW_NEAR_PLANE, SHADOW_NEAR_PLANE, SHADOW_NEAR_PLANE, range);
+	for (int face = 0; face < 6; face++)
+	{
+		map.faceViewProjection[face] = projection * glm::lookAt(position, position + directions[face], ups[face]);
+		map.faceFrusta[face] = ExtractFrustum(map.faceViewProjection[face]);
+		map.faceDirty[face] = true;
+	}
+}
+
+static void DirtyShadowFaces(ShadowMaps& shadows, const Aabb& box)
+{
+	for (ShadowMap& map : shadows.maps)
+		for (int face = 0; face < 6; face++)
+			if (!map.faceDirty[face] && TestFrustumAabb(map.faceFrusta[face], box) != FRUSTUM_OUTSIDE)
+				map.faceDirty[face] = true;
+}
+
+// Compare the objects' boxes with the ones the maps were rendered with and dirty the faces a moved
+// caster left or entered. A changed object count (objects added) dirties everything.
+static void InvalidateShadowCasters(ShadowMaps& shadows, const std::vector<Aabb>& objectBounds)
+{
+	if (shadows.casterBounds.size() != objectBounds.size())
+	{
+		for (ShadowMap& map : shadows.maps)
+			for (bool& dirty : map.faceDirty)
+				dirty = true;
+		shadows.casterBounds = objectBounds;
+		return;
+	}
+
+	for (size_t i = 0; i < objectBounds.size(); i++)
+	{
+		Aabb& previous = shadows.casterBounds[i];
+		if (previous.min == objectBounds[i].min && previous.max == objectBounds[i].max)
+			continue;
+		DirtyShadowFaces(shadows, previous);
+		DirtyShadowFaces(shadows, objectBounds[i]);
+		previous = objectBounds[i];
+	}
+}
+
+// Re-render every dirty face. drawCasters(frustum) draws the casters that may touch the face's
+// frustum with the depth program bound, setting "model" through shadows.modelLoc.
+// The caller's framebuffer and viewport are restored afterwards.
+template<typename DrawCasters>
+static void RenderShadowMaps(ShadowMaps& shadows, const MeshRegistry& meshes, DrawCasters drawCasters)
+{
+	shadows.facesRebuilt = 0;
+	GLint previousFramebuffer = 0, viewport[4];
+	bool bound = false;
+
+	for (ShadowMap& map : shadows.maps)
+		for (int face = 0; face < 6; face++)
+		{
+			if (!map.faceDirty[face])
+				continue;
+			if (!bound)
+			{
+				glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+				glGetIntegerv(GL_VIEWPORT, viewport);
+				glBindFramebuffer(GL_FRAMEBUFFER, shadows.fbo);
+				glViewport(0, 0, shadows.size, shadows.size);
+				glUseProgram(shadows.program);
+				glBindVertexArray(meshes.vao);
+				//Slope-scaled offset keeps lit surfaces from shadowing themselves
+				glEnable(GL_POLYGON_OFFSET_FILL);
+				glPolygonOffset(2.0f, 4.0f);
+				bound = true;
+			}
+
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, map.texture, 0);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			glUniformMatrix4fv(shadows.viewProjectionLoc, 1, GL_FALSE, glm::value_ptr(map.faceViewProjection[face]));
+			drawCasters(map.faceFrusta[face]);
+			map.faceDirty[face] = false;
+			shadows.facesRebuilt++;
+		}
+
+	if (bound)
+	{
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+	shadows.totalFacesRebuilt += shadows.facesRebuilt;
+}
+
+static void DestroyShadowMaps(ShadowMaps& shadows)
+{
+	for (ShadowMap& map : shadows.maps)
+		glDeleteTextures(1, &map.texture);
+	if (shadows.fbo)
+		glDeleteFramebuffers(1, &shadows.fbo);
+	if (shadows.program)
+		glDeleteProgram(shadows.program);
+	shadows = ShadowMaps();
+}
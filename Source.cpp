@@ -8,6 +8,40 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <SOIL2/SOIL2.H>
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Headless.h"
+#include "VertexFormat.h"
+#include "MeshRegistry.h"
+#include "Primitives.h"
+#include "TextureStreamer.h"
+#include "JobPool.h"
+#include "ClusteredLighting.h"
+#include "ProgramCache.h"
+#include "SceneGraph.h"
+#include "Culling.h"
+#include "RenderQueue.h"
+#include "Profiler.h"
+#include "InputQueue.h"
+#include "MeshFile.h"
+#include "ObjImport.h"
+#include "MeshOptimizer.h"
+#include "ShadowMaps.h"
+#include "DynamicResolution.h"
+#include "BatchTransform.h"
+#include "InstanceBatches.h"
+
 using namespace std;
 
 int width, height;
@@ -22,6 +56,8 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 void cursor_position_callback(GLFWwindow* window, double xpos, double ypos);
+void framebuffer_size_callback(GLFWwindow* window, int fbWidth, int fbHeight);
+void window_refresh_callback(GLFWwindow* window);
 
 //Declare View Matrix
 glm::mat4 viewMatrix;
@@ -63,31 +99,76 @@ GLfloat lastX = 320, lastY = 240, xChange, yChange; //center mouse cursor
 //Detect initial mouse movement
 bool firstMouseMove = true;
 
-void initCamera();
+//Set when something on screen may have changed, --on-demand only draws a frame when it is set
+bool frameDirty = true;
+//Longest frame time motion is scaled by, an idle on-demand window would otherwise report its whole wait
+const GLfloat MAX_FRAME_DELTA = 0.1f;
 
-//Light source position
-glm::vec3 lightPosition(0.0f, 0.35f, 0.0f); //adjust position with these
-glm::vec3 lightPosition2(5.0f, 0.8f, 1.0f); //added a second position for the second light
+void initCamera();
 
-// Draw Primitive(s)
-void draw()
+//Point light in the scene, drawn with a small lamp cube above it
+struct PointLight
 {
-	GLenum mode = GL_TRIANGLES;
-	GLsizei indices = 48;  //having less indices isn't a problem
-	glDrawElements(mode, indices, GL_UNSIGNED_BYTE, nullptr);
+	glm::vec3 position;
+	glm::vec3 color;
+	GLfloat radius;	//light fades out at this distance, 0 lights the whole scene
+};
 
+//Most lights the forward shader's uniform arrays hold
+const int MAX_LIGHTS = 64;
 
-}
+//Light sources, adjust positions with these
+vector<PointLight> lights = {
+	{ glm::vec3(0.0f, 0.35f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f), 0.0f },
+	{ glm::vec3(5.0f, 0.8f, 1.0f), glm::vec3(1.0f, 1.0f, 1.0f), 0.0f } //added a second position for the second light
+};
 
-// Draw Primitive(s)
-void drawCylinder()
-{
-	GLenum mode = GL_TRIANGLES;
-	GLsizei indices = 36;
-	glDrawElements(mode, indices, GL_UNSIGNED_BYTE, nullptr);
+//Shade through light clusters (any number of lights) instead of the forward light arrays
+bool clusteredLighting = false;
 
+//Projection depth range, the clusters' depth slices span the same range
+const GLfloat NEAR_PLANE = 0.1f;
+const GLfloat FAR_PLANE = 100.0f;
 
-}
+//CPU and GPU scope timings, always on in the window and on with --trace when headless
+FrameProfiler profiler;
+
+//Per-frame camera and light state, mirrors the std140 FrameData block shared by both programs
+struct FrameUniforms
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec4 viewPos;
+	GLint lightCount[4];	//ivec4, only x is used
+	glm::vec4 clusterScale;	//1 / tile size (x, y), depth slice scale and bias
+	GLint clusterGrid[4];	//tiles x, tiles y, depth slices
+	glm::vec4 lightPos[MAX_LIGHTS];	//w is the radius
+	glm::vec4 lightColor[MAX_LIGHTS];
+};
+
+//Uniform buffer binding point FrameData is attached to
+const GLuint FRAME_UNIFORM_BINDING = 0;
+
+//Lamp cubes float above their light and are scaled down to an 1/8 unit cube
+const glm::vec3 lampOffset(0.f, 5.0f, 0.f);
+const GLfloat lampScale = 0.125f;
+
+// Plane transforms used to build the lamp cube (For Lights)
+const glm::vec3 planePositions3[] = {
+	glm::vec3(0.0f,  0.0f,  0.5f),
+	glm::vec3(0.5f,  0.0f,  0.0f),
+	glm::vec3(0.0f,  0.0f,  -0.5f),
+	glm::vec3(-0.5f, 0.0f,  0.0f),
+	glm::vec3(0.0f, 0.5f,  0.0f),
+	glm::vec3(0.0f, -0.5f,  0.0f)
+};
+
+const glm::float32 planeRotations3[] = {
+	0.0f, 90.0f, 180.0f, -90.0f, -90.f, 90.f
+};
+
+//Driver binaries of linked programs, reused across launches
+ProgramCache programCache;
 
 // Create and Compile Shaders
 static GLuint CompileShader(const string& source, GLuint shaderType)
@@ -102,6 +183,18 @@ static GLuint CompileShader(const string& source, GLuint shaderType)
 	// Compile Shader
 	glCompileShader(shaderID);
 
+	// Log the compiler's diagnostics if it failed
+	GLint compiled = GL_FALSE;
+	glGetShaderiv(shaderID, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		GLint logLength = 0;
+		glGetShaderiv(shaderID, GL_INFO_LOG_LENGTH, &logLength);
+		string log(max(logLength, 1), '\0');
+		glGetShaderInfoLog(shaderID, (GLsizei)log.size(), nullptr, &log[0]);
+		cerr << (shaderType == GL_VERTEX_SHADER ? "Vertex" : "Fragment") << " shader failed to compile:" << endl << log.c_str() << endl;
+	}
+
 	// Return ID of Compiled shader
 	return shaderID;
 
@@ -110,6 +203,17 @@ static GLuint CompileShader(const string& source, GLuint shaderType)
 // Create Program Object
 static GLuint CreateShaderProgram(const string& vertexShader, const string& fragmentShader)
 {
+	auto buildStart = chrono::high_resolution_clock::now();
+
+	// Reuse the binary from an earlier launch if the driver still accepts it
+	uint64_t cacheKey = ProgramCacheKey(programCache, vertexShader, fragmentShader);
+	GLuint cachedProgram = LoadCachedProgram(programCache, cacheKey);
+	if (cachedProgram)
+	{
+		programCache.buildMs += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - buildStart).count();
+		return cachedProgram;
+	}
+
 	// Compile vertex shader
 	GLuint vertexShaderComp = CompileShader(vertexShader, GL_VERTEX_SHADER);
 
@@ -124,20 +228,503 @@ static GLuint CreateShaderProgram(const string& vertexShader, const string& frag
 	glAttachShader(shaderProgram, fragmentShaderComp);
 
 	// Link shaders to create executable
+	PrepareCachedProgram(programCache, shaderProgram);
 	glLinkProgram(shaderProgram);
 
 	// Delete compiled vertex and fragment shaders
 	glDeleteShader(vertexShaderComp);
 	glDeleteShader(fragmentShaderComp);
 
+	// Log the linker's diagnostics and return 0 if it failed, otherwise cache the binary
+	GLint linked = GL_FALSE;
+	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		GLint logLength = 0;
+		glGetProgramiv(shaderProgram, GL_INFO_LOG_LENGTH, &logLength);
+		string log(max(logLength, 1), '\0');
+		glGetProgramInfoLog(shaderProgram, (GLsizei)log.size(), nullptr, &log[0]);
+		cerr << "Shader program failed to link:" << endl << log.c_str() << endl;
+		glDeleteProgram(shaderProgram);
+		shaderProgram = 0;
+	}
+	else
+		StoreCachedProgram(programCache, shaderProgram, cacheKey);
+
+	programCache.buildMs += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - buildStart).count();
+
 	// Return Shader Program
 	return shaderProgram;
 
 }
 
 
-int main(void)
+//Where the camera is and what it looks at, as simulated or interpolated for drawing
+struct CameraPose
+{
+	glm::vec3 position, target;
+};
+
+//View and projection matrices with the camera state they were built from
+struct CameraCache
+{
+	bool valid = false;
+	glm::vec3 position, target, up;
+	GLfloat fov = 0.f;
+	int width = 0, height = 0;
+	glm::mat4 view, projection;
+};
+
+// Rebuild the view and projection matrices only when the camera, fov or framebuffer size changed
+static void UpdateCameraMatrices(CameraCache& camera, const CameraPose& pose, int fbWidth, int fbHeight)
+{
+	if (camera.valid && camera.position == pose.position && camera.target == pose.target && camera.up == worldUp
+		&& camera.fov == fov && camera.width == fbWidth && camera.height == fbHeight)
+		return;
+
+	camera.position = pose.position;
+	camera.target = pose.target;
+	camera.up = worldUp;
+	camera.fov = fov;
+	camera.width = fbWidth;
+	camera.height = fbHeight;
+	camera.view = glm::lookAt(pose.position, pose.target, worldUp);
+	camera.projection = glm::perspective(fov, (GLfloat)fbWidth / (GLfloat)fbHeight, NEAR_PLANE, FAR_PLANE);
+	camera.valid = true;
+}
+
+//One drawable object: where it is placed, what it draws and with which texture
+struct SceneObject
+{
+	SceneNode node;
+	MeshHandle mesh;		//drawn mesh, and the one whose bounds are culled
+	const LodChain* lods;	//if set, the level of detail drawn is picked by screen size instead
+	TextureHandle texture;
+	bool transparent;		//blended after every opaque object, back to front
+};
+
+//Render queue sort ids of the programs and VAOs (small numbers instead of GL names)
+enum RenderSortId
+{
+	SORT_SCENE = 0,	//shaderProgram, drawing from the mesh registry's VAO
+	SORT_LAMP = 1,	//lampShaderProgram with lampVAO
+	SORT_INSTANCED = 2	//instanceProgram, VAO sort id is the batch index
+};
+
+//What one worker thread records into during a frame
+struct WorkerFrameData
+{
+	FrameArena arena;
+	RenderQueue bucket;
+	vector<BvhTask> stack;
+	CullStats stats;
+};
+
+//GL objects that make up the desk scene
+struct SceneResources
+{
+	//All meshes share one vertex and one index buffer, the board reuses the cube mesh
+	MeshRegistry meshes;
+	MeshHandle cubeMesh, floorMesh, lampMesh;
+	LodChain cylinderLods;	//glue stick at several segment counts, picked per frame by screen size
+
+	//Pose the next frame is drawn from and its matrices, kept between frames while the camera is still
+	CameraPose viewPose;
+	CameraCache camera;
+
+	//Object placement, each object's transform is relative to the one it sits on
+	SceneGraph graph;
+	SceneNode glueStickNode, cubeNode, boardNode, floorNode;
+
+	//Objects in draw order, their world-space boxes and the hierarchy the frustum is tested against
+	vector<SceneObject> objects;
+	vector<Aabb> objectBounds;
+	Bvh bvh;
+	vector<BvhTask> cullTasks;	//subtrees handed to the workers
+	CullStats cullStats;	//of the last frame
+
+	//Meshes loaded from --mesh files, and how long mapping and uploading them took
+	vector<MeshHandle> fileMeshes;
+	double meshLoadMs = 0.0;
+
+	//Spinning cubes added by --objects, animated every frame
+	vector<SceneNode> stressNodes;
+	GLfloat animationTime = 0.f;
+
+	//Draws of the current frame, sorted by state and depth; their memory is reset every frame
+	FrameArena frameArena;
+	RenderQueue queue;
+	uint32_t queueStateChanges = 0;	//program, VAO and texture changes of the last frame
+
+	//Per worker thread recording buckets, merged into queue on the GL thread
+	vector<WorkerFrameData> workers;
+	double prepareMs = 0.0, submitMs = 0.0;	//last frame's worker stage and GL thread stage
+
+	//Instanced stress meshes (--instances), their selectors pick from instanceTextures
+	InstanceBatches instances;
+	vector<TextureHandle> instanceTextures;
+	vector<GLint> instanceLayers;	//array layer of each instance texture, resolved every frame
+	GLuint instanceProgram = 0;
+	GLint instanceLayersLoc = -1;
+
+	GLuint lampVAO;			//shared buffers plus the per-instance lamp matrices
+	GLuint lampInstanceVBO;	//one model matrix per light, refilled each frame
+	vector<glm::mat4> lampMatrices;
+	//Textures decode on worker threads and draw a placeholder until they are resident
+	TextureStreamer textures;
+	TextureHandle glueTexture, woodTexture, cubeTexture, boardTexture;
+	GLuint shaderProgram, lampShaderProgram;
+	GLuint frameUBO; //FrameUniforms, written once per frame
+
+	//Light binning for the clustered path, spread over the job pool's threads
+	JobPool jobs;
+	LightClusters clusters;
+	vector<glm::vec4> lightData;	//position + radius, color per light, as the light buffer stores them
+
+	//Cube shadow maps of the first lights, re-rendered only where something moved
+	ShadowMaps shadows;
+
+	//Per-object uniform locations, resolved once after linking
+	GLint modelLoc, normalMatrixLoc, objectColorLoc;
+	GLint materialLayerLoc;	//texture array layer, -1 when textures are bound one by one
+
+	//Depth-only program of the pre-pass (--depth-prepass)
+	GLuint prepassProgram = 0;
+	GLint prepassModelLoc = -1;
+
+	//Samples that passed the depth test while the queue was shaded, counted only when asked for
+	GLuint fragmentQuery = 0;
+	bool countShadedFragments = false;
+	GLuint64 shadedFragments = 0;
+
+	//Offscreen target and controller of the dynamic render scale (--dynamic-resolution)
+	DynamicResolution resolution;
+};
+
+// Upload an object's model matrix with its CPU-computed normal matrix
+static void SetModelUniforms(const SceneResources& scene, const glm::mat4& modelMatrix, const glm::mat3& normalMatrix)
+{
+	glUniformMatrix4fv(scene.modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
+	glUniformMatrix3fv(scene.normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+}
+
+// Resize the job pool and give every thread its own recording bucket
+static void SetWorkerThreads(SceneResources& scene, unsigned threadCount)
+{
+	DestroyJobPool(scene.jobs);
+	InitJobPool(scene.jobs, threadCount);
+	scene.workers.resize(JobPoolThreadCount(scene.jobs));
+	SetProfilerThreads(profiler, JobPoolThreadCount(scene.jobs));
+	for (WorkerFrameData& worker : scene.workers)
+		if (worker.arena.blocks.empty())
+			InitFrameArena(worker.arena, 64 * 1024);
+}
+
+// Record one visible object's draw into a worker's bucket: level of detail and sort key
+static void RecordObjectDraw(const SceneResources& scene, uint32_t objectIndex, const glm::mat4& projectionMatrix, int fbHeight, RenderQueue& bucket)
+{
+	const SceneObject& object = scene.objects[objectIndex];
+	const glm::mat4& model = scene.graph.worldMatrices[object.node];
+
+	// Pick the level of detail from the object's size on screen
+	MeshHandle mesh = object.mesh;
+	if (object.lods)
+	{
+		GLfloat radiusPixels = ProjectedRadiusPixels(object.lods->boundingCenter, object.lods->boundingRadius,
+			model, viewMatrix, projectionMatrix, fbHeight);
+		mesh = SelectLodLevel(*object.lods, radiusPixels);
+	}
+
+	// Sort by state first, then by the view depth of the object's box center
+	const Aabb& bounds = scene.objectBounds[objectIndex];
+	GLfloat viewDepth = -(viewMatrix * glm::vec4((bounds.min + bounds.max) * 0.5f, 1.0f)).z;
+	uint64_t key = MakeRenderKey(object.transparent, SORT_SCENE, SORT_SCENE, object.texture, viewDepth / FAR_PLANE);
+	PushDraw(bucket, key, { scene.shaderProgram, scene.meshes.vao, mesh, object.texture, 0, &model,
+		scene.graph.normalMatrices[object.node] });
+}
+
+// Triangles in the meshes loaded from files
+static size_t FileMeshTriangles(const SceneResources& scene)
+{
+	size_t triangles = 0;
+	for (MeshHandle mesh : scene.fileMeshes)
+		triangles += scene.meshes.meshes[mesh].indexCount / 3;
+	return triangles;
+}
+
+// Advance time-based motion: the --objects cubes spin in place
+static void AnimateScene(SceneResources& scene, GLfloat elapsed)
+{
+	ProfileScope scope(profiler, "Animate");
+	scene.animationTime += elapsed;
+	for (size_t i = 0; i < scene.stressNodes.size(); i++)
+	{
+		GLfloat speed = 0.5f + (GLfloat)(i % 7) * 0.25f;
+		SetNodeRotation(scene.graph, scene.stressNodes[i], glm::angleAxis(scene.animationTime * speed, glm::vec3(0.0f, 1.0f, 0.0f)));
+	}
+}
+
+// Select an object's texture: a layer uniform when textures share one array, otherwise a bind
+static void BindMaterial(const SceneResources& scene, TextureHandle texture)
+{
+	if (scene.textures.arrayTexture)
+		glUniform1i(scene.materialLayerLoc, ResolveTextureLayer(scene.textures, texture));
+	else
+		glBindTexture(GL_TEXTURE_2D, ResolveTexture(scene.textures, texture));
+}
+
+// Point a program's FrameData block at the shared uniform buffer binding
+static void BindFrameUniformBlock(GLuint program)
+{
+	GLuint blockIndex = glGetUniformBlockIndex(program, "FrameData");
+	if (blockIndex != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, blockIndex, FRAME_UNIFORM_BINDING);
+}
+
+//Input from the window thread, replayed by the camera simulation on the render thread
+InputQueue inputQueue;
+
+//The camera is simulated in fixed steps so its motion does not depend on the frame rate
+const double SIMULATION_STEP = 1.0 / 120.0;
+const int MAX_SIMULATION_STEPS = 8;	//a frame that falls further behind skips the missed time
+
+struct CameraSimulation
+{
+	double time = 0.0;			//simulated up to here
+	CameraPose previous, current;	//poses at the end of the last two steps
+	vector<InputEvent> pending;	//drained from the queue, arrived after the last simulated step
+};
+
+static CameraPose CaptureCameraPose()
+{
+	return { cameraPosition, getTarget() };
+}
+
+// Hand a queued event to the handler GLFW used to call directly
+static void ApplyInputEvent(GLFWwindow* window, const InputEvent& event)
+{
+	switch (event.type)
+	{
+	case INPUT_KEY: key_callback(window, event.code, 0, event.action, 0); break;
+	case INPUT_MOUSE_BUTTON: mouse_button_callback(window, event.code, event.action, 0); break;
+	case INPUT_CURSOR: cursor_position_callback(window, event.x, event.y); break;
+	case INPUT_SCROLL: scroll_callback(window, event.x, event.y); break;
+	case INPUT_RESIZE: framebuffer_size_callback(window, event.code, event.action); break;
+	case INPUT_REFRESH: window_refresh_callback(window); break;
+	}
+}
+
+static void InitCameraSimulation(CameraSimulation& simulation, double now)
+{
+	simulation.time = now;
+	simulation.previous = simulation.current = CaptureCameraPose();
+	simulation.pending.clear();
+}
+
+// Run every whole step up to now, each step applying the input that arrived before it ended
+static void StepCameraSimulation(CameraSimulation& simulation, GLFWwindow* window, double now)
+{
+	InputEvent event;
+	while (PopInputEvent(inputQueue, event))
+		simulation.pending.push_back(event);
+
+	if (now - simulation.time > MAX_SIMULATION_STEPS * SIMULATION_STEP)
+		simulation.time = now - SIMULATION_STEP;
+
+	size_t applied = 0;
+	while (simulation.time + SIMULATION_STEP <= now)
+	{
+		double stepEnd = simulation.time + SIMULATION_STEP;
+		simulation.previous = simulation.current;
+		deltaTime = (GLfloat)SIMULATION_STEP; //panning speed is per step, not per rendered frame
+		for (; applied < simulation.pending.size() && simulation.pending[applied].time < stepEnd; applied++)
+			ApplyInputEvent(window, simulation.pending[applied]);
+		TransformCamera();
+		simulation.current = CaptureCameraPose();
+		simulation.time = stepEnd;
+	}
+	simulation.pending.erase(simulation.pending.begin(), simulation.pending.begin() + applied);
+}
+
+// Pose between the last two steps, drawing trails the simulation by up to one step
+static CameraPose InterpolateCameraPose(const CameraSimulation& simulation, double now)
+{
+	GLfloat alpha = (GLfloat)glm::clamp((now - simulation.time) / SIMULATION_STEP, 0.0, 1.0);
+	return { glm::mix(simulation.previous.position, simulation.current.position, alpha),
+		glm::mix(simulation.previous.target, simulation.current.target, alpha) };
+}
+
+static bool CameraPoseMoving(const CameraSimulation& simulation)
+{
+	return simulation.previous.position != simulation.current.position || simulation.previous.target != simulation.current.target;
+}
+
+// GLFW callbacks on the window thread, they only timestamp and queue the event
+static void QueueKeyEvent(GLFWwindow*, int key, int, int action, int)
+{
+	PushInputEvent(inputQueue, { INPUT_KEY, glfwGetTime(), key, action, 0.0, 0.0 });
+}
+static void QueueMouseButtonEvent(GLFWwindow*, int button, int action, int)
 {
+	PushInputEvent(inputQueue, { INPUT_MOUSE_BUTTON, glfwGetTime(), button, action, 0.0, 0.0 });
+}
+static void QueueCursorEvent(GLFWwindow*, double xpos, double ypos)
+{
+	PushInputEvent(inputQueue, { INPUT_CURSOR, glfwGetTime(), 0, 0, xpos, ypos });
+}
+static void QueueScrollEvent(GLFWwindow*, double xoffset, double yoffset)
+{
+	PushInputEvent(inputQueue, { INPUT_SCROLL, glfwGetTime(), 0, 0, xoffset, yoffset });
+}
+static void QueueResizeEvent(GLFWwindow*, int fbWidth, int fbHeight)
+{
+	PushInputEvent(inputQueue, { INPUT_RESIZE, glfwGetTime(), fbWidth, fbHeight, 0.0, 0.0 });
+}
+static void QueueRefreshEvent(GLFWwindow*)
+{
+	PushInputEvent(inputQueue, { INPUT_REFRESH, glfwGetTime(), 0, 0, 0.0, 0.0 });
+}
+
+//Command line options
+struct AppOptions
+{
+	bool headless = false;	//render offscreen and report frame times instead of opening a window
+	int frames = 300;		//measured frames in headless mode
+	int warmupFrames = 10;	//frames rendered before measuring (driver shader compiles, texture uploads)
+	int width = 1280, height = 720;
+	string outputPath;		//write the benchmark report here instead of stdout
+	string screenshotPath;	//save the last headless frame as a binary PPM
+	int lightCount = 0;		//replace the default lights with this many lights on a ring (0 keeps the defaults)
+	TextureCacheFormat textureCache = TEXTURE_CACHE_BC1;	//how textures are stored in their .texcache files
+	int textureArraySize = 0;	//pack textures into a GL_TEXTURE_2D_ARRAY with layers this size (0 binds them one by one)
+	bool bakeTextures = false;	//build the texture caches and exit
+	bool programCache = true;	//reuse linked program binaries from earlier launches
+	int objectCount = 0;		//extra spinning cubes for stress tests
+	int instanceCount = 0;		//instanced cubes, glue sticks and boards of each kind for stress tests
+	bool instanceSweep = false;	//headless: measure 10 to 1,000,000 instances of each kind
+	int threads = 0;			//worker threads, 0 for one per core
+	bool threadSweep = false;	//headless: measure with 1, 2, 4, ... worker threads
+	bool clustered = false;		//shade through light clusters instead of the forward light arrays
+	bool lightSweep = false;	//headless: measure a range of ring light counts instead of one scene
+	string tracePath;			//write a Chrome trace of the profiled frames here (headless: at exit)
+	vector<string> meshFiles;	//binary meshes to place next to the desk
+	string convertInput, convertOutput;	//convert an OBJ file to a binary mesh and exit
+	bool meshOptimizer = true;	//weld and reorder built-in and converted meshes for the vertex cache
+	bool shadows = false;		//cube shadow maps for the first MAX_SHADOWED_LIGHTS lights
+	int shadowPcf = 2;			//shadow lookups per axis, the kernel is shadowPcf^3 lookups
+	int shadowSize = 512;		//shadow cube face resolution
+	bool depthPrepass = false;	//lay down opaque depth first, then shade only the visible fragments
+	bool overdraw = false;		//show how many fragments were shaded per pixel instead of the lit scene
+	double resolutionTargetMs = 0.0;	//GPU budget the render scale is adjusted to hold, 0 always renders at full size
+	float minRenderScale = 0.5f;		//lowest render scale the controller may pick
+	UpscaleMode upscale = UPSCALE_SHARPEN;	//how scaled frames are stretched over the output
+	int transformKernel = -1;	//force a batched transform kernel (TransformKernel), -1 picks the widest the CPU runs
+	bool transformBench = false;	//time the batched transform kernels against glm and exit
+	bool onDemand = false;		//window: only redraw after input, a resize or animation
+	int frameRateCap = 0;		//window: most frames per second, 0 for no cap
+};
+
+//Scene setup, per-frame drawing and teardown shared by the windowed and headless paths
+static void ExecuteRenderQueue(SceneResources& scene, const RenderQueue& queue);
+static void ExecuteDepthPrepass(SceneResources& scene, const RenderQueue& queue);
+void InitScene(SceneResources& scene);
+void RenderScene(SceneResources& scene, int fbWidth, int fbHeight);
+static void RenderFrame(SceneResources& scene, int fbWidth, int fbHeight);
+void DestroyScene(SceneResources& scene);
+
+static bool ParseCommandLine(int argc, char* argv[], AppOptions& options);
+static void PlaceRingLights(int count);
+static int RunHeadlessBenchmark(const AppOptions& options);
+static int BakeTextureCaches(const AppOptions& options);
+static int ConvertObjMesh(const AppOptions& options);
+static int RunTransformBenchmark(const AppOptions& options);
+static void RunRenderLoop(GLFWwindow* window, SceneResources* scene, const AppOptions* options);
+static void WaitForDirtyFrame(SceneResources& scene);
+
+//Cache format InitScene asks the texture streamer for (falls back to RGBA8 without S3TC support)
+TextureCacheFormat textureCacheFormat = TEXTURE_CACHE_BC1;
+//Texture array layer size, 0 keeps one texture object per image
+GLuint textureArraySize = 0;
+//Whether InitScene loads and stores program binaries
+bool programCacheEnabled = true;
+//Spinning cubes InitScene adds around the desk (--objects)
+int stressObjectCount = 0;
+//Whether InitScene sets up the instanced stress meshes, how many of each it draws (--instances) and the texture
+//array layer size they imply
+bool instancedStressScene = false;
+int stressInstanceCount = 0;
+const GLuint INSTANCE_TEXTURE_ARRAY_SIZE = 512;
+//Threads that prepare each frame's draws, 0 uses every core
+unsigned workerThreadCount = 0;
+//Binary mesh files InitScene loads and places beside the desk (--mesh)
+vector<string> sceneMeshFiles;
+//Whether InitScene welds and reorders the built-in meshes as it registers them
+bool optimizeSceneMeshes = true;
+//Shadow maps InitScene sets up (--shadows), kernel size and face resolution
+bool shadowsEnabled = false;
+int shadowPcfKernel = 2;
+int shadowMapSize = 512;
+//Depth pre-pass before the shading pass, and the additive overdraw view instead of lighting
+bool depthPrepass = false;
+bool overdrawView = false;
+//Dynamic resolution budget (0 is off), lowest scale and upscale pass, and the scale the window title shows
+double resolutionTargetMs = 0.0;
+float minRenderScale = 0.5f;
+UpscaleMode upscaleMode = UPSCALE_SHARPEN;
+const float UPSCALE_SHARPNESS = 0.5f;
+atomic<int> renderScalePercent(100);
+//Where the Chrome trace goes, and whether F12 asked for one this frame
+string tracePath = "frame.trace.json";
+bool traceRequested = false;
+
+//Image files the desk scene textures are loaded from
+const char* const sceneTextureFiles[] = { "glueStick.png", "woodTexture.jpeg", "rubik_cube_PNG53.png", "board.png" };
+
+
+int main(int argc, char* argv[])
+{
+	AppOptions options;
+	if (!ParseCommandLine(argc, argv, options))
+		return -1;
+
+	if (options.lightCount > 0)
+		PlaceRingLights(options.lightCount);
+
+	textureCacheFormat = options.textureCache;
+	textureArraySize = (GLuint)options.textureArraySize;
+	clusteredLighting = options.clustered;
+	programCacheEnabled = options.programCache;
+	stressObjectCount = options.objectCount;
+	instancedStressScene = options.instanceCount > 0 || options.instanceSweep;
+	stressInstanceCount = options.instanceSweep ? 0 : options.instanceCount; //the sweep builds its own counts
+	//Instances select their texture by array layer, so they need the texture array
+	if (textureArraySize == 0 && instancedStressScene)
+		textureArraySize = INSTANCE_TEXTURE_ARRAY_SIZE;
+	workerThreadCount = (unsigned)options.threads;
+	if (!options.tracePath.empty())
+		tracePath = options.tracePath;
+	sceneMeshFiles = options.meshFiles;
+	optimizeSceneMeshes = options.meshOptimizer;
+	shadowsEnabled = options.shadows;
+	shadowPcfKernel = options.shadowPcf;
+	shadowMapSize = options.shadowSize;
+	depthPrepass = options.depthPrepass;
+	overdrawView = options.overdraw;
+	resolutionTargetMs = options.resolutionTargetMs;
+	minRenderScale = options.minRenderScale;
+	upscaleMode = options.upscale;
+	if (options.transformKernel >= 0)
+		SetTransformKernel((TransformKernel)options.transformKernel);
+	if (options.transformBench)
+		return RunTransformBenchmark(options);
+	if (options.bakeTextures)
+		return BakeTextureCaches(options);
+	if (!options.convertInput.empty())
+		return ConvertObjMesh(options);
+
+	if (options.headless)
+		return RunHeadlessBenchmark(options);
+
 	width = 640; height = 480;
 
 	GLFWwindow* window;
@@ -154,11 +741,14 @@ int main(void)
 		return -1;
 	}
 
-	//Set input callback functions
-	glfwSetKeyCallback(window, key_callback);
-	glfwSetCursorPosCallback(window, cursor_position_callback);
-	glfwSetMouseButtonCallback(window, mouse_button_callback);
-	glfwSetScrollCallback(window, scroll_callback);
+	//Set input callback functions, they queue events for the render thread
+	InitInputQueue(inputQueue);
+	glfwSetKeyCallback(window, QueueKeyEvent);
+	glfwSetCursorPosCallback(window, QueueCursorEvent);
+	glfwSetMouseButtonCallback(window, QueueMouseButtonEvent);
+	glfwSetScrollCallback(window, QueueScrollEvent);
+	glfwSetFramebufferSizeCallback(window, QueueResizeEvent);
+	glfwSetWindowRefreshCallback(window, QueueRefreshEvent);
 
 	/* Make the window's context current */
 	glfwMakeContextCurrent(window);
@@ -167,222 +757,835 @@ int main(void)
 	if (glewInit() != GLEW_OK)
 		cout << "Error!" << endl;
 
-	GLfloat lampVertices[] = {
-		-0.5, -0.5, 0.0, // index 0
-		-0.5, 0.5, 0.0, // index 1
-		0.5, -0.5, 0.0,  // index 2	
-		0.5, 0.5, 0.0  // index 3	
-	};
+	SceneResources scene;
+	InitScene(scene);
+	InitProfiler(profiler, true, JobPoolThreadCount(scene.jobs));
+	glfwGetFramebufferSize(window, &width, &height);
 
-	//vertices for the provided boxes
-	GLfloat vertices[] = {
+	//Drawing moves to its own thread, this one only waits for window events and queues them
+	glfwMakeContextCurrent(NULL);
+	thread renderThread(RunRenderLoop, window, &scene, &options);
 
-		// Triangle 1
-		-0.5, -0.5, 0.0, // index 0
-		1.0, 0.65, 0.0, // orange
+	/* Loop until the user closes the window */
+	int shownScalePercent = 100;
+	while (!glfwWindowShouldClose(window))
+	{
+		glfwWaitEvents();
 
-		-0.5, 0.5, 0.0, // index 1
-		1.0, 0.65, 0.0, // orange
+		//The render thread wakes this one when the render scale changes, only this thread may set the title
+		int scalePercent = renderScalePercent;
+		if (scalePercent != shownScalePercent)
+		{
+			shownScalePercent = scalePercent;
+			glfwSetWindowTitle(window, ("Main Window - render scale " + to_string(scalePercent) + "%").c_str());
+		}
+	}
 
-		0.5, -0.5, 0.0,  // index 2	
-		1.0, 0.65, 0.0, // orange
+	CloseInputQueue(inputQueue);
+	renderThread.join();
+	glfwMakeContextCurrent(window);
 
-		// Triangle 2	
-		0.5, 0.5, 0.0,  // index 3	
-		1.0, 0.65, 0.0 // orange
+	DestroyProfiler(profiler);
+	DestroyScene(scene);
+
+	glfwTerminate();
+	return 0;
+}
+
+static void PrintUsage(const char* program)
+{
+	cout << "Usage: " << program << " [--headless] [--frames N] [--warmup N] [--resolution WxH] [--output FILE] [--screenshot FILE] [--lights N]"
+		<< " [--texture-cache off|rgba8|bc1] [--bake-textures] [--texture-array SIZE] [--clustered] [--light-sweep] [--program-cache on|off]"
+		<< " [--objects N] [--threads N] [--thread-sweep] [--trace FILE] [--on-demand] [--fps-cap N] [--mesh FILE] [--convert-obj IN OUT]"
+		<< " [--mesh-optimizer on|off] [--shadows] [--shadow-pcf N] [--shadow-size N]"
+		<< " [--depth-prepass] [--overdraw] [--dynamic-resolution MS] [--min-scale F] [--upscale blit|sharpen]"
+		<< " [--transform-kernel scalar|sse2|avx2] [--transform-bench] [--instances N] [--instance-sweep]" << endl;
+	cout << "  --headless        render offscreen (EGL/OSMesa) and report CPU/GPU frame times as JSON" << endl;
+	cout << "  --frames N        number of measured frames (default 300)" << endl;
+	cout << "  --warmup N        frames rendered before measuring (default 10)" << endl;
+	cout << "  --resolution WxH  offscreen framebuffer size (default 1280x720)" << endl;
+	cout << "  --output FILE     write the JSON report to FILE instead of stdout" << endl;
+	cout << "  --screenshot FILE save the last headless frame as a PPM image" << endl;
+	cout << "  --lights N        light the scene with N lights on a ring around the desk" << endl;
+	cout << "  --texture-cache F store textures with their mipmaps in .texcache files as rgba8 or bc1 (default), or off" << endl;
+	cout << "  --bake-textures   build the texture cache files for the scene and exit" << endl;
+	cout << "  --texture-array N pack the scene textures into one texture array with NxN layers" << endl;
+	cout << "  --clustered       shade with clustered forward lighting (up to " << MAX_CLUSTERED_LIGHTS << " lights)" << endl;
+	cout << "  --light-sweep     headless: report frame times for 2 to 1000 ring lights" << endl;
+	cout << "  --program-cache S reuse linked shader binaries from .progcache files (on, default) or compile every launch (off)" << endl;
+	cout << "  --objects N       add N spinning cubes around the desk" << endl;
+	cout << "  --threads N       prepare draws on N threads (default: one per core)" << endl;
+	cout << "  --thread-sweep    headless: report frame times with 1, 2, 4, ... up to --threads worker threads" << endl;
+	cout << "  --trace FILE      write a Chrome trace of CPU and GPU scopes to FILE (headless: at exit, window: on F12)" << endl;
+	cout << "  --on-demand       only redraw the window after input, a resize or animation instead of continuously" << endl;
+	cout << "  --fps-cap N       draw at most N frames per second in the window" << endl;
+	cout << "  --mesh FILE       load a binary .mesh file and place it beside the desk (repeatable)" << endl;
+	cout << "  --convert-obj I O convert the Wavefront OBJ file I to the binary mesh file O and exit" << endl;
+	cout << "  --mesh-optimizer S weld and reorder meshes for the vertex cache when converting and at start-up (on, default) or not (off)" << endl;
+	cout << "  --shadows         cast shadows from the first " << MAX_SHADOWED_LIGHTS << " lights with cached cube shadow maps" << endl;
+	cout << "  --shadow-pcf N    average N x N x N shadow lookups per light (1 to 5, default 2)" << endl;
+	cout << "  --shadow-size N   shadow cube face size in texels (default 512)" << endl;
+	cout << "  --depth-prepass   draw opaque depth with a depth-only program first, then shade only visible fragments" << endl;
+	cout << "  --overdraw        show shaded fragments per pixel (dark red 1, orange 4, yellow 8, white 16 or more)" << endl;
+	cout << "  --dynamic-resolution MS lower the render scale when the scene takes more than MS ms on the GPU" << endl;
+	cout << "  --min-scale F     lowest render scale, 0.25 to 1 (default 0.5)" << endl;
+	cout << "  --upscale M       stretch scaled frames with a linear blit or a bilinear sharpen pass (sharpen, default)" << endl;
+	cout << "  --transform-kernel K build model and normal matrices with the scalar, sse2 or avx2 kernel (default: the widest the CPU supports)" << endl;
+	cout << "  --transform-bench time 1k, 100k and 1M batched transforms against the glm path, report them as JSON and exit" << endl;
+	cout << "  --instances N     fill the desk with N cubes, N glue sticks and N boards, one instanced draw per mesh (implies --texture-array " << INSTANCE_TEXTURE_ARRAY_SIZE << ")" << endl;
+	cout << "  --instance-sweep  headless: report frame times and draw calls for 10 to 1,000,000 (or --instances) instances of each mesh" << endl;
+}
+
+static bool ParseCommandLine(int argc, char* argv[], AppOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--headless")
+			options.headless = true;
+		else if (arg == "--frames" && hasValue)
+			options.frames = atoi(argv[++i]);
+		else if (arg == "--warmup" && hasValue)
+			options.warmupFrames = atoi(argv[++i]);
+		else if (arg == "--resolution" && hasValue)
+		{
+			if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2)
+			{
+				cerr << "Invalid resolution: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (arg == "--output" && hasValue)
+			options.outputPath = argv[++i];
+		else if (arg == "--screenshot" && hasValue)
+			options.screenshotPath = argv[++i];
+		else if (arg == "--lights" && hasValue)
+			options.lightCount = atoi(argv[++i]);
+		else if (arg == "--texture-cache" && hasValue)
+		{
+			string format = argv[++i];
+			if (format == "off")
+				options.textureCache = TEXTURE_CACHE_OFF;
+			else if (format == "rgba8")
+				options.textureCache = TEXTURE_CACHE_RGBA8;
+			else if (format == "bc1")
+				options.textureCache = TEXTURE_CACHE_BC1;
+			else
+			{
+				cerr << "Invalid texture cache format: " << format << endl;
+				return false;
+			}
+		}
+		else if (arg == "--bake-textures")
+			options.bakeTextures = true;
+		else if (arg == "--texture-array" && hasValue)
+			options.textureArraySize = atoi(argv[++i]);
+		else if (arg == "--clustered")
+			options.clustered = true;
+		else if (arg == "--light-sweep")
+			options.lightSweep = true;
+		else if (arg == "--objects" && hasValue)
+			options.objectCount = atoi(argv[++i]);
+		else if (arg == "--instances" && hasValue)
+			options.instanceCount = atoi(argv[++i]);
+		else if (arg == "--instance-sweep")
+			options.instanceSweep = true;
+		else if (arg == "--threads" && hasValue)
+			options.threads = atoi(argv[++i]);
+		else if (arg == "--thread-sweep")
+			options.threadSweep = true;
+		else if (arg == "--trace" && hasValue)
+			options.tracePath = argv[++i];
+		else if (arg == "--mesh" && hasValue)
+			options.meshFiles.push_back(argv[++i]);
+		else if (arg == "--convert-obj" && i + 2 < argc)
+		{
+			options.convertInput = argv[++i];
+			options.convertOutput = argv[++i];
+		}
+		else if (arg == "--shadows")
+			options.shadows = true;
+		else if (arg == "--shadow-pcf" && hasValue)
+			options.shadowPcf = atoi(argv[++i]);
+		else if (arg == "--shadow-size" && hasValue)
+			options.shadowSize = atoi(argv[++i]);
+		else if (arg == "--depth-prepass")
+			options.depthPrepass = true;
+		else if (arg == "--overdraw")
+			options.overdraw = true;
+		else if (arg == "--dynamic-resolution" && hasValue)
+			options.resolutionTargetMs = atof(argv[++i]);
+		else if (arg == "--min-scale" && hasValue)
+			options.minRenderScale = (float)atof(argv[++i]);
+		else if (arg == "--upscale" && hasValue)
+		{
+			string mode = argv[++i];
+			if (mode == "blit")
+				options.upscale = UPSCALE_BLIT;
+			else if (mode == "sharpen")
+				options.upscale = UPSCALE_SHARPEN;
+			else
+			{
+				cerr << "Invalid upscale mode: " << mode << endl;
+				return false;
+			}
+		}
+		else if (arg == "--transform-kernel" && hasValue)
+		{
+			string kernel = argv[++i];
+			if (kernel == "scalar")
+				options.transformKernel = TRANSFORM_SCALAR;
+			else if (kernel == "sse2")
+				options.transformKernel = TRANSFORM_SSE2;
+			else if (kernel == "avx2")
+				options.transformKernel = TRANSFORM_AVX2;
+			else
+			{
+				cerr << "Invalid transform kernel: " << kernel << endl;
+				return false;
+			}
+			if (!TransformKernelSupported((TransformKernel)options.transformKernel))
+			{
+				cerr << "This CPU cannot run the " << kernel << " transform kernel" << endl;
+				return false;
+			}
+		}
+		else if (arg == "--transform-bench")
+			options.transformBench = true;
+		else if (arg == "--on-demand")
+			options.onDemand = true;
+		else if (arg == "--fps-cap" && hasValue)
+			options.frameRateCap = atoi(argv[++i]);
+		else if (arg == "--program-cache" && hasValue)
+		{
+			string state = argv[++i];
+			if (state == "on" || state == "off")
+				options.programCache = state == "on";
+			else
+			{
+				cerr << "Invalid program cache setting: " << state << endl;
+				return false;
+			}
+		}
+		else if (arg == "--mesh-optimizer" && hasValue)
+		{
+			string state = argv[++i];
+			if (state == "on" || state == "off")
+				options.meshOptimizer = state == "on";
+			else
+			{
+				cerr << "Invalid mesh optimizer setting: " << state << endl;
+				return false;
+			}
+		}
+		else
+		{
+			PrintUsage(argv[0]);
+			return false;
+		}
+	}
+
+	if (options.frames <= 0 || options.warmupFrames < 0 || options.width <= 0 || options.height <= 0 || options.lightCount < 0
+		|| options.textureArraySize < 0 || options.textureArraySize > 8192 || options.objectCount < 0 || options.instanceCount < 0 || options.threads < 0 || options.frameRateCap < 0
+		|| options.shadowPcf < 1 || options.shadowPcf > 5 || options.shadowSize < 16 || options.shadowSize > 4096
+		|| options.resolutionTargetMs < 0.0 || options.minRenderScale < 0.25f || options.minRenderScale > 1.0f)
+	{
+		PrintUsage(argv[0]);
+		return false;
+	}
+	return true;
+}
+
+// Replace the light list with count lights spread on a ring around the desk.
+// Each light only reaches RING_LIGHT_RADIUS, colors are scaled by how many lights overlap a
+// point on the ring so a dense ring is about as bright as two lights.
+const GLfloat RING_LIGHT_RADIUS = 4.f;
+static void PlaceRingLights(int count)
+{
+	lights.clear();
+	GLfloat ringRadius = 6.f;
+	GLfloat overlapping = (GLfloat)count * 2.f * RING_LIGHT_RADIUS / (2.f * glm::pi<float>() * ringRadius);
+	GLfloat intensity = 2.f / max(2.f, overlapping);
+	for (int i = 0; i < count; i++)
+	{
+		GLfloat angle = (GLfloat)i / (GLfloat)count * 2.f * glm::pi<float>();
+		glm::vec3 position(ringRadius * cosf(angle), 0.8f, ringRadius * sinf(angle));
+		lights.push_back({ position, glm::vec3(intensity, intensity, intensity), RING_LIGHT_RADIUS });
+	}
+}
+
+//Per-frame measurements of one headless run
+struct FrameMeasurements
+{
+	vector<double> cpuFrameTimes, gpuFrameTimes, binTimes;
+	vector<double> prepareTimes, submitTimes;	//worker stage and GL thread stage of each frame
+	vector<double> shadowFaces;	//shadow cube faces re-rendered each frame
+	vector<double> renderScales;	//dynamic resolution scale of each frame
+	size_t lightReferences = 0;	//light-cluster pairs of the last frame
+};
+
+// Render warmupFrames + frames frames and collect the times of the measured ones
+static FrameMeasurements MeasureFrames(SceneResources& scene, const AppOptions& options)
+{
+	//Ring of timer queries so reading a result never waits on the frame that was just submitted
+	const int queryCount = 4;
+	GLuint timerQueries[queryCount];
+	glGenQueries(queryCount, timerQueries);
+
+	FrameMeasurements measurements;
+	measurements.cpuFrameTimes.reserve(options.frames);
+	measurements.gpuFrameTimes.reserve(options.frames);
+	measurements.binTimes.reserve(options.frames);
+
+	int totalFrames = options.warmupFrames + options.frames;
+	for (int frame = 0; frame < totalFrames + queryCount; frame++)
+	{
+		//Collect the GPU time of the frame that used this query slot
+		int slot = frame % queryCount;
+		int previousFrame = frame - queryCount;
+		if (previousFrame >= options.warmupFrames)
+		{
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(timerQueries[slot], GL_QUERY_RESULT, &elapsed);
+			measurements.gpuFrameTimes.push_back((double)elapsed / 1.0e6);
+		}
+
+		if (frame >= totalFrames)
+			continue; //only draining outstanding queries
+
+		BeginProfilerFrame(profiler);
+		deltaTime = 1.f / 60.f; //fixed step keeps any time-based motion deterministic
+		AnimateScene(scene, deltaTime);
+		scene.viewPose = CaptureCameraPose();
+
+		scene.countShadedFragments = frame == totalFrames - 1;
+		glBeginQuery(GL_TIME_ELAPSED, timerQueries[slot]);
+		auto cpuStart = chrono::high_resolution_clock::now();
+
+		RenderFrame(scene, options.width, options.height);
+
+		auto cpuEnd = chrono::high_resolution_clock::now();
+		glEndQuery(GL_TIME_ELAPSED);
+		glFlush();
+
+		if (frame >= options.warmupFrames)
+		{
+			measurements.cpuFrameTimes.push_back(chrono::duration<double, milli>(cpuEnd - cpuStart).count());
+			measurements.binTimes.push_back(scene.clusters.binMs);
+			measurements.prepareTimes.push_back(scene.prepareMs);
+			measurements.submitTimes.push_back(scene.submitMs);
+			measurements.shadowFaces.push_back(scene.shadows.facesRebuilt);
+			measurements.renderScales.push_back(scene.resolution.enabled ? scene.resolution.scale : 1.0);
+		}
+	}
+
+	glFinish();
+	glDeleteQueries(queryCount, timerQueries);
+	measurements.lightReferences = scene.clusters.lightReferences;
+	return measurements;
+}
+
+// Measure the scene lit by 2 to 1000 ring lights, the forward path only shades MAX_LIGHTS of them
+static string RunLightSweep(SceneResources& scene, const AppOptions& options)
+{
+	const int lightCounts[] = { 2, 4, 8, 16, 32, 64, 128, 256, 512, 1000 };
+
+	string results;
+	for (int count : lightCounts)
+	{
+		PlaceRingLights(count);
+		FrameMeasurements measurements = MeasureFrames(scene, options);
+
+		if (!results.empty())
+			results += ",";
+		results += "{\"lights\":" + to_string(count)
+			+ ",\"shaded_lights\":" + to_string(clusteredLighting ? min(count, MAX_CLUSTERED_LIGHTS) : min(count, MAX_LIGHTS))
+			+ ",\"light_refs\":" + to_string(measurements.lightReferences)
+			+ ",\"cpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.cpuFrameTimes))
+			+ ",\"gpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.gpuFrameTimes))
+			+ ",\"bin_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.binTimes))
+			+ "}";
+	}
+	return "\"mode\":\"light_sweep\",\"clustered\":" + string(clusteredLighting ? "true" : "false")
+		+ ",\"threads\":" + to_string(JobPoolThreadCount(scene.jobs))
+		+ ",\"results\":[" + results + "]";
+}
+
+// Measure the same scene with 1, 2, 4, ... worker threads up to the configured count
+static string RunThreadSweep(SceneResources& scene, const AppOptions& options)
+{
+	unsigned maxThreads = JobPoolThreadCount(scene.jobs);
+	vector<unsigned> threadCounts;
+	for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	string results;
+	for (unsigned threads : threadCounts)
+	{
+		SetWorkerThreads(scene, threads);
+		FrameMeasurements measurements = MeasureFrames(scene, options);
+
+		if (!results.empty())
+			results += ",";
+		results += "{\"threads\":" + to_string(threads)
+			+ ",\"cpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.cpuFrameTimes))
+			+ ",\"prepare_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.prepareTimes))
+			+ ",\"submit_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.submitTimes))
+			+ ",\"gpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.gpuFrameTimes))
+			+ "}";
+	}
+	return "\"mode\":\"thread_sweep\",\"objects\":" + to_string(scene.objects.size())
+		+ ",\"visible\":" + to_string(scene.cullStats.visible)
+		+ ",\"results\":[" + results + "]";
+}
+
+// Measure the desk filled with 10, 100, ... up to 1,000,000 instances of each stress mesh (or up to --instances).
+// Every count is still a single draw per mesh, so the curve shows what instancing costs per instance.
+static string RunInstanceSweep(SceneResources& scene, const AppOptions& options)
+{
+	size_t maxInstances = options.instanceCount > 0 ? (size_t)options.instanceCount : 1000000;
+	vector<size_t> instanceCounts;
+	for (size_t count = 10; count < maxInstances; count *= 10)
+		instanceCounts.push_back(count);
+	instanceCounts.push_back(maxInstances);
+
+	string results;
+	for (size_t count : instanceCounts)
+	{
+		if (!BuildInstances(scene.instances, scene.meshes, count, (GLuint)scene.instanceTextures.size()))
+		{
+			cerr << "Could not allocate " << count << " instances of each mesh, stopping the sweep" << endl;
+			break;
+		}
+		FrameMeasurements measurements = MeasureFrames(scene, options);
+
+		if (!results.empty())
+			results += ",";
+		results += "{\"per_mesh\":" + to_string(count)
+			+ ",\"instances\":" + to_string(InstanceCount(scene.instances))
+			+ ",\"triangles\":" + to_string(InstanceTriangles(scene.instances, scene.meshes))
+			+ ",\"buffer_bytes\":" + to_string(scene.instances.bufferBytes)
+			+ ",\"build_ms\":" + to_string(scene.instances.buildMs)
+			+ ",\"draw_calls\":" + to_string(scene.queue.count)
+			+ ",\"cpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.cpuFrameTimes))
+			+ ",\"submit_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.submitTimes))
+			+ ",\"gpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.gpuFrameTimes))
+			+ "}";
+	}
+	return "\"mode\":\"instance_sweep\",\"meshes\":" + to_string(scene.instances.batches.size())
+		+ ",\"transform_kernel\":\"" + string(TransformKernelName(ActiveTransformKernel())) + "\""
+		+ ",\"results\":[" + results + "]";
+}
+
+// Render the scene offscreen for a fixed number of frames and report CPU/GPU frame times
+static int RunHeadlessBenchmark(const AppOptions& options)
+{
+	HeadlessContext context;
+	if (!CreateHeadlessContext(context))
+	{
+		cerr << "Failed to create headless OpenGL context" << endl;
+		DestroyHeadlessContext(context);
+		return -1;
+	}
+
+	// Initialize GLEW (core functions still load when there is no GLX display)
+	glewExperimental = GL_TRUE;
+	GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	if (glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+		glewStatus = GLEW_OK;
+#endif
+	if (glewStatus != GLEW_OK)
+	{
+		cerr << "Error initializing GLEW: " << glewGetErrorString(glewStatus) << endl;
+		DestroyHeadlessContext(context);
+		return -1;
+	}
+	glGetError(); //glewExperimental can leave GL_INVALID_ENUM behind on core contexts
+
+	OffscreenTarget target;
+	if (!CreateOffscreenTarget(target, options.width, options.height))
+	{
+		cerr << "Offscreen framebuffer is incomplete" << endl;
+		DestroyOffscreenTarget(target);
+		DestroyHeadlessContext(context);
+		return -1;
+	}
+
+	width = options.width; height = options.height;
+
+	SceneResources scene;
+	auto initStart = chrono::high_resolution_clock::now();
+	InitScene(scene);
+	auto initEnd = chrono::high_resolution_clock::now();
+
+	//Measured frames should show the final textures, so wait for every texture to be resident
+	FinishTextureLoads(scene.textures);
+	auto texturesEnd = chrono::high_resolution_clock::now();
+	InitProfiler(profiler, !options.tracePath.empty(), JobPoolThreadCount(scene.jobs));
+
+	string report;
+	if (options.lightSweep || options.threadSweep || options.instanceSweep)
+		report = "{" + (options.lightSweep ? RunLightSweep(scene, options)
+				: options.threadSweep ? RunThreadSweep(scene, options) : RunInstanceSweep(scene, options))
+			+ ",\"backend\":\"" + string(context.backend) + "\""
+			+ ",\"renderer\":\"" + JsonEscape((const char*)glGetString(GL_RENDERER)) + "\""
+			+ ",\"width\":" + to_string(options.width)
+			+ ",\"height\":" + to_string(options.height)
+			+ ",\"frames\":" + to_string(options.frames)
+			+ "}";
+	else
+	{
+		FrameMeasurements measurements = MeasureFrames(scene, options);
+		report = "{\"mode\":\"headless\",\"backend\":\"" + string(context.backend) + "\""
+			+ ",\"renderer\":\"" + JsonEscape((const char*)glGetString(GL_RENDERER)) + "\""
+			+ ",\"width\":" + to_string(options.width)
+			+ ",\"height\":" + to_string(options.height)
+			+ ",\"frames\":" + to_string(options.frames)
+			+ ",\"lights\":" + to_string(lights.size())
+			+ ",\"clustered\":" + string(clusteredLighting ? "true" : "false")
+			+ ",\"init_ms\":" + to_string(chrono::duration<double, milli>(initEnd - initStart).count())
+			+ ",\"textures_ready_ms\":" + to_string(chrono::duration<double, milli>(texturesEnd - initStart).count())
+			+ ",\"texture_bytes\":" + to_string(TextureMemoryBytes(scene.textures))
+			+ ",\"objects\":{\"visible\":" + to_string(scene.cullStats.visible)
+			+ ",\"culled\":" + to_string(scene.cullStats.culled)
+			+ ",\"boxes_tested\":" + to_string(scene.cullStats.nodesTested) + "}"
+			+ ",\"queue\":{\"draws\":" + to_string(scene.queue.count)
+			+ ",\"state_changes\":" + to_string(scene.queueStateChanges)
+			+ ",\"arena_bytes\":" + to_string(scene.frameArena.frameBytes)
+			+ ",\"arena_grows\":" + to_string(scene.frameArena.grows) + "}"
+			+ ",\"program_ms\":" + to_string(programCache.buildMs)
+			+ ",\"program_cache\":{\"enabled\":" + string(programCache.enabled ? "true" : "false")
+			+ ",\"hits\":" + to_string(programCache.hits)
+			+ ",\"misses\":" + to_string(programCache.misses)
+			+ ",\"rejected\":" + to_string(programCache.rejected) + "}"
+			+ ",\"threads\":" + to_string(JobPoolThreadCount(scene.jobs))
+			+ ",\"transform_kernel\":\"" + string(TransformKernelName(ActiveTransformKernel())) + "\""
+			+ (scene.fileMeshes.empty() ? string() : ",\"mesh_files\":{\"count\":" + to_string(scene.fileMeshes.size())
+				+ ",\"triangles\":" + to_string(FileMeshTriangles(scene)) + ",\"load_ms\":" + to_string(scene.meshLoadMs) + "}")
+			+ (scene.instances.perBatch > 0 ? ",\"instances\":{\"per_mesh\":" + to_string(scene.instances.perBatch)
+				+ ",\"count\":" + to_string(InstanceCount(scene.instances))
+				+ ",\"triangles\":" + to_string(InstanceTriangles(scene.instances, scene.meshes))
+				+ ",\"buffer_bytes\":" + to_string(scene.instances.bufferBytes)
+				+ ",\"build_ms\":" + to_string(scene.instances.buildMs) + "}" : string())
+			+ ",\"mesh_optimizer\":{\"enabled\":" + string(scene.meshes.optimizeMeshes ? "true" : "false")
+			+ ",\"vertices_before\":" + to_string(scene.meshes.optimizeStats.verticesBefore)
+			+ ",\"vertices_after\":" + to_string(scene.meshes.optimizeStats.verticesAfter)
+			+ ",\"acmr_before\":" + to_string(AcmrBefore(scene.meshes.optimizeStats))
+			+ ",\"acmr_after\":" + to_string(AcmrAfter(scene.meshes.optimizeStats))
+			+ ",\"ms\":" + to_string(scene.meshes.optimizeStats.ms) + "}"
+			+ ",\"cpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.cpuFrameTimes))
+			+ ",\"prepare_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.prepareTimes))
+			+ ",\"submit_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.submitTimes))
+			+ ",\"gpu_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.gpuFrameTimes))
+			+ (clusteredLighting ? ",\"bin_ms\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.binTimes)) : string())
+			+ (scene.shadows.enabled ? ",\"shadows\":{\"maps\":" + to_string(scene.shadows.maps.size())
+				+ ",\"size\":" + to_string(scene.shadows.size) + ",\"pcf\":" + to_string(scene.shadows.pcfKernel)
+				+ ",\"faces_rebuilt\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.shadowFaces))
+				+ ",\"faces_rebuilt_total\":" + to_string(scene.shadows.totalFacesRebuilt) + "}" : string())
+			+ (scene.resolution.enabled ? ",\"dynamic_resolution\":{\"target_ms\":" + to_string(scene.resolution.targetMs)
+				+ ",\"upscale\":\"" + string(scene.resolution.upscale == UPSCALE_BLIT ? "blit" : "sharpen") + "\""
+				+ ",\"scale\":" + FrameTimeSummaryJson(SummarizeFrameTimes(measurements.renderScales))
+				+ ",\"final_scale\":" + to_string(scene.resolution.scale)
+				+ ",\"scene_gpu_ms\":" + to_string(scene.resolution.gpuMs)
+				+ ",\"changes\":" + to_string(scene.resolution.scaleChanges) + "}" : string())
+			+ ",\"fill\":{\"depth_prepass\":" + string(depthPrepass ? "true" : "false")
+			+ ",\"overdraw_view\":" + string(overdrawView ? "true" : "false")
+			+ ",\"shaded_fragments\":" + to_string(scene.shadedFragments)
+			+ ",\"per_pixel\":" + to_string((double)scene.shadedFragments / ((double)options.width * options.height)) + "}"
+			+ (profiler.enabled ? ",\"trace\":{\"file\":\"" + JsonEscape(tracePath.c_str()) + "\",\"gpu_frames_dropped\":" + to_string(profiler.droppedGpuFrames) + "}" : string())
+			+ "}";
+	}
+
+	if (options.outputPath.empty())
+		cout << report << endl;
+	else
+		ofstream(options.outputPath) << report << endl;
+
+	if (!options.screenshotPath.empty())
+		SaveFramebufferPPM(options.screenshotPath, options.width, options.height);
+
+	int result = 0;
+	if (profiler.enabled)
+	{
+		FinishProfiler(profiler);
+		if (!WriteChromeTrace(profiler, tracePath.c_str()))
+		{
+			cerr << "Failed to write " << tracePath << endl;
+			result = -1;
+		}
+	}
+
+	DestroyProfiler(profiler);
+	DestroyScene(scene);
+	DestroyOffscreenTarget(target);
+	DestroyHeadlessContext(context);
+	return result;
+}
+
+// Transcode every scene texture into its cache file ahead of time (no GL context needed)
+static int BakeTextureCaches(const AppOptions& options)
+{
+	if (options.textureCache == TEXTURE_CACHE_OFF)
+	{
+		cerr << "--bake-textures needs a texture cache format" << endl;
+		return -1;
+	}
+
+	int failures = 0;
+	for (const char* file : sceneTextureFiles)
+	{
+		auto start = chrono::high_resolution_clock::now();
+		bool built = BuildTextureCache(file, options.textureCache);
+		auto end = chrono::high_resolution_clock::now();
+		if (built)
+			cout << TextureCachePath(file) << " (" << chrono::duration<double, milli>(end - start).count() << " ms)" << endl;
+		else
+		{
+			cerr << "Failed to bake " << file << endl;
+			failures++;
+		}
+	}
+	return failures ? -1 : 0;
+}
+
+// Render thread body: owns the GL context, simulates the camera from queued input and draws
+// until the window thread closes the input queue
+static void RunRenderLoop(GLFWwindow* window, SceneResources* scenePointer, const AppOptions* optionsPointer)
+{
+	SceneResources& scene = *scenePointer;
+	const AppOptions& options = *optionsPointer;
+	glfwMakeContextCurrent(window);
+
+	CameraSimulation simulation;
+	InitCameraSimulation(simulation, glfwGetTime());
+	while (!inputQueue.closed)
+	{
+		//Input, resizes and camera movement up to now
+		double now = glfwGetTime();
+		StepCameraSimulation(simulation, window, now);
+
+		//On demand, a frame with nothing new in it is not drawn
+		if (options.onDemand && !frameDirty && !CameraPoseMoving(simulation) && scene.stressNodes.empty())
+		{
+			WaitForDirtyFrame(scene);
+			continue;
+		}
+
+		BeginProfilerFrame(profiler);
+
+		//Set Delta time
+		GLfloat currentFrame = (GLfloat)now;
+		GLfloat frameDelta = min(currentFrame - lastFrame, MAX_FRAME_DELTA);
+		lastFrame = currentFrame;
+		frameDirty = false; //anything arriving from here on needs another frame
+		scene.viewPose = InterpolateCameraPose(simulation, now);
+
+		//Move any newly decoded textures to the GPU
+		ProfileScope uploadScope(profiler, "Texture uploads", true);
+		PumpTextureUploads(scene.textures);
+		uploadScope.End();
+
+		AnimateScene(scene, frameDelta);
+		RenderFrame(scene, width, height);
+		if (scene.resolution.enabled && (int)(scene.resolution.scale * 100.0f + 0.5f) != renderScalePercent)
+		{
+			renderScalePercent = (int)(scene.resolution.scale * 100.0f + 0.5f);
+			glfwPostEmptyEvent();
+		}
+
+	    /* Swap front and back buffers */
+		ProfileScope swapScope(profiler, "Swap buffers");
+		glfwSwapBuffers(window);
+		swapScope.End();
+
+		//F12 writes the kept frames as a Chrome trace
+		if (traceRequested)
+		{
+			traceRequested = false;
+			FinishProfiler(profiler);
+			if (WriteChromeTrace(profiler, tracePath.c_str()))
+				cout << "Wrote " << tracePath << endl;
+			else
+				cerr << "Failed to write " << tracePath << endl;
+		}
+
+		//Hold the frame rate down to the cap
+		if (options.frameRateCap > 0)
+		{
+			double frameEnd = now + 1.0 / options.frameRateCap;
+			double afterFrame = glfwGetTime();
+			if (afterFrame < frameEnd)
+				this_thread::sleep_for(chrono::duration<double>(frameEnd - afterFrame));
+		}
+	}
+
+	glfwMakeContextCurrent(NULL);
+}
+
+// Import an OBJ file and write it as a binary mesh file (no GL context needed)
+static int ConvertObjMesh(const AppOptions& options)
+{
+	auto start = chrono::high_resolution_clock::now();
+	vector<PackedVertex> vertices;
+	vector<GLuint> meshIndices;
+	string error;
+	if (!ImportObj(options.convertInput, vertices, meshIndices, error))
+	{
+		cerr << "Failed to import " << options.convertInput << ": " << error << endl;
+		return -1;
+	}
+	auto imported = chrono::high_resolution_clock::now();
+
+	MeshOptimizeStats optimized;
+	if (options.meshOptimizer)
+		optimized = OptimizeMesh(vertices, meshIndices);
+	auto optimizedEnd = chrono::high_resolution_clock::now();
+
+	if (!WriteMeshFile(options.convertOutput, vertices, meshIndices))
+	{
+		cerr << "Failed to write " << options.convertOutput << endl;
+		return -1;
+	}
+	auto written = chrono::high_resolution_clock::now();
+
+	cout << options.convertOutput << ": " << vertices.size() << " vertices, " << meshIndices.size() / 3 << " triangles"
+		<< " (import " << chrono::duration<double, milli>(imported - start).count() << " ms"
+		<< ", write " << chrono::duration<double, milli>(written - optimizedEnd).count() << " ms)" << endl;
+	if (options.meshOptimizer)
+		cout << "  optimized in " << optimized.ms << " ms: " << optimized.verticesBefore << " -> " << optimized.verticesAfter << " vertices"
+			<< ", ACMR " << AcmrBefore(optimized) << " -> " << AcmrAfter(optimized) << " (FIFO " << MESH_FIFO_CACHE_SIZE << ")" << endl;
+	return 0;
+}
+
+// Time building count model and normal matrices the way the scene graph used to (glm translate,
+// rotate and scale, then an inverse transpose) against every batched kernel the CPU runs, and check
+// that the kernels agree with glm (no GL context needed)
+static string TimeTransformBatch(size_t count)
+{
+	mt19937 random(1234);
+	uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	vector<glm::vec3> positions(count), scales(count);
+	vector<glm::quat> rotations(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		positions[i] = glm::vec3(unit(random), unit(random), unit(random)) * 50.0f;
+		rotations[i] = glm::normalize(glm::quat(unit(random), unit(random), unit(random), unit(random)));
+		scales[i] = glm::vec3(unit(random), unit(random), unit(random)) * 1.5f + glm::vec3(2.0f);
+	}
+
+	//Every method runs on about 4M transforms in total, at least 5 times
+	size_t repeats = max((size_t)5, (size_t)4000000 / count);
+	vector<glm::mat4> glmModels(count), models(count);
+	vector<glm::mat3> glmNormals(count), normals(count);
+	vector<double> times;
+	auto timeMethod = [&](const char* name, auto build)
+	{
+		times.clear();
+		for (size_t repeat = 0; repeat < repeats; repeat++)
+		{
+			auto start = chrono::high_resolution_clock::now();
+			build();
+			times.push_back(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+		}
+		FrameTimeSummary summary = SummarizeFrameTimes(times);
+		return ",\"" + string(name) + "\":{\"ms\":" + FrameTimeSummaryJson(summary)
+			+ ",\"ns_per_transform\":" + to_string(summary.min * 1.0e6 / count) + "}";
 	};
 
-	GLfloat cylinderVertices[] = {
-		//rear panel points 
+	string result = "{\"count\":" + to_string(count);
+	result += timeMethod("glm", [&]()
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			glm::mat4 model = glm::translate(glm::mat4(1.0f), positions[i]) * glm::mat4_cast(rotations[i]);
+			glmModels[i] = glm::scale(model, scales[i]);
+			glmNormals[i] = glm::transpose(glm::inverse(glm::mat3(glmModels[i])));
+		}
+	});
 
-		//bottom left
-		0.25, 0.0, 1.0,	//point (0)
-		0.0, 0.0, 0.0, //color not used but kept to use with current shader
-		0.0, 0.0,	//uv
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom right
-		-0.25, 0.0, 1.0,  //1
-		0.0, 0.0, 0.0,
-		0.32, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left
-		0.25, 2.0, 1.0,  //2
-		0.0, 0.0, 0.0,
-		0.0, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right
-		-0.25, 2.0, 1.0,  //3
-		0.0, 0.0, 0.0,
-		0.32, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
+	bool modelsExact = true;
+	float normalError = 0.0f;
+	for (int kernel = TRANSFORM_SCALAR; kernel <= TRANSFORM_AVX2; kernel++)
+	{
+		if (!TransformKernelSupported((TransformKernel)kernel))
+			continue;
+		result += timeMethod(TransformKernelName((TransformKernel)kernel), [&]()
+		{
+			BatchTransformsWith((TransformKernel)kernel, positions.data(), rotations.data(), scales.data(), count, models.data(), normals.data());
+		});
+		for (size_t i = 0; i < count; i++)
+			for (int column = 0; column < 4; column++)
+				for (int row = 0; row < 4; row++)
+				{
+					modelsExact = modelsExact && models[i][column][row] == glmModels[i][column][row];
+					if (column < 3 && row < 3)
+						normalError = max(normalError, fabsf(normals[i][column][row] - glmNormals[i][column][row]));
+				}
+	}
+	return result + ",\"models_match_glm\":" + string(modelsExact ? "true" : "false")
+		+ ",\"normal_max_difference\":" + to_string(normalError) + "}";
+}
+
+static int RunTransformBenchmark(const AppOptions& options)
+{
+	string results;
+	for (size_t count : { (size_t)1000, (size_t)100000, (size_t)1000000 })
+		results += (results.empty() ? "" : ",") + TimeTransformBatch(count);
+	string report = "{\"mode\":\"transform_bench\",\"kernel\":\"" + string(TransformKernelName(ActiveTransformKernel())) + "\""
+		+ ",\"results\":[" + results + "]}";
+
+	if (options.outputPath.empty())
+		cout << report << endl;
+	else
+		ofstream(options.outputPath) << report << endl;
+	return 0;
+}
 
-		//left rear panel points
+// Sleep until something may need a new frame: queued input (the simulation decides whether it
+// changed anything), or a texture becoming resident. While textures are still streaming in the
+// wait times out regularly so finished ones are uploaded.
+const double TEXTURE_POLL_SECONDS = 0.05;
+const double IDLE_WAIT_SECONDS = 1.0;
+static void WaitForDirtyFrame(SceneResources& scene)
+{
+	while (!frameDirty && InputQueueEmpty(inputQueue) && !inputQueue.closed)
+	{
+		WaitForInput(inputQueue, TextureLoadsPending(scene.textures) ? TEXTURE_POLL_SECONDS : IDLE_WAIT_SECONDS);
+		if (PumpTextureUploads(scene.textures) > 0)
+			frameDirty = true;
+	}
+}
 
-		//bottom left
-		-0.25, 0.0, 1.0, //4
-		0.0, 0.0, 0.0,
-		0.33, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//botom right
-		-0.5, 0.0, 0.5, //5
-		0.0, 0.0, 0.0,
-		0.67, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left 
-		-0.25, 2.0, 1.0, //6
-		0.0, 0.0, 0.0,
-		0.33, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right
-		-0.5, 2.0, 0.5, //7
-		0.0, 0.0, 0.0,
-		0.67, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
+// Create geometry, textures and shader programs for the desk scene
+void InitScene(SceneResources& scene)
+{
+	GLfloat lampVertices[] = {
+		-0.5, -0.5, 0.0, // index 0
+		-0.5, 0.5, 0.0, // index 1
+		0.5, -0.5, 0.0,  // index 2	
+		0.5, 0.5, 0.0  // index 3	
+	};
+
+	//vertices for the provided boxes
+	GLfloat vertices[] = {
 
-		//Left front panel
-		//bottom left
-		-0.5, 0.0, 0.5, //8
-		0.0, 0.0, 0.0,
-		0.68,0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom right
-		-0.25, 0.0, 0.0, //9
-		0.0, 0.0, 0.0,
-		1.0, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left
-		-0.5, 2.0, 0.5, //10
-		0.0, 0.0, 0.0,
-		0.68, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right 
-		-0.25, 2.0, 0.0, //11
-		0.0, 0.0, 0.0,
-		1.0, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		 
-		//Front Panel
-		//bottom left
-		-0.25, 0.0, 0.0, //12
-		0.0, 0.0, 0.0,
-		0.0, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom right
-		0.25, 0.0, 0.0, //13
-		0.0, 0.0, 0.0,
-		0.32, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left
-		-0.25, 2.0, 0.0, //14
-		0.0, 0.0, 0.0,
-		0.0, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right
-		0.25, 2.0, 0.0,  //15
-		0.0, 0.0, 0.0,
-		0.32, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		
-		//right front panel
-		//bottom left
-		0.25, 0.0, 0.0, //16
-		0.0, 0.0, 0.0,
-		0.33, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom right
-		0.5, 0.0, 0.5, //17
-		0.0, 0.0, 0.0,
-		0.67, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left
-		0.25, 2.0, 0.0, //18
-		0.0, 0.0, 0.0,
-		0.33, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right
-		0.5, 2.0, 0.5,  //19
-		0.0, 0.0, 0.0,
-		0.67, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
+		// Triangle 1
+		-0.5, -0.5, 0.0, // index 0
+		1.0, 0.65, 0.0, // orange
 
-		//right rear panel
-		//bottom left
-		0.5, 0.0, 0.5, //20
-		0.0, 0.0, 0.0,
-		0.68, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom right
-		0.25, 0.0, 1.0, //21
-		0.0, 0.0, 0.0,
-		1.0, 0.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top left
-		0.5, 2.0, 0.5, //22
-		0.0, 0.0, 0.0,
-		0.68, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
-		//top right
-		0.25, 2.0, 1.0, //23
-		0.0, 0.0, 0.0,
-		1.0, 1.0,
-		0.0f, 0.0f, 1.0f, //normal positive z
+		-0.5, 0.5, 0.0, // index 1
+		1.0, 0.65, 0.0, // orange
 
+		0.5, -0.5, 0.0,  // index 2	
+		1.0, 0.65, 0.0, // orange
 
-		//make a top piece
-		//top middle
-			-.25, 2.0, 1.0, //24
-			0.0, 0.0, 0.0,
-			0.0, 1.0,
-			0.0f, 0.0f, 1.0f, //normal positive z
-			0.25, 2.0, 1.0, //25
-			0.0, 0.0, 0.0,
-			1.0, 1.0,
-			0.0f, 0.0f, 1.0f, //normal positive z
-			0.25, 2.0, 0.0, //26
-			0.0, 0.0, 0.0,
-			1.0, 0.0,
-			0.0f, 0.0f, 1.0f, //normal positive z
-		//bottom middle
-			//24 again
-			//26 again
-			-0.25, 2.0, 0.0, //27
-			0.0, 0.0, 0.0,
-			0.0, 0.0,
-			0.0f, 0.0f, 1.0f, //normal positive z
-		//left 
-			-0.5, 2.0, 0.5, //28
-			0.0, 0.0, 0.0,
-			0.0, 0.0,
-			0.0f, 0.0f, 1.0f, //normal positive z
-			//24 again
-			//27 again
-		//right
-			0.5, 2.0, 0.5, //29
-			0.0, 0.0, 0.0,
-			1.0, 0.0,
-			0.0f, 0.0f, 1.0f //normal positive z
-
-			//25 again
-			//26 again
-	
-	};
-	GLubyte cylinderIndices[] = {
-		0, 1, 2,
-		1, 2, 3,
-		4, 5, 6,
-		5, 6, 7,
-		8, 9, 10,
-		9, 10, 11,
-		12, 13, 14,
-		13, 14, 15,
-		16, 17, 18,
-		17, 18, 19,
-		20, 21, 22,
-		21, 22, 23,
-		24, 25, 26,
-		24, 26, 27,
-		28, 24, 27,
-		29, 25, 26
+		// Triangle 2	
+		0.5, 0.5, 0.0,  // index 3	
+		1.0, 0.65, 0.0 // orange
 	};
 
 	GLubyte cubeIndices[] = {
@@ -555,16 +1758,6 @@ int main(void)
 		glm::vec3(-0.5f, 0.0f,  0.0f) // Left Plane
 	};
 
-	// For Lights
-	glm::vec3 planePositions3[] = {
-		glm::vec3(0.0f,  0.0f,  0.5f),
-		glm::vec3(0.5f,  0.0f,  0.0f),
-		glm::vec3(0.0f,  0.0f,  -0.5f),
-		glm::vec3(-0.5f, 0.0f,  0.0f),
-		glm::vec3(0.0f, 0.5f,  0.0f),
-		glm::vec3(0.0f, -0.5f,  0.0f)
-	};
-
 	//editing to make cylinder
 	glm::vec3 planePositions2[] = {
 		glm::vec3(0.f,  0.0f,  0.4f), // front plane
@@ -580,10 +1773,6 @@ int main(void)
 		0.0f, 90.0f, 0.0f, 90.0f
 	};
 
-	glm::float32 planeRotations3[] = {
-		0.0f, 90.0f, 180.0f, -90.0f, -90.f, 90.f
-	};
-
 	//used to rotate cylinder pieces
 	glm::float32 planeRotations2[] = {
 		0.0f, 60.0f, 0.0f, 300.0f,60.f,300.f
@@ -594,266 +1783,326 @@ int main(void)
 
 
 
-	GLuint  floorVBO, floorEBO, floorVAO, cylinderVBO, cylinderEBO, cylinderVAO, lampVBO, lampEBO, lampVAO, cubeVBO, cubeEBO, cubeVAO, boardVBO, boardEBO, boardVAO;
-
-	
-
-	glGenBuffers(1, &floorVBO); // Create VBO
-	glGenBuffers(1, &floorEBO); // Create EBO
-
-	glGenBuffers(1, &cylinderVBO); // Create VBO
-	glGenBuffers(1, &cylinderEBO); // Create EBO
-
-	glGenBuffers(1, &lampVBO); // Create VBO
-	glGenBuffers(1, &lampEBO); // Create EBO
 
-	glGenBuffers(1, &cubeVBO); // Create VBO
-	glGenBuffers(1, &cubeEBO); // Create EBO
-
-	glGenBuffers(1, &boardVBO); // Create VBO
-	glGenBuffers(1, &boardEBO); // Create EBO
 	
-	glGenVertexArrays(1, &floorVAO); // Create VAO
-	glGenVertexArrays(1, &cylinderVAO); // Create VAO
-	glGenVertexArrays(1, &lampVAO); // Create VOA
-	glGenVertexArrays(1, &cubeVAO); // Create VOA
-	glGenVertexArrays(1, &boardVAO); // Create VOA
-
-
-
-	glBindVertexArray(boardVAO);
-
-	// VBO and EBO Placed in User-Defined VAO
-	glBindBuffer(GL_ARRAY_BUFFER, boardVBO); // Select VBO
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, boardEBO); // Select EBO
-
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(verticesCube), verticesCube, GL_STATIC_DRAW); // Load vertex attributes
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeIndices), cubeIndices, GL_STATIC_DRAW); // Load indices 
-
-	// Specify attribute location and layout to GPU
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1);
-
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2);
-
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(3);
-
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
-
-	glBindVertexArray(cubeVAO);
-
-	// VBO and EBO Placed in User-Defined VAO
-	glBindBuffer(GL_ARRAY_BUFFER, cubeVBO); // Select VBO
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeEBO); // Select EBO
-
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(verticesCube), verticesCube, GL_STATIC_DRAW); // Load vertex attributes
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeIndices), cubeIndices, GL_STATIC_DRAW); // Load indices 
-
-	// Specify attribute location and layout to GPU
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1);
 
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2);
-
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(3);
-
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
-
-
-	glBindVertexArray(floorVAO);
-
-	glBindBuffer(GL_ARRAY_BUFFER, floorVBO); // Select VBO
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, floorEBO); // Select EBO
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(verticesFloor), verticesFloor, GL_STATIC_DRAW); // Load vertex attributes
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
-
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
+	// Pack the authored 11-float rows into the compact vertex format and suballocate them from the shared buffers,
+	// welding the duplicated corners and reordering the triangles for the vertex cache on the way
+	scene.meshes.optimizeMeshes = optimizeSceneMeshes;
+	scene.cubeMesh = RegisterMesh(scene.meshes, PackVertices(verticesCube, sizeof(verticesCube) / sizeof(GLfloat)), cubeIndices, sizeof(cubeIndices));
+	scene.floorMesh = RegisterMesh(scene.meshes, PackVertices(verticesFloor, sizeof(verticesFloor) / sizeof(GLfloat)), indices, sizeof(indices));
+
+	// Glue stick: generated round body and top cap, the label wraps twice like the old hexagon panels
+	CylinderParams glueStick;
+	glueStick.radius = 0.5f;
+	glueStick.height = 2.0f;
+	glueStick.baseCenter = glm::vec3(0.0f, 0.0f, 0.5f);
+	glueStick.uvWraps = 2;
+	glueStick.bottomCap = false; //rests on the board
+	scene.cylinderLods = RegisterCylinderLods(scene.meshes, glueStick, { 96, 48, 24, 12, 6 });
+
+	// Place the objects: the cube is positioned relative to the glue stick, the board to the cube and the floor to the board
+	scene.glueStickNode = AddSceneNode(scene.graph, SCENE_NO_PARENT, glm::vec3(0.0f, 0.0f, 0.0f),
+		glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f, 2.0f, 1.0f));
+	scene.cubeNode = AddSceneNode(scene.graph, scene.glueStickNode, glm::vec3(-2.2f, 0.0f, 2.2f),
+		glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(2.2f, 1.5f, 2.2f));
+	scene.boardNode = AddSceneNode(scene.graph, scene.cubeNode, glm::vec3(1.5f, 0.0f, 0.0f),
+		glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(3.f, 0.15f, 1.f));
+	scene.floorNode = AddSceneNode(scene.graph, scene.boardNode, glm::vec3(0.f, 0.0f, 0.f),
+		glm::angleAxis(90.f * toRadians, glm::vec3(1.0f, 0.0f, 0.0f)), glm::vec3(20.f, 20.f, 20.f)); //increased the plane size
+
+	// Transform planes to form the lamp cube once, so each light is a single instance of it
+	vector<PackedVertex> lampCubeVertices;
+	vector<GLuint> lampCubeIndices;
+	for (GLuint i = 0; i < 6; i++)
+	{
+		glm::mat4 planeMatrix(1.0f);
+		planeMatrix = glm::translate(planeMatrix, planePositions3[i]);
+		planeMatrix = glm::rotate(planeMatrix, planeRotations3[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
+		if (i >= 4)
+			planeMatrix = glm::rotate(planeMatrix, planeRotations3[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
 
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1);
-	//arguments are(index of pointer, size, glfloat, glfalse, span, where to start)
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2);
+		for (GLuint v = 0; v < 4; v++)
+		{
+			glm::vec4 corner = planeMatrix * glm::vec4(lampVertices[v * 3], lampVertices[v * 3 + 1], lampVertices[v * 3 + 2], 1.0f);
+			lampCubeVertices.push_back(MakePackedVertex(glm::vec3(corner), glm::vec2(0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)));
+		}
+		for (GLuint n = 0; n < 6; n++)
+			lampCubeIndices.push_back(indices[n] + i * 4);
+	}
+	scene.lampMesh = RegisterMesh(scene.meshes, lampCubeVertices, lampCubeIndices);
 
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(3);
+	// Send every registered mesh to the GPU in one pass
+	UploadMeshRegistry(scene.meshes);
 
+	// Meshes from files go straight from their mapping into the shared buffers
+	auto meshLoadStart = chrono::high_resolution_clock::now();
+	for (const string& file : sceneMeshFiles)
+	{
+		MeshHandle mesh;
+		if (LoadMeshFile(scene.meshes, file, mesh))
+			scene.fileMeshes.push_back(mesh);
+		else
+			cerr << "Failed to load mesh " << file << endl;
+	}
+	scene.meshLoadMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - meshLoadStart).count();
+
+	//lampVAO, same vertex and index buffers as every other mesh
+	glGenVertexArrays(1, &scene.lampVAO);
+	glBindVertexArray(scene.lampVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, scene.meshes.vbo); // Select VBO
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene.meshes.ebo); // Select EBO
+	ApplyVertexLayout(packedVertexLayout);
+
+	// Per-instance model matrix, a mat4 takes attribute locations 1-4 and advances once per lamp
+	glGenBuffers(1, &scene.lampInstanceVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, scene.lampInstanceVBO);
+	glBufferData(GL_ARRAY_BUFFER, MAX_CLUSTERED_LIGHTS * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+	ApplyVertexLayout(instanceMatrixLayout);
 	glBindVertexArray(0);
 
+	//Load textures, decoding runs in the background and RenderScene binds placeholders until each one lands
+	InitTextureStreamer(scene.textures, min(4u, max(1u, thread::hardware_concurrency())));
+	scene.textures.cacheFormat = textureCacheFormat;
+	if (textureCacheFormat == TEXTURE_CACHE_BC1 && !GLEW_EXT_texture_compression_s3tc)
+		scene.textures.cacheFormat = TEXTURE_CACHE_RGBA8;
+	if (textureArraySize > 0)
+		InitTextureArray(scene.textures, textureArraySize, sizeof(sceneTextureFiles) / sizeof(sceneTextureFiles[0]), scene.textures.cacheFormat);
+	scene.glueTexture = LoadTextureAsync(scene.textures, sceneTextureFiles[0]);
+	scene.woodTexture = LoadTextureAsync(scene.textures, sceneTextureFiles[1]);
+	scene.cubeTexture = LoadTextureAsync(scene.textures, sceneTextureFiles[2]);
+	scene.boardTexture = LoadTextureAsync(scene.textures, sceneTextureFiles[3]);
+
+	// Objects drawn each frame, boxed and culled against the view frustum
+	scene.objects = {
+		{ scene.glueStickNode, scene.cylinderLods.levels[0], &scene.cylinderLods, scene.glueTexture, false },
+		{ scene.cubeNode, scene.cubeMesh, nullptr, scene.cubeTexture, false },
+		{ scene.boardNode, scene.cubeMesh, nullptr, scene.boardTexture, false }, //same mesh as the cube
+		{ scene.floorNode, scene.floorMesh, nullptr, scene.woodTexture, false }
+	};
 
+	// Loaded meshes stand in a row behind the desk, each scaled to fit a 2 unit box and resting on y = 0
+	for (size_t i = 0; i < scene.fileMeshes.size(); i++)
+	{
+		const Aabb& bounds = scene.meshes.bounds[scene.fileMeshes[i]];
+		glm::vec3 extent = bounds.max - bounds.min;
+		GLfloat scale = 2.f / max(max(extent.x, extent.y), max(extent.z, 1e-6f));
+		glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+		glm::vec3 position(-3.f + 3.f * (GLfloat)i - center.x * scale, -bounds.min.y * scale, -3.f - center.z * scale);
+		SceneNode node = AddSceneNode(scene.graph, SCENE_NO_PARENT, position, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(scale));
+		scene.objects.push_back({ node, scene.fileMeshes[i], nullptr, scene.woodTexture, false });
+	}
 
-	glBindVertexArray(cylinderVAO);
-
-	// VBO and EBO Placed in User-Defined VAO
-	glBindBuffer(GL_ARRAY_BUFFER, cylinderVBO); // Select VBO
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cylinderEBO); // Select EBO
-
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cylinderVertices), cylinderVertices, GL_STATIC_DRAW); // Load vertex attributes
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cylinderIndices), cylinderIndices, GL_STATIC_DRAW); // Load indices 
-
-	// Specify attribute location and layout to GPU
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1);
-
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2);
-
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(3);
+	// Stress test cubes on a grid around the desk, each its own node so it can spin independently
+	int gridSide = (int)ceil(sqrt((double)stressObjectCount));
+	GLfloat spacing = gridSide ? 30.f / gridSide : 0.f;
+	for (int i = 0; i < stressObjectCount; i++)
+	{
+		glm::vec3 position(-15.f + (i % gridSide + 0.5f) * spacing, -2.f, -15.f + (i / gridSide + 0.5f) * spacing);
+		SceneNode node = AddSceneNode(scene.graph, SCENE_NO_PARENT, position, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(spacing * 0.4f));
+		scene.stressNodes.push_back(node);
+		scene.objects.push_back({ node, scene.cubeMesh, nullptr, scene.cubeTexture, false });
+	}
 
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	// Instanced stress meshes shaped like the desk's, the glue sticks at a middle level of detail since they are
+	// small and one draw cannot pick levels per instance. Each instance may use any of the scene textures.
+	if (instancedStressScene && scene.textures.arrayTexture)
+	{
+		AddInstanceBatch(scene.instances, scene.cubeMesh, glm::vec3(1.0f, 1.0f, 1.0f));
+		AddInstanceBatch(scene.instances, scene.cylinderLods.levels[2], glm::vec3(1.0f, 2.0f, 1.0f));
+		AddInstanceBatch(scene.instances, scene.cubeMesh, glm::vec3(3.0f, 0.15f, 1.0f)); //board
+		scene.instanceTextures = { scene.glueTexture, scene.woodTexture, scene.cubeTexture, scene.boardTexture };
+		scene.instanceLayers.resize(scene.instanceTextures.size());
+		if (!BuildInstances(scene.instances, scene.meshes, stressInstanceCount, (GLuint)scene.instanceTextures.size()))
+			cerr << "Could not allocate " << stressInstanceCount << " instances of each mesh" << endl;
+	}
 
-	//lampVAO
-	glBindVertexArray(lampVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, lampVBO); // Select VBO
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lampEBO); // Select EBO
-	glBufferData(GL_ARRAY_BUFFER, sizeof(lampVertices), lampVertices, GL_STATIC_DRAW); // Load vertex attributes
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // Load indices 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
-	glBindVertexArray(0);
+	scene.objectBounds.resize(scene.objects.size());
+	InitFrameArena(scene.frameArena, 64 * 1024);
 
-	//Load textures
-	int glueTexWidth, glueTexHeight, woodTexWidth, woodTexHeight, cubeTexWidth, cubeTexHeight, boardTexWidth, boardTexHeight;
-	unsigned char* glueImage = SOIL_load_image("glueStick.png", &glueTexWidth, &glueTexHeight, 0, SOIL_LOAD_RGB);
-	unsigned char* woodImage = SOIL_load_image("woodTexture.jpeg", &woodTexWidth, &woodTexHeight, 0, SOIL_LOAD_RGB);
-	unsigned char* cubeImage = SOIL_load_image("rubik_cube_PNG53.png", &cubeTexWidth, &cubeTexHeight, 0, SOIL_LOAD_RGB);
-	unsigned char* boardImage = SOIL_load_image("board.png", &boardTexWidth, &boardTexHeight, 0, SOIL_LOAD_RGB);
-
-	//Generate Textures
-	GLuint glueTexture;
-	glGenTextures(1, &glueTexture); //number of objects and where they go
-	glBindTexture(GL_TEXTURE_2D, glueTexture); //the type and the reference
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, glueTexWidth, glueTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, glueImage);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	SOIL_free_image_data(glueImage);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	GLuint woodTexture;
-	glGenTextures(1, &woodTexture); //number of objects and where they go
-	glBindTexture(GL_TEXTURE_2D, woodTexture); //the type and the reference
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, woodTexWidth, woodTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, woodImage);
-	glGenerateMipmap(GL_TEXTURE_2D); //handles resolution
-	SOIL_free_image_data(woodImage); //free resource
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	GLuint cubeTexture;
-	glGenTextures(1, &cubeTexture); //number of objects and where they go
-	glBindTexture(GL_TEXTURE_2D, cubeTexture); //the type and the reference
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cubeTexWidth, cubeTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, cubeImage);
-	glGenerateMipmap(GL_TEXTURE_2D); //handles resolution
-	SOIL_free_image_data(cubeImage); //free resource
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	GLuint boardTexture;
-	glGenTextures(1, &boardTexture); //number of objects and where they go
-	glBindTexture(GL_TEXTURE_2D, boardTexture); //the type and the reference
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, boardTexWidth, boardTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, boardImage);
-	glGenerateMipmap(GL_TEXTURE_2D); //handles resolution
-	SOIL_free_image_data(boardImage); //free resource
-	glBindTexture(GL_TEXTURE_2D, 0);
 
+	// Per-frame camera and light block (std140, see FrameUniforms)
+	string frameUniformBlock =
+		"layout(std140) uniform FrameData\n"
+		"{\n"
+		"mat4 view;"
+		"mat4 projection;"
+		"vec4 viewPos;"
+		"ivec4 lightCount;"
+		"vec4 clusterScale;"
+		"ivec4 clusterGrid;"
+		"vec4 lightPos[" + to_string(MAX_LIGHTS) + "];"
+		"vec4 lightColor[" + to_string(MAX_LIGHTS) + "];"
+		"};\n";
+
+	// Objects pick their texture by binding it, or by layer when textures share one array
+	string materialSampling = scene.textures.arrayTexture ?
+		"uniform sampler2DArray myTextures;\n"
+		"uniform int materialLayer;\n"
+		"vec4 SampleMaterial(vec2 uv) { return texture(myTextures, vec3(uv, float(materialLayer))); }\n" :
+		"uniform sampler2D myTexture;\n"
+		"vec4 SampleMaterial(vec2 uv) { return texture(myTexture, uv); }\n";
+
+	// The shading pass only passes GL_EQUAL against the pre-pass depth if both compute the exact same positions
+	string positionInvariance = depthPrepass ? "invariant gl_Position;" : "";
 
 	// Vertex shader source code
 	string vertexShaderSource =
-		"#version 330 core\n"
+		"#version 330 core\n" + frameUniformBlock +
 		"layout(location = 0) in vec3 vPosition;"
-		"layout(location = 1) in vec3 aColor;"
 		"layout(location = 2) in vec2 texCoord;"
 		"layout(location = 3) in vec3 normal;"
-		"out vec3 oColor;"
 		"out vec2 oTexCoord;"
 		"out vec3 oNormal;"
 		"out vec3 FragPos;"
 		"uniform mat4 model;"
-		"uniform mat4 view;"
-		"uniform mat4 projection;"
+		"uniform mat3 normalMatrix;" + positionInvariance +
 		"void main()\n"
 		"{\n"
 		"gl_Position = projection * view * model * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
-		"oColor = aColor;"
 		"oTexCoord = texCoord;"
-		"oNormal = mat3(transpose(inverse(model))) * normal;"
+		"oNormal = normalMatrix * normal;"
 		"FragPos = vec3(model * vec4(vPosition, 1.0f));"
 		"}\n";
 
-	// Fragment shader source code
-	string fragmentShaderSource =
-		"#version 330 core\n"
-		"in vec3 oColor;"
-		"in vec2 oTexCoord;"
-		"in vec3 oNormal;"
-		"in vec3 FragPos;"
-		"out vec4 fragColor;"
-		"uniform sampler2D myTexture;"
-		"uniform vec3 objectColor;"
-		"uniform vec3 lightColor;"
-		"uniform vec3 lightColor2;"
-		"uniform vec3 lightPos;"
-		"uniform vec3 lightPos2;"
-		"uniform vec3 viewPos;"
-		"void main()\n"
+	// One light's contribution; lights with a radius fade to nothing at it
+	string shadeLightFunction =
+		"vec3 ShadeLight(vec3 lightPosition, float lightRadius, vec3 color, vec3 norm, vec3 viewDir, float shadow)\n"
 		"{\n"
-		"//Ambient\n"
 		"float ambientStrength = 3.0f;"
-		"vec3 ambient = ambientStrength * lightColor;"
-		"//Ambient 2\n"
-		"float ambientStrength2 = 3.0f;"
-		"vec3 ambient2 = ambientStrength2 * lightColor2;"
+		"float specularStrength = 5.0f;"
+		"//Ambient\n"
+		"vec3 ambient = ambientStrength * color;"
 		"//Diffuse\n"
-		"vec3 norm = normalize(oNormal);"
-		"vec3 lightDir = normalize(lightPos - FragPos);"
+		"vec3 toLight = lightPosition - FragPos;"
+		"vec3 lightDir = normalize(toLight);"
 		"float diff = max(dot(norm, lightDir), 0.0);"
-		"vec3 diffuse = diff * lightColor;"
-		"//Diffuse 2\n"
-		"vec3 norm2 = normalize(oNormal);"
-		"vec3 lightDir2 = normalize(lightPos2 - FragPos);"
-		"float diff2 = max(dot(norm2, lightDir2), 0.0);"
-		"vec3 diffuse2 = diff2 * lightColor2;"
+		"vec3 diffuse = diff * color;"
 		"//Specularity\n"
-		"float specularStrength = 5.0f;"
-		"vec3 viewDir = normalize(viewPos - FragPos);"
 		"vec3 reflectDir = reflect(-lightDir, norm);"
 		"float spec = pow(max(dot(viewDir, reflectDir), 0.0), 8);"
-		"vec3 specular = specularStrength * spec * lightColor;"
-		"//Specularity 2\n"
-		"float specularStrength2 = 5.0f;"
-		"vec3 specular2 = specularStrength2 * spec * lightColor2;"
-		"vec3 result = (ambient + diffuse + specular) * objectColor;"
-		"result += (ambient2 + diffuse2 + specular2) * objectColor;"
-		"fragColor = texture(myTexture, oTexCoord) * vec4(result, 1.0f);"
+		"vec3 specular = specularStrength * spec * color;"
+		"float attenuation = 1.0f;"
+		"if (lightRadius > 0.0f)\n"
+		"{\n"
+		"float d = length(toLight) / lightRadius;"
+		"attenuation = clamp(1.0f - d * d * d * d, 0.0f, 1.0f);"
+		"attenuation *= attenuation;"
+		"}\n"
+		"return (ambient + diffuse * shadow + specular * shadow) * objectColor * attenuation;"
 		"}\n";
 
-	// Lamp Vertex shader source code
-	string lampVertexShaderSource =
+	// Shadowed lights compare the fragment's distance with their cube map, the rest are never in shadow.
+	// The cube map holds perspective depth along the face's axis, so the fragment's depth is
+	// rebuilt from its largest direction component; the sample grid spreads about one texel apart.
+	int shadowedLights = shadowsEnabled ? (int)min(lights.size(), (size_t)MAX_SHADOWED_LIGHTS) : 0;
+	string shadowFunctions;
+	if (shadowedLights > 0)
+	{
+		string nearPlane = to_string(SHADOW_NEAR_PLANE);
+		shadowFunctions =
+			"uniform samplerCubeShadow shadowMaps[" + to_string(shadowedLights) + "];\n"
+			"float SampleShadow(samplerCubeShadow shadowMap, vec3 toFragment, float range)\n"
+			"{\n"
+			"float spread = length(toFragment) * " + to_string(2.0f / shadowMapSize) + ";"
+			"float shadow = 0.0f;"
+			"for (int x = 0; x < " + to_string(shadowPcfKernel) + "; x++)\n"
+			"for (int y = 0; y < " + to_string(shadowPcfKernel) + "; y++)\n"
+			"for (int z = 0; z < " + to_string(shadowPcfKernel) + "; z++)\n"
+			"{\n"
+			"vec3 direction = toFragment + (vec3(x, y, z) - " + to_string((shadowPcfKernel - 1) * 0.5f) + ") * spread;"
+			"vec3 axis = abs(direction);"
+			"float major = max(axis.x, max(axis.y, axis.z));"
+			"float depth = 0.5f * (range + " + nearPlane + ") / (range - " + nearPlane + ") + 0.5f - range * " + nearPlane + " / ((range - " + nearPlane + ") * major);"
+			"shadow += texture(shadowMap, vec4(direction, depth));"
+			"}\n"
+			"return shadow / " + to_string(shadowPcfKernel * shadowPcfKernel * shadowPcfKernel) + ".0f;"
+			"}\n"
+			"float LightShadow(int light, vec3 lightPosition, float lightRadius, vec3 norm)\n"
+			"{\n"
+			"if (light >= lightCount.x) return 1.0f;" //the light list shrank below the maps (light sweep)
+			"float range = lightRadius > 0.0f ? lightRadius : " + to_string(SHADOW_UNBOUNDED_RANGE) + ";"
+			"vec3 toFragment = FragPos + norm * 0.02f - lightPosition;";
+		for (int i = 0; i < shadowedLights; i++)
+			shadowFunctions += "if (light == " + to_string(i) + ") return SampleShadow(shadowMaps[" + to_string(i) + "], toFragment, range);";
+		shadowFunctions += "return 1.0f;\n}\n";
+	}
+	else
+		shadowFunctions = "float LightShadow(int light, vec3 lightPosition, float lightRadius, vec3 norm) { return 1.0f; }\n";
+
+	// Forward path loops over every light, the clustered path over its cluster's list
+	string lightLoop = clusteredLighting ?
+		"float viewDepth = max(-(view * vec4(FragPos, 1.0f)).z, " + to_string(NEAR_PLANE) + ");"
+		"ivec3 cell = ivec3(ivec2(gl_FragCoord.xy * clusterScale.xy), int(floor(log(viewDepth) * clusterScale.z + clusterScale.w)));"
+		"cell = clamp(cell, ivec3(0), clusterGrid.xyz - 1);"
+		"int cluster = (cell.z * clusterGrid.y + cell.y) * clusterGrid.x + cell.x;"
+		"uvec2 range = texelFetch(clusterRanges, cluster).xy;"
+		"for (uint k = 0u; k < range.y; k++)\n"
+		"{\n"
+		"int i = int(texelFetch(clusterIndices, int(range.x + k)).x);"
+		"vec4 positionRadius = texelFetch(clusterLights, i * 2);"
+		"result += ShadeLight(positionRadius.xyz, positionRadius.w, texelFetch(clusterLights, i * 2 + 1).rgb, norm, viewDir,"
+		" LightShadow(i, positionRadius.xyz, positionRadius.w, norm));"
+		"}\n" :
+		"for (int i = 0; i < lightCount.x; i++)\n"
+		"result += ShadeLight(lightPos[i].xyz, lightPos[i].w, lightColor[i].rgb, norm, viewDir, LightShadow(i, lightPos[i].xyz, lightPos[i].w, norm));\n";
+
+	string clusterBuffers = clusteredLighting ?
+		"uniform samplerBuffer clusterLights;"
+		"uniform usamplerBuffer clusterRanges;"
+		"uniform usamplerBuffer clusterIndices;" : "";
+
+	// Fragment shader source code, the instanced program shares everything after the material sampling
+	string fragmentShaderBody =
+		"in vec2 oTexCoord;"
+		"in vec3 oNormal;"
+		"in vec3 FragPos;"
+		"out vec4 fragColor;"
+		"uniform vec3 objectColor;" + clusterBuffers + "\n" + shadeLightFunction + shadowFunctions +
+		"void main()\n"
+		"{\n"
+		"vec3 norm = normalize(oNormal);"
+		"vec3 viewDir = normalize(viewPos.xyz - FragPos);"
+		"vec3 result = vec3(0.0f);" + lightLoop +
+		"fragColor = SampleMaterial(oTexCoord) * vec4(result, 1.0f);"
+		"}\n";
+	string fragmentShaderSource = "#version 330 core\n" + frameUniformBlock + materialSampling + fragmentShaderBody;
+
+	// Overdraw view: every shaded fragment adds a little heat, so 1 layer is dark red, 4 orange, 8 yellow and 16 white
+	string overdrawFragmentShaderSource =
 		"#version 330 core\n"
+		"out vec4 fragColor;"
+		"void main()\n"
+		"{\n"
+		"fragColor = vec4(0.25f, 0.125f, 0.0625f, 1.0f);"
+		"}\n";
+
+	// Depth pre-pass vertex shader, positions computed exactly like the shading pass
+	string prepassVertexShaderSource =
+		"#version 330 core\n" + frameUniformBlock +
 		"layout(location = 0) in vec3 vPosition;"
-		"uniform mat4 model;"
-		"uniform mat4 view;"
-		"uniform mat4 projection;"
+		"uniform mat4 model;" + positionInvariance +
 		"void main()\n"
 		"{\n"
 		"gl_Position = projection * view * model * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
 		"}\n";
 
+	string prepassFragmentShaderSource =
+		"#version 330 core\n"
+		"void main()\n"
+		"{\n"
+		"}\n";
+
+	// Lamp Vertex shader source code
+	string lampVertexShaderSource =
+		"#version 330 core\n" + frameUniformBlock +
+		"layout(location = 0) in vec3 vPosition;"
+		"layout(location = 1) in mat4 instanceModel;"
+		"void main()\n"
+		"{\n"
+		"gl_Position = projection * view * instanceModel * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
+		"}\n";
+
 	// Lamp Fragment shader source code
 	string lampFragmentShaderSource =
 		"#version 330 core\n"
@@ -863,230 +2112,550 @@ int main(void)
 		"fragColor =vec4(1.0f);"
 		"}\n";
 
-	// Creating Shader Program
-	GLuint shaderProgram = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
+	// Instanced stress meshes: matrices and a material selector per instance, the selector picks an array layer
+	string instanceVertexShaderSource =
+		"#version 330 core\n" + frameUniformBlock +
+		"layout(location = 0) in vec3 vPosition;"
+		"layout(location = 1) in float instanceMaterial;"
+		"layout(location = 2) in vec2 texCoord;"
+		"layout(location = 3) in vec3 normal;"
+		"layout(location = 4) in mat4 instanceModel;"
+		"layout(location = 8) in mat3 instanceNormalMatrix;"
+		"out vec2 oTexCoord;"
+		"out vec3 oNormal;"
+		"out vec3 FragPos;"
+		"flat out int materialLayer;"
+		"uniform int materialLayers[" + to_string(max((size_t)1, scene.instanceTextures.size())) + "];"
+		"void main()\n"
+		"{\n"
+		"gl_Position = projection * view * instanceModel * vec4(vPosition.x, vPosition.y, vPosition.z, 1.0);"
+		"oTexCoord = texCoord;"
+		"oNormal = instanceNormalMatrix * normal;"
+		"FragPos = vec3(instanceModel * vec4(vPosition, 1.0f));"
+		"materialLayer = materialLayers[int(instanceMaterial)];"
+		"}\n";
+	string instanceFragmentShaderSource =
+		"#version 330 core\n" + frameUniformBlock +
+		"uniform sampler2DArray myTextures;\n"
+		"flat in int materialLayer;\n"
+		"vec4 SampleMaterial(vec2 uv) { return texture(myTextures, vec3(uv, float(materialLayer))); }\n" + fragmentShaderBody;
+
+	// Creating Shader Program, from cached binaries where possible
+	InitProgramCache(programCache, programCacheEnabled);
+	scene.shaderProgram = CreateShaderProgram(vertexShaderSource, overdrawView ? overdrawFragmentShaderSource : fragmentShaderSource);
 	// Creating Lamp Shader Program
-	GLuint lampShaderProgram = CreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource);
-
-	// Use Shader Program exe once
-	//glUseProgram(shaderProgram);
-
-
-	/* Loop until the user closes the window */
-	while (!glfwWindowShouldClose(window))
+	scene.lampShaderProgram = CreateShaderProgram(lampVertexShaderSource, overdrawView ? overdrawFragmentShaderSource : lampFragmentShaderSource);
+	if (!scene.instances.batches.empty())
 	{
-		//Set Delta time
-		GLfloat currentFrame = glfwGetTime();
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame;
-
-		// Resize window and graphics simultaneously
-		glfwGetFramebufferSize(window, &width, &height);
-		glViewport(0, 0, width, height);
+		scene.instanceProgram = CreateShaderProgram(instanceVertexShaderSource, overdrawView ? overdrawFragmentShaderSource : instanceFragmentShaderSource);
+		scene.instanceLayersLoc = glGetUniformLocation(scene.instanceProgram, "materialLayers");
+		glUseProgram(scene.instanceProgram);
+		glUniform3f(glGetUniformLocation(scene.instanceProgram, "objectColor"), 0.1f, 0.1f, 0.1f);
+		glUseProgram(0);
+		BindFrameUniformBlock(scene.instanceProgram);
+	}
+	// Programs that light their fragments and so read the clusters and shadow maps
+	vector<GLuint> litPrograms = { scene.shaderProgram };
+	if (scene.instanceProgram)
+		litPrograms.push_back(scene.instanceProgram);
+	if (depthPrepass)
+	{
+		scene.prepassProgram = CreateShaderProgram(prepassVertexShaderSource, prepassFragmentShaderSource);
+		scene.prepassModelLoc = glGetUniformLocation(scene.prepassProgram, "model");
+		BindFrameUniformBlock(scene.prepassProgram);
+	}
+	glGenQueries(1, &scene.fragmentQuery);
 
-		/* Render here */
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); //removed "|  GL_DEPTH_BUFFER_BIT" to check if makes an ortho view
+	// Resolve per-object uniform locations once, they do not change after linking
+	scene.modelLoc = glGetUniformLocation(scene.shaderProgram, "model");
+	scene.normalMatrixLoc = glGetUniformLocation(scene.shaderProgram, "normalMatrix");
+	scene.objectColorLoc = glGetUniformLocation(scene.shaderProgram, "objectColor");
+	scene.materialLayerLoc = glGetUniformLocation(scene.shaderProgram, "materialLayer");
 
-		// Use Shader Program exe and select VAO before drawing 
-		glUseProgram(shaderProgram); // Call Shader per-frame when updating attributes
+	// Cluster buffers live on their own texture units, binning runs on every core
+	SetWorkerThreads(scene, workerThreadCount ? workerThreadCount : max(1u, thread::hardware_concurrency()));
+	if (clusteredLighting)
+	{
+		InitLightClusters(scene.clusters, NEAR_PLANE, FAR_PLANE);
+		for (GLuint program : litPrograms)
+		{
+			glUseProgram(program);
+			glUniform1i(glGetUniformLocation(program, "clusterLights"), CLUSTER_LIGHT_UNIT);
+			glUniform1i(glGetUniformLocation(program, "clusterRanges"), CLUSTER_RANGE_UNIT);
+			glUniform1i(glGetUniformLocation(program, "clusterIndices"), CLUSTER_INDEX_UNIT);
+		}
+		glUseProgram(0);
+	}
 
+	// Shadow maps are drawn with a depth-only program and sampled from their own texture units
+	if (shadowedLights > 0)
+	{
+		string depthVertexShaderSource =
+			"#version 330 core\n"
+			"layout(location = 0) in vec3 vPosition;"
+			"uniform mat4 model;"
+			"uniform mat4 lightViewProjection;"
+			"void main()\n"
+			"{\n"
+			"gl_Position = lightViewProjection * model * vec4(vPosition, 1.0);"
+			"}\n";
+		string depthFragmentShaderSource =
+			"#version 330 core\n"
+			"void main()\n"
+			"{\n"
+			"}\n";
+		InitShadowMaps(scene.shadows, lights.size(), shadowMapSize, shadowPcfKernel, CreateShaderProgram(depthVertexShaderSource, depthFragmentShaderSource));
+		for (GLuint program : litPrograms)
+		{
+			glUseProgram(program);
+			for (int i = 0; i < shadowedLights; i++)
+				glUniform1i(glGetUniformLocation(program, ("shadowMaps[" + to_string(i) + "]").c_str()), SHADOW_MAP_FIRST_UNIT + i);
+		}
+		glUseProgram(0);
+	}
 
-		// Declare transformations (can be initialized outside loop)
-		//glm::mat4 modelMatrix;
-		//glm::mat4 viewMatrix;
-		glm::mat4 projectionMatrix;
+	// Dynamic resolution stretches scaled frames over the output with a blit or this sharpen pass
+	if (resolutionTargetMs > 0.0)
+	{
+		string upscaleVertexShaderSource =
+			"#version 330 core\n"
+			"out vec2 uv;"
+			"void main()\n"
+			"{\n"
+			"uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);" //one triangle covering the screen
+			"gl_Position = vec4(uv * 2.0f - 1.0f, 0.0f, 1.0f);"
+			"}\n";
+		// Bilinear sample plus an unsharp mask, clamped to the neighbours so edges do not ring
+		string upscaleFragmentShaderSource =
+			"#version 330 core\n"
+			"in vec2 uv;"
+			"out vec4 fragColor;"
+			"uniform sampler2D sceneColor;"
+			"uniform vec2 renderScale;"
+			"uniform vec2 texelSize;"
+			"uniform float sharpness;"
+			"vec3 SampleScene(vec2 position)\n"
+			"{\n"
+			"return texture(sceneColor, clamp(position, texelSize * 0.5f, renderScale - texelSize * 0.5f)).rgb;"
+			"}\n"
+			"void main()\n"
+			"{\n"
+			"vec2 position = uv * renderScale;"
+			"vec3 center = SampleScene(position);"
+			"vec3 north = SampleScene(position + vec2(0.0f, texelSize.y));"
+			"vec3 south = SampleScene(position - vec2(0.0f, texelSize.y));"
+			"vec3 east = SampleScene(position + vec2(texelSize.x, 0.0f));"
+			"vec3 west = SampleScene(position - vec2(texelSize.x, 0.0f));"
+			"vec3 low = min(center, min(min(north, south), min(east, west)));"
+			"vec3 high = max(center, max(max(north, south), max(east, west)));"
+			"vec3 sharpened = center + (center - (north + south + east + west) * 0.25f) * sharpness;"
+			"fragColor = vec4(clamp(sharpened, low, high), 1.0f);"
+			"}\n";
+		GLuint upscaleProgram = upscaleMode == UPSCALE_SHARPEN ? CreateShaderProgram(upscaleVertexShaderSource, upscaleFragmentShaderSource) : 0;
+		InitDynamicResolution(scene.resolution, resolutionTargetMs, minRenderScale, upscaleProgram, UPSCALE_SHARPNESS);
+	}
 
-		viewMatrix = glm::lookAt(cameraPosition, getTarget(), worldUp);
+	// Both programs read camera and lights from the same uniform buffer
+	BindFrameUniformBlock(scene.shaderProgram);
+	BindFrameUniformBlock(scene.lampShaderProgram);
+	glGenBuffers(1, &scene.frameUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, scene.frameUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, scene.frameUBO);
+}
 
+// Draw one frame into the currently bound framebuffer, at the dynamic render scale when it is on
+static void RenderFrame(SceneResources& scene, int fbWidth, int fbHeight)
+{
+	if (!scene.resolution.enabled)
+	{
+		RenderScene(scene, fbWidth, fbHeight);
+		return;
+	}
 
+	GLint outputFramebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &outputFramebuffer);
+	if (!ResizeDynamicResolution(scene.resolution, fbWidth, fbHeight))
+	{
+		RenderScene(scene, fbWidth, fbHeight);
+		return;
+	}
+	int renderWidth, renderHeight;
+	BeginDynamicResolutionFrame(scene.resolution, renderWidth, renderHeight);
+	RenderScene(scene, renderWidth, renderHeight);
+	ProfileScope upscaleScope(profiler, "Upscale", true);
+	EndDynamicResolutionFrame(scene.resolution, (GLuint)outputFramebuffer);
+}
 
-		//modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f));
-		//modelMatrix = glm::rotate(modelMatrix, 0.0f * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-		//modelMatrix = glm::scale(modelMatrix, glm::vec3(1.0f, 1.0f, 1.0f));		
-		/*
-		viewMatrix = glm::translate(viewMatrix, glm::vec3(0.0f, 0.0f, -5.0f));
-		viewMatrix = glm::rotate(viewMatrix, 45.0f * toRadians, glm::vec3(1.f, 0.0f, 0.0f));//change the float*radians to adjust the angle and the vec3 is x,y,z
-		*/
-		//Pseudocode: if p pressed then switch projections
-		
-		if (keys[GLFW_KEY_P] || perspectiveChecker == false) {
-			perspectiveChecker = true;
-			if (projectionMatrix == glm::perspective(fov, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f)) {
-				projectionMatrix == glm::ortho(0.0f, 10.0f, 0.0f, 10.0f);
-			}
-			else
-				projectionMatrix == glm::perspective(fov, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);
-			
-		}
-		projectionMatrix = glm::perspective(fov, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);
-		//projectionMatrix = glm::ortho(0.0f, 10.0f, 0.0f, 10.0f);
+// Draw one frame of the scene into the currently bound framebuffer
+void RenderScene(SceneResources& scene, int fbWidth, int fbHeight)
+{
+	ProfileScope frameScope(profiler, "RenderScene", true);
+	ProfileScope setupScope(profiler, "Clear and frame uniforms", true);
+	glViewport(0, 0, fbWidth, fbHeight);
 
-		// Get matrix's uniform location and set matrix
-		GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-		GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-		GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
+	/* Render here */
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); //removed "|  GL_DEPTH_BUFFER_BIT" to check if makes an ortho view
 
-		//Get light and object color, and light position location
-		GLint objectColorLoc = glGetUniformLocation(shaderProgram, "objectColor");
-		GLint lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
-		GLint lightPosLoc = glGetUniformLocation(shaderProgram, "lightPos");
-		GLint viewPosLoc = glGetUniformLocation(shaderProgram, "viewPos");
-		GLint lightColorLoc2 = glGetUniformLocation(shaderProgram, "lightColor2");
-		GLint lightPosLoc2 = glGetUniformLocation(shaderProgram, "lightPos2");
+	// Use Shader Program exe and select VAO before drawing 
+	glUseProgram(scene.shaderProgram); // Call Shader per-frame when updating attributes
 
-		//Assign Light and Object Colors, 0.46f, 0.36f, 0.25f,  0.79f, 0.39f, 0.13f
-		glUniform3f(objectColorLoc, 0.1f, 0.1f, 0.1f);
-		glUniform3f(lightColorLoc, 1.0f, 1.0f, 1.0f);
-		glUniform3f(lightColorLoc2, 1.0f, 1.0f, 1.0f);
 
+	// Declare transformations (can be initialized outside loop)
+	//glm::mat4 modelMatrix;
+	//glm::mat4 viewMatrix;
+	glm::mat4 projectionMatrix;
 
-		//Set light position 
-		glUniform3f(lightPosLoc, lightPosition.x, lightPosition.y, lightPosition.z);
-		glUniform3f(lightPosLoc2, lightPosition2.x, lightPosition2.y, lightPosition2.y);
+	UpdateCameraMatrices(scene.camera, scene.viewPose, fbWidth, fbHeight);
+	viewMatrix = scene.camera.view;
 
-		//Specify view position (camera)
-		glUniform3f(viewPosLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
 
-		//glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-		glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
 
+	//modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f));
+	//modelMatrix = glm::rotate(modelMatrix, 0.0f * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
+	//modelMatrix = glm::scale(modelMatrix, glm::vec3(1.0f, 1.0f, 1.0f));		
+	/*
+	viewMatrix = glm::translate(viewMatrix, glm::vec3(0.0f, 0.0f, -5.0f));
+	viewMatrix = glm::rotate(viewMatrix, 45.0f * toRadians, glm::vec3(1.f, 0.0f, 0.0f));//change the float*radians to adjust the angle and the vec3 is x,y,z
+	*/
+	//Pseudocode: if p pressed then switch projections
+	
+	if (keys[GLFW_KEY_P] || perspectiveChecker == false) {
+		perspectiveChecker = true;
+		if (projectionMatrix == glm::perspective(fov, (GLfloat)fbWidth / (GLfloat)fbHeight, 0.1f, 100.0f)) {
+			projectionMatrix == glm::ortho(0.0f, 10.0f, 0.0f, 10.0f);
+		}
+		else
+			projectionMatrix == glm::perspective(fov, (GLfloat)fbWidth / (GLfloat)fbHeight, 0.1f, 100.0f);
 		
+	}
+	projectionMatrix = scene.camera.projection;
+	//projectionMatrix = glm::ortho(0.0f, 10.0f, 0.0f, 10.0f);
 
-		/*
-		//experimenting on cube, creating cylinder with 6 sides using planePositions2[]. Moving points experimentally by changing position and rotation.
-		glBindVertexArray(cubeVAO); // User-defined VAO must be called before draw.
-		for (GLuint i = 0; i < 6; i++)
+	//Bin every light into the clusters it can reach
+	GLsizei clusteredCount = (GLsizei)min(lights.size(), (size_t)MAX_CLUSTERED_LIGHTS);
+	if (clusteredLighting)
+	{
+		ProfileScope binScope(profiler, "Light binning", true);
+		scene.lightData.resize(clusteredCount * 2);
+		for (GLsizei i = 0; i < clusteredCount; i++)
 		{
-			glm::mat4 modelMatrix;
-			modelMatrix = glm::translate(modelMatrix, planePositions2[i]);
-			modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 1.0f, 0.0f));
-			modelMatrix = glm::rotate(modelMatrix, planeRotations2[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-			modelMatrix = glm::scale(modelMatrix, glm::vec3(0.5f, 2.5f, 0.5f));
-			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			// Draw primitive(s)
-			draw();
+			scene.lightData[i * 2] = glm::vec4(lights[i].position, lights[i].radius);
+			scene.lightData[i * 2 + 1] = glm::vec4(lights[i].color, 1.0f);
 		}
-		glBindVertexArray(0); //Incase different VAO wii be used after
-		*/
-
-		//Bind the texture
-		glBindTexture(GL_TEXTURE_2D, glueTexture);
-
-		// Select and transform cylinder
-		glBindVertexArray(cylinderVAO);
-		glm::mat4 modelMatrix;
-		modelMatrix = glm::scale(modelMatrix, glm::vec3(1.0f, 2.0f, 1.0f));
-		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-		//Bind the texture
-		glBindTexture(GL_TEXTURE_2D, cubeTexture);
-
-		// Select and transform cube
-		glBindVertexArray(cubeVAO);
-		modelMatrix = glm::scale(modelMatrix, glm::vec3(2.2f, 1.5f, 2.2f));
-		modelMatrix = glm::translate(modelMatrix, glm::vec3(-1.f, 0.0f, 1.f));
-		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-		//Bind the texture
-		glBindTexture(GL_TEXTURE_2D, boardTexture);
-
-		// Select and transform cube
-		glBindVertexArray(boardVAO);
-		modelMatrix = glm::scale(modelMatrix, glm::vec3(3.f, 0.15f, 1.f));
-		modelMatrix = glm::translate(modelMatrix, glm::vec3(0.5f, 0.0f, 0.f));
-		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-		//Bind the texture
-		glBindTexture(GL_TEXTURE_2D, woodTexture);
-		
-	    // Select and transform floor
-		glBindVertexArray(floorVAO);
-		
-		modelMatrix = glm::translate(modelMatrix, glm::vec3(0.f, 0.0f, 0.f));
-		modelMatrix = glm::rotate(modelMatrix, 90.f * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-		modelMatrix = glm::scale(modelMatrix, glm::vec3(20.f, 20.f, 20.f)); //increased the plane size 
-		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-		//use shader
-		glUseProgram(lampShaderProgram);
-
-		//get matrix uniform location and set matrix
-		GLint lampModelLoc = glGetUniformLocation(lampShaderProgram, "model");
-		GLint lampViewLoc = glGetUniformLocation(lampShaderProgram, "view");
-		GLint lampProjLoc = glGetUniformLocation(lampShaderProgram, "projection");
-		glUniformMatrix4fv(lampViewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-		glUniformMatrix4fv(lampProjLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-
-		glBindVertexArray(lampVAO); // User-defined VAO must be called before draw. 
-
-		// Transform planes to form cube
-		for (GLuint i = 0; i < 6; i++)
+		UpdateLightClusters(scene.clusters, scene.jobs, scene.lightData, viewMatrix, projectionMatrix, fbWidth, fbHeight);
+		BindLightClusters(scene.clusters);
+	}
+
+	//Fill the shared camera and light block once for both programs
+	FrameUniforms frameUniforms;
+	frameUniforms.view = viewMatrix;
+	frameUniforms.projection = projectionMatrix;
+	frameUniforms.viewPos = glm::vec4(scene.viewPose.position, 1.0f);
+	frameUniforms.clusterScale = glm::vec4(1.0f / CLUSTER_TILE_SIZE, 1.0f / CLUSTER_TILE_SIZE, scene.clusters.sliceScale, scene.clusters.sliceBias);
+	frameUniforms.clusterGrid[0] = scene.clusters.tilesX;
+	frameUniforms.clusterGrid[1] = scene.clusters.tilesY;
+	frameUniforms.clusterGrid[2] = scene.clusters.slices;
+	frameUniforms.clusterGrid[3] = 0;
+
+	//Set light positions and colors, the forward path does not shade lights past MAX_LIGHTS
+	GLsizei lightCount = (GLsizei)min(lights.size(), (size_t)MAX_LIGHTS);
+	frameUniforms.lightCount[0] = lightCount;
+	for (GLsizei i = 0; i < lightCount; i++)
+	{
+		frameUniforms.lightPos[i] = glm::vec4(lights[i].position, lights[i].radius);
+		frameUniforms.lightColor[i] = glm::vec4(lights[i].color, 1.0f);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, scene.frameUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, offsetof(FrameUniforms, lightPos) + lightCount * sizeof(glm::vec4), &frameUniforms);
+	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(FrameUniforms, lightColor), lightCount * sizeof(glm::vec4), frameUniforms.lightColor);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	//Assign Object Color, 0.46f, 0.36f, 0.25f,  0.79f, 0.39f, 0.13f
+	glUniform3f(scene.objectColorLoc, 0.1f, 0.1f, 0.1f);
+
+	// With a texture array every object samples the same texture and only its layer changes
+	if (scene.textures.arrayTexture)
+		glBindTexture(GL_TEXTURE_2D_ARRAY, scene.textures.arrayTexture);
+	setupScope.End();
+
+	// Stage 1, spread over the job pool: world matrices, object boxes, culling and draw recording.
+	// Every worker records into its own bucket, so the threads never share a queue.
+	auto prepareStart = chrono::high_resolution_clock::now();
+	const vector<glm::mat4>& worldMatrices = scene.graph.worldMatrices;
+	ProfileScope matrixScope(profiler, "World matrices");
+	size_t movedNodes = UpdateWorldMatricesParallel(scene.graph, scene.jobs);
+	matrixScope.End();
+	if (movedNodes > 0)
+	{
+		//Objects moved, so re-box them and refit the hierarchy (rebuilt when objects were added)
+		ProfileScope boundsScope(profiler, "Object bounds and BVH refit");
+		const size_t boundsChunk = 1024;
+		ParallelFor(scene.jobs, (scene.objects.size() + boundsChunk - 1) / boundsChunk, [&](size_t chunk, unsigned)
 		{
-			glm::mat4 modelMatrix;
-			modelMatrix = glm::translate(modelMatrix, planePositions3[i] / glm::vec3(8., 8., 8.) + lightPosition);
-			modelMatrix = glm::translate(modelMatrix, glm::vec3(0.f, 5.0f, 0.f));
-			modelMatrix = glm::rotate(modelMatrix, planeRotations3[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-			modelMatrix = glm::scale(modelMatrix, glm::vec3(0.125f, 0.125f, 0.125f));
-			if (i >= 4)
-				modelMatrix = glm::rotate(modelMatrix, planeRotations3[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-			glUniformMatrix4fv(lampModelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			// Draw primitive(s)
-			draw();
-		}
-		for (GLuint i = 0; i < 6; i++)
+			size_t last = min(scene.objects.size(), (chunk + 1) * boundsChunk);
+			for (size_t i = chunk * boundsChunk; i < last; i++)
+				scene.objectBounds[i] = TransformAabb(scene.meshes.bounds[scene.objects[i].mesh], worldMatrices[scene.objects[i].node]);
+		});
+		if (scene.bvh.objectOrder.size() != scene.objects.size())
+			BuildBvh(scene.bvh, scene.objectBounds);
+		else
+			RefitBvh(scene.bvh, scene.objectBounds);
+	}
+
+	// Skip everything outside the view frustum, a few subtrees per thread keeps the workers evenly loaded
+	ProfileScope cullScope(profiler, "Cull and record");
+	Frustum frustum = ExtractFrustum(projectionMatrix * viewMatrix);
+	CullStats cullStats;
+	SplitBvhTasks(scene.bvh, frustum, JobPoolThreadCount(scene.jobs) * 4, scene.cullTasks, cullStats);
+	for (WorkerFrameData& worker : scene.workers)
+	{
+		ResetFrameArena(worker.arena);
+		BeginRenderQueue(worker.bucket, worker.arena, (uint32_t)scene.objects.size());
+		worker.stats = CullStats();
+	}
+	ParallelFor(scene.jobs, scene.cullTasks.size(), [&](size_t task, unsigned workerIndex)
+	{
+		ProfileScope taskScope(profiler, "Cull subtree", false, workerIndex);
+		WorkerFrameData& worker = scene.workers[workerIndex];
+		WalkBvh(scene.bvh, scene.objectBounds, frustum, scene.cullTasks[task], worker.stack, worker.stats,
+			[&](uint32_t object) { RecordObjectDraw(scene, object, projectionMatrix, fbHeight, worker.bucket); });
+	});
+	cullScope.End();
+	auto prepareEnd = chrono::high_resolution_clock::now();
+
+	// Bring the shadow maps up to date: only faces whose light moved, or that a caster moved in or out of, are drawn again
+	if (scene.shadows.enabled)
+	{
+		ProfileScope shadowScope(profiler, "Shadow maps", true);
+		//The light list can shrink below the map count after init (light sweep), those maps are left as they are
+		for (size_t i = 0; i < min(scene.shadows.maps.size(), lights.size()); i++)
+			UpdateShadowLights(scene.shadows, i, lights[i].position, lights[i].radius);
+		if (movedNodes > 0)
+			InvalidateShadowCasters(scene.shadows, scene.objectBounds);
+		CullStats shadowCullStats;
+		RenderShadowMaps(scene.shadows, scene.meshes, [&](const Frustum& faceFrustum)
+		{
+			WalkBvh(scene.bvh, scene.objectBounds, faceFrustum, { 0u, false }, scene.bvh.stack, shadowCullStats, [&](uint32_t object)
+			{
+				if (scene.objects[object].transparent)
+					return;
+				glUniformMatrix4fv(scene.shadows.modelLoc, 1, GL_FALSE, glm::value_ptr(worldMatrices[scene.objects[object].node]));
+				DrawMesh(scene.meshes, scene.objects[object].mesh);
+			});
+		});
+	}
+
+	// Stage 2, on the GL thread: merge the buckets into this frame's queue, sort and replay it
+	ProfileScope mergeScope(profiler, "Merge and sort queue", true);
+	uint32_t recorded = 0;
+	for (const WorkerFrameData& worker : scene.workers)
+	{
+		cullStats.visible += worker.stats.visible;
+		cullStats.nodesTested += worker.stats.nodesTested;
+		recorded += worker.bucket.count;
+	}
+	cullStats.culled = (uint32_t)scene.objects.size() - cullStats.visible;
+	scene.cullStats = cullStats;
+
+	ResetFrameArena(scene.frameArena);
+	BeginRenderQueue(scene.queue, scene.frameArena, recorded + 1 + (uint32_t)scene.instances.batches.size());
+	for (const WorkerFrameData& worker : scene.workers)
+		AppendRenderQueue(scene.queue, worker.bucket);
+
+	// One lamp cube instance per shaded light
+	GLsizei lampCount = clusteredLighting ? clusteredCount : lightCount;
+	scene.lampMatrices.resize(lampCount);
+	for (GLsizei i = 0; i < lampCount; i++)
+	{
+		scene.lampMatrices[i] = glm::translate(glm::mat4(1.0f), lights[i].position + lampOffset);
+		scene.lampMatrices[i] = glm::scale(scene.lampMatrices[i], glm::vec3(lampScale, lampScale, lampScale));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, scene.lampInstanceVBO);
+	glBufferData(GL_ARRAY_BUFFER, MAX_CLUSTERED_LIGHTS * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW); //orphan last frame's matrices
+	glBufferSubData(GL_ARRAY_BUFFER, 0, lampCount * sizeof(glm::mat4), scene.lampMatrices.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if (lampCount > 0)
+		PushDraw(scene.queue, MakeRenderKey(false, SORT_LAMP, SORT_LAMP, NO_QUEUE_TEXTURE, 0.0f),
+			{ scene.lampShaderProgram, scene.lampVAO, scene.lampMesh, NO_QUEUE_TEXTURE, lampCount, nullptr, glm::mat3(1.0f) });
+
+	// One instanced draw per stress mesh, their selectors map to whichever layers the textures have landed in
+	if (scene.instances.perBatch > 0)
+	{
+		for (size_t i = 0; i < scene.instanceTextures.size(); i++)
+			scene.instanceLayers[i] = ResolveTextureLayer(scene.textures, scene.instanceTextures[i]);
+		glUseProgram(scene.instanceProgram);
+		glUniform1iv(scene.instanceLayersLoc, (GLsizei)scene.instanceLayers.size(), scene.instanceLayers.data());
+		for (uint32_t i = 0; i < scene.instances.batches.size(); i++)
 		{
-			glm::mat4 modelMatrix;
-			modelMatrix = glm::translate(modelMatrix, planePositions3[i] / glm::vec3(8., 8., 8.) + lightPosition2);
-			modelMatrix = glm::translate(modelMatrix, glm::vec3(0.f, 5.0f, 0.f));
-			modelMatrix = glm::rotate(modelMatrix, planeRotations3[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-			modelMatrix = glm::scale(modelMatrix, glm::vec3(0.125f, 0.125f, 0.125f));
-			if (i >= 4)
-				modelMatrix = glm::rotate(modelMatrix, planeRotations3[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-			glUniformMatrix4fv(lampModelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			// Draw primitive(s)
-			draw();
+			const InstanceBatch& batch = scene.instances.batches[i];
+			PushDraw(scene.queue, MakeRenderKey(false, SORT_INSTANCED, i, NO_QUEUE_TEXTURE, 0.0f),
+				{ scene.instanceProgram, batch.vao, batch.mesh, NO_QUEUE_TEXTURE, (GLsizei)scene.instances.perBatch, nullptr, glm::mat3(1.0f) });
 		}
+	}
 
-		// Unbind Shader exe and VOA after drawing per frame
-		glBindVertexArray(0); //Incase different VAO wii be used after
+	SortRenderQueue(scene.queue);
+	mergeScope.End();
+	if (depthPrepass)
+		ExecuteDepthPrepass(scene, scene.queue);
+	if (scene.countShadedFragments)
+		glBeginQuery(GL_SAMPLES_PASSED, scene.fragmentQuery);
+	ExecuteRenderQueue(scene, scene.queue);
+	if (scene.countShadedFragments)
+	{
+		glEndQuery(GL_SAMPLES_PASSED);
+		glGetQueryObjectui64v(scene.fragmentQuery, GL_QUERY_RESULT, &scene.shadedFragments); //waits for the GPU, so only on request
+	}
+	scene.prepareMs = chrono::duration<double, milli>(prepareEnd - prepareStart).count();
+	scene.submitMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - prepareEnd).count();
 
+	// Unbind Shader exe and VOA after drawing per frame
+	glBindVertexArray(0); //Incase different VAO wii be used after
+	glUseProgram(0); // Incase different shader will be used after
+}
 
+// Lay down the depth of every opaque scene object with the depth-only program and no color writes.
+// The queue is already front to back within each state group, so most hidden surfaces fail early.
+static void ExecuteDepthPrepass(SceneResources& scene, const RenderQueue& queue)
+{
+	ProfileScope prepassScope(profiler, "Depth pre-pass", true);
+	glUseProgram(scene.prepassProgram);
+	glBindVertexArray(scene.meshes.vao);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	for (uint32_t i = 0; i < queue.count; i++)
+	{
+		const RenderCommand& command = queue.commands[i];
+		const DrawItem& item = queue.items[command.item];
+		if (IsTransparentKey(command.key) || item.program != scene.shaderProgram)
+			continue;
+		glUniformMatrix4fv(scene.prepassModelLoc, 1, GL_FALSE, glm::value_ptr(*item.model));
+		DrawMesh(scene.meshes, item.mesh);
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
 
+// Issue the sorted draws, changing program, VAO and texture only when the next draw needs a different one
+static void ExecuteRenderQueue(SceneResources& scene, const RenderQueue& queue)
+{
+	ProfileScope executeScope(profiler, "Execute queue", true);
+	GLuint program = 0, vao = 0, texture = NO_QUEUE_TEXTURE;
+	bool blending = false, equalDepth = false;
+	scene.queueStateChanges = 0;
 
+	// The overdraw view adds up every shaded fragment, transparent or not
+	if (overdrawView)
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		blending = true;
+	}
 
+	//Each run of draws with the same program (and blending) is timed as one object group
+	ProfileMark group = {};
+	bool groupOpen = false;
 
-		glUseProgram(0); // Incase different shader will be used after
+	for (uint32_t i = 0; i < queue.count; i++)
+	{
+		const RenderCommand& command = queue.commands[i];
+		const DrawItem& item = queue.items[command.item];
 
-	    /* Swap front and back buffers */
-		glfwSwapBuffers(window);
+		bool startsGroup = item.program != program || (IsTransparentKey(command.key) && !blending);
+		if (startsGroup)
+		{
+			if (groupOpen)
+				EndProfileScope(profiler, group);
+			const char* groupName = item.program == scene.lampShaderProgram ? "Lamps"
+				: item.program == scene.instanceProgram ? "Instances"
+				: (IsTransparentKey(command.key) ? "Transparent objects" : "Opaque objects");
+			group = BeginProfileScope(profiler, groupName, true);
+			groupOpen = true;
+		}
 
-		/* Poll for and process events */
-		glfwPollEvents();
+		// Draws the pre-pass laid down only shade the fragments that won it, depth is already written
+		bool prepassed = depthPrepass && !IsTransparentKey(command.key) && item.program == scene.shaderProgram;
+		if (prepassed != equalDepth)
+		{
+			glDepthFunc(prepassed ? GL_EQUAL : GL_LESS);
+			glDepthMask(prepassed ? GL_FALSE : GL_TRUE);
+			equalDepth = prepassed;
+		}
 
-		//Poll Camera Transformations
-		TransformCamera();
-	}
+		// Transparent draws sort last, blend them over the opaque scene without writing depth
+		if (IsTransparentKey(command.key) && !blending)
+		{
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glDepthMask(GL_FALSE);
+			blending = true;
+		}
+
+		if (item.program != program)
+		{
+			glUseProgram(item.program);
+			program = item.program;
+			scene.queueStateChanges++;
+		}
+		if (item.vao != vao)
+		{
+			glBindVertexArray(item.vao);
+			vao = item.vao;
+			scene.queueStateChanges++;
+		}
+		if (item.texture != NO_QUEUE_TEXTURE && item.texture != texture)
+		{
+			BindMaterial(scene, item.texture);
+			texture = item.texture;
+			scene.queueStateChanges++;
+		}
 
-	//Clear GPU resources
-	glDeleteVertexArrays(1, &cylinderVAO);
-	glDeleteBuffers(1, &cylinderVBO);
-	glDeleteBuffers(1, &cylinderEBO);
-	glDeleteVertexArrays(1, &floorVAO);
-	glDeleteBuffers(1, &floorVBO);
-	glDeleteBuffers(1, &floorEBO);
+		if (item.instanceCount > 0)
+			DrawMeshInstanced(scene.meshes, item.mesh, item.instanceCount);
+		else
+		{
+			SetModelUniforms(scene, *item.model, item.normalMatrix);
+			DrawMesh(scene.meshes, item.mesh);
+		}
+	}
 
+	if (groupOpen)
+		EndProfileScope(profiler, group);
+	if (equalDepth)
+	{
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
+	if (blending)
+	{
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+	}
+}
 
-	glfwTerminate();
-	return 0;
+//Clear GPU resources
+void DestroyScene(SceneResources& scene)
+{
+	DestroyMeshRegistry(scene.meshes);
+	glDeleteVertexArrays(1, &scene.lampVAO);
+	glDeleteBuffers(1, &scene.lampInstanceVBO);
+	DestroyInstanceBatches(scene.instances);
+	DestroyJobPool(scene.jobs);
+	if (clusteredLighting)
+		DestroyLightClusters(scene.clusters);
+	DestroyShadowMaps(scene.shadows);
+	DestroyDynamicResolution(scene.resolution);
+
+	DestroyTextureStreamer(scene.textures);
+
+	glDeleteProgram(scene.shaderProgram);
+	glDeleteProgram(scene.lampShaderProgram);
+	if (scene.prepassProgram)
+		glDeleteProgram(scene.prepassProgram);
+	if (scene.instanceProgram)
+		glDeleteProgram(scene.instanceProgram);
+	glDeleteQueries(1, &scene.fragmentQuery);
+	glDeleteBuffers(1, &scene.frameUBO);
 }
 
 //Define input callback functions
@@ -1094,8 +2663,11 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 	//Display ASCII keycode
 	//cout << " ASCII: " << key << endl;
 
+	frameDirty = true;
 	if (action == GLFW_PRESS) {
 		keys[key] = true;
+		if (key == GLFW_KEY_F12)
+			traceRequested = true;
 	}
 	else if (action == GLFW_RELEASE) {
 		keys[key] = false;
@@ -1111,6 +2683,8 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
 	cout << yoffset << endl;
 	*/
 
+	frameDirty = true;
+
 	//Clamp fov
 	if (fov >= 1.f && fov <= 45.f)
 		fov -= yoffset * 0.05f;//changing the float value changes the zoom speed up/down
@@ -1133,6 +2707,7 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 		cout << "RMB clicked!" << endl;
 	*/
 
+	frameDirty = true;
 	if (action == GLFW_PRESS)
 		mouseButtons[button] = true;
 	else if (action == GLFW_RELEASE)
@@ -1157,6 +2732,10 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
 	lastX = xpos;
 	lastY = ypos;
 
+	//Only moving the camera changes the picture
+	if (isPanning || isOrbiting)
+		frameDirty = true;
+
 	//Pan camera
 	if (isPanning)
 	{
@@ -1195,6 +2774,16 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
 
 }
 
+//Resizing, or the window being uncovered, needs the frame drawn again
+void framebuffer_size_callback(GLFWwindow*, int fbWidth, int fbHeight) {
+	width = fbWidth;
+	height = fbHeight;
+	frameDirty = true;
+}
+void window_refresh_callback(GLFWwindow*) {
+	frameDirty = true;
+}
+
 //Define get target function
 glm::vec3 getTarget() {
 	if (isPanning)
@@ -1230,4 +2819,4 @@ void initCamera()
 	cameraRight = glm::normalize(glm::cross(worldUp, cameraDirection));
 	cameraUp = glm::normalize(glm::cross(cameraDirection, cameraRight));
 	cameraFront = glm::normalize(glm::vec3(0.0f, 0.f, -1.f));
-}
\ No newline at end of file
+}
\ No newline at end of file
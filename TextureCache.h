@@ -0,0 +1,520 @@
+#pragma once
+
+// Precompiled texture cache.
+// The first time a texture is loaded (or when baking with --bake-textures) the source image is
+// decoded once, its full mip chain is built on the CPU and stored next to it as
+// "<source>.texcache", either as RGBA8 or as BC1 (S3TC DXT1, 4 bits per texel). Later runs map
+// the cache file and pass each level's bytes straight to glTexImage2D/glCompressedTexImage2D.
+// A cache is only used when its stored FNV-1a hash matches the current source file.
+// Texture array layers use the same format, resized to the array's square layer size.
+
+#include <GLEW/glew.h>
+#include <SOIL2/SOIL2.H>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTURE_CACHE_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "MappedFile.h"
+
+enum TextureCacheFormat
+{
+	TEXTURE_CACHE_OFF = 0,	//decode the source every launch
+	TEXTURE_CACHE_RGBA8 = 1,
+	TEXTURE_CACHE_BC1 = 2
+};
+
+const uint32_t TEXTURE_CACHE_MAGIC = 0x48435854; //"TXCH"
+const uint32_t TEXTURE_CACHE_VERSION = 1;
+const uint32_t TEXTURE_CACHE_MAX_MIPS = 16;
+
+struct TextureCacheMip
+{
+	uint32_t width, height;
+	uint64_t offset, size;	//bytes from the start of the file
+};
+
+//Fixed-size header at the start of every cache file, mip data follows 16-byte aligned
+struct TextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash;
+	uint32_t format;
+	uint32_t width, height;
+	uint32_t mipCount;
+	TextureCacheMip mips[TEXTURE_CACHE_MAX_MIPS];
+};
+
+//A validated cache image, either a mapped file or built in memory
+struct TextureCacheFile
+{
+	MappedFile file;
+	std::vector<unsigned char> memory;
+};
+
+// Cache bytes (header first), or nullptr if nothing is open
+static const unsigned char* TextureCacheBytes(const TextureCacheFile& cache)
+{
+	if (cache.file.data)
+		return cache.file.data;
+	return cache.memory.empty() ? nullptr : cache.memory.data();
+}
+
+static const TextureCacheHeader& TextureCacheHeaderOf(const TextureCacheFile& cache)
+{
+	return *(const TextureCacheHeader*)TextureCacheBytes(cache);
+}
+
+// Cache file for a source image, resized caches (texture array layers) get the size in the name
+static std::string TextureCachePath(const std::string& sourcePath, uint32_t size = 0)
+{
+	if (size)
+		return sourcePath + "." + std::to_string(size) + ".texcache";
+	return sourcePath + ".texcache";
+}
+
+static size_t TextureLevelSize(TextureCacheFormat format, uint32_t levelWidth, uint32_t levelHeight)
+{
+	if (format == TEXTURE_CACHE_BC1)
+		return (size_t)((levelWidth + 3) / 4) * ((levelHeight + 3) / 4) * 8;
+	return (size_t)levelWidth * levelHeight * 4;
+}
+
+// Next mip level with a 2x2 box filter; odd edges reuse their last row/column
+static std::vector<unsigned char> DownsampleRGBA(const std::vector<unsigned char>& source, uint32_t sourceWidth, uint32_t sourceHeight)
+{
+	uint32_t levelWidth = std::max(1u, sourceWidth / 2), levelHeight = std::max(1u, sourceHeight / 2);
+	std::vector<unsigned char> level((size_t)levelWidth * levelHeight * 4);
+
+	for (uint32_t y = 0; y < levelHeight; y++)
+	{
+		uint32_t y0 = std::min(y * 2, sourceHeight - 1), y1 = std::min(y * 2 + 1, sourceHeight - 1);
+		for (uint32_t x = 0; x < levelWidth; x++)
+		{
+			uint32_t x0 = std::min(x * 2, sourceWidth - 1), x1 = std::min(x * 2 + 1, sourceWidth - 1);
+			for (int c = 0; c < 4; c++)
+			{
+				unsigned sum = source[((size_t)y0 * sourceWidth + x0) * 4 + c] + source[((size_t)y0 * sourceWidth + x1) * 4 + c]
+					+ source[((size_t)y1 * sourceWidth + x0) * 4 + c] + source[((size_t)y1 * sourceWidth + x1) * 4 + c];
+				level[((size_t)y * levelWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+	return level;
+}
+
+static uint16_t PackRGB565(const int color[3])
+{
+	return (uint16_t)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
+}
+
+static void UnpackRGB565(uint16_t packed, int color[3])
+{
+	int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+// Endpoints from the block's bounding box, inset by 1/16 of its extent to cut the error of the
+// outermost texels, then quantized to 565. Writes color0 > color1 (opaque four-color mode).
+static void ChooseBC1Endpoints(const unsigned char minColor[4], const unsigned char maxColor[4], uint16_t& color0, uint16_t& color1)
+{
+	int low[3], high[3];
+	for (int c = 0; c < 3; c++)
+	{
+		int inset = (maxColor[c] - minColor[c]) >> 4;
+		low[c] = std::min(255, minColor[c] + inset);
+		high[c] = std::max(0, maxColor[c] - inset);
+	}
+	color0 = PackRGB565(high);
+	color1 = PackRGB565(low);
+	if (color0 < color1)
+		std::swap(color0, color1);
+}
+
+// Palette index for each of the 16 texels: project onto the endpoint line and round to
+// one of the four steps. projection = dot(texel - end1, end0 - end1) * 3 / |end0 - end1|^2
+static const uint32_t bc1StepToIndex[4] = { 1, 3, 2, 0 };
+
+#if !defined(TEXTURE_CACHE_SSE2)
+static uint32_t BC1IndexFromProjection(int dot, float scale)
+{
+	int step = (int)((float)dot * scale + 0.5f);
+	step = std::min(3, std::max(0, step));
+	return bc1StepToIndex[step];
+}
+
+// Reference encoder for one 4x4 RGBA block (64 bytes, rows of 4 texels), used where SSE2 is not available
+static void EncodeBC1BlockScalar(const unsigned char* block, unsigned char* output)
+{
+	unsigned char minColor[4] = { 255, 255, 255, 255 }, maxColor[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 4; c++)
+		{
+			minColor[c] = std::min(minColor[c], block[i * 4 + c]);
+			maxColor[c] = std::max(maxColor[c], block[i * 4 + c]);
+		}
+
+	uint16_t color0, color1;
+	ChooseBC1Endpoints(minColor, maxColor, color0, color1);
+
+	uint32_t indices = 0;
+	if (color0 != color1)
+	{
+		int end0[3], end1[3], axis[3];
+		UnpackRGB565(color0, end0);
+		UnpackRGB565(color1, end1);
+		int lengthSquared = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			axis[c] = end0[c] - end1[c];
+			lengthSquared += axis[c] * axis[c];
+		}
+		float scale = 3.0f / (float)lengthSquared;
+
+		for (int i = 0; i < 16; i++)
+		{
+			int dot = 0;
+			for (int c = 0; c < 3; c++)
+				dot += (block[i * 4 + c] - end1[c]) * axis[c];
+			indices |= BC1IndexFromProjection(dot, scale) << (i * 2);
+		}
+	}
+
+	memcpy(output, &color0, 2);
+	memcpy(output + 2, &color1, 2);
+	memcpy(output + 4, &indices, 4);
+}
+#else
+// SSE2 encoder, bit-identical to EncodeBC1BlockScalar: bounding box with byte min/max across
+// the block, and four texel projections per multiply-add
+static void EncodeBC1BlockSSE2(const unsigned char* block, unsigned char* output)
+{
+	__m128i row0 = _mm_loadu_si128((const __m128i*)(block + 0));
+	__m128i row1 = _mm_loadu_si128((const __m128i*)(block + 16));
+	__m128i row2 = _mm_loadu_si128((const __m128i*)(block + 32));
+	__m128i row3 = _mm_loadu_si128((const __m128i*)(block + 48));
+
+	//Reduce 16 texels to one min and one max texel
+	__m128i minimum = _mm_min_epu8(_mm_min_epu8(row0, row1), _mm_min_epu8(row2, row3));
+	__m128i maximum = _mm_max_epu8(_mm_max_epu8(row0, row1), _mm_max_epu8(row2, row3));
+	minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+	maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(1, 0, 3, 2)));
+	minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+	maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	uint32_t packedMin = (uint32_t)_mm_cvtsi128_si32(minimum), packedMax = (uint32_t)_mm_cvtsi128_si32(maximum);
+	unsigned char minColor[4], maxColor[4];
+	memcpy(minColor, &packedMin, 4);
+	memcpy(maxColor, &packedMax, 4);
+
+	uint16_t color0, color1;
+	ChooseBC1Endpoints(minColor, maxColor, color0, color1);
+
+	uint32_t indices = 0;
+	if (color0 != color1)
+	{
+		int end0[3], end1[3];
+		UnpackRGB565(color0, end0);
+		UnpackRGB565(color1, end1);
+		int lengthSquared = 0;
+		for (int c = 0; c < 3; c++)
+			lengthSquared += (end0[c] - end1[c]) * (end0[c] - end1[c]);
+		float scale = 3.0f / (float)lengthSquared;
+
+		//16-bit lanes hold two texels as r,g,b,a; alpha gets a zero weight
+		__m128i zero = _mm_setzero_si128();
+		__m128i base = _mm_setr_epi16((short)end1[0], (short)end1[1], (short)end1[2], 0, (short)end1[0], (short)end1[1], (short)end1[2], 0);
+		__m128i axis = _mm_setr_epi16((short)(end0[0] - end1[0]), (short)(end0[1] - end1[1]), (short)(end0[2] - end1[2]), 0,
+			(short)(end0[0] - end1[0]), (short)(end0[1] - end1[1]), (short)(end0[2] - end1[2]), 0);
+		__m128 scaleVector = _mm_set1_ps(scale);
+		__m128 half = _mm_set1_ps(0.5f);
+
+		const __m128i rows[4] = { row0, row1, row2, row3 };
+		for (int r = 0; r < 4; r++)
+		{
+			__m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(rows[r], zero), base);	//texels 0,1
+			__m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(rows[r], zero), base);	//texels 2,3
+			__m128i pairsLow = _mm_madd_epi16(low, axis);	//r+g and b+a products per texel
+			__m128i pairsHigh = _mm_madd_epi16(high, axis);
+
+			//Add each texel's two partial sums: (p0, p0', p1, p1') + (p2, ...) -> dots of texels 0..3
+			__m128i evens = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(pairsLow), _mm_castsi128_ps(pairsHigh), _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i odds = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(pairsLow), _mm_castsi128_ps(pairsHigh), _MM_SHUFFLE(3, 1, 3, 1)));
+			__m128i dots = _mm_add_epi32(evens, odds);
+
+			__m128i steps = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(dots), scaleVector), half));
+			int stepValues[4];
+			_mm_storeu_si128((__m128i*)stepValues, steps);
+			for (int i = 0; i < 4; i++)
+			{
+				int step = std::min(3, std::max(0, stepValues[i]));
+				indices |= bc1StepToIndex[step] << ((r * 4 + i) * 2);
+			}
+		}
+	}
+
+	memcpy(output, &color0, 2);
+	memcpy(output + 2, &color1, 2);
+	memcpy(output + 4, &indices, 4);
+}
+#endif
+
+// Compress one RGBA8 level to BC1, edge blocks of levels smaller than 4x4 repeat their last texel
+static void EncodeBC1(const unsigned char* pixels, uint32_t levelWidth, uint32_t levelHeight, unsigned char* output)
+{
+	unsigned char block[64];
+	for (uint32_t by = 0; by < levelHeight; by += 4)
+	{
+		for (uint32_t bx = 0; bx < levelWidth; bx += 4)
+		{
+			for (uint32_t y = 0; y < 4; y++)
+			{
+				uint32_t sourceY = std::min(by + y, levelHeight - 1);
+				for (uint32_t x = 0; x < 4; x++)
+				{
+					uint32_t sourceX = std::min(bx + x, levelWidth - 1);
+					memcpy(&block[(y * 4 + x) * 4], &pixels[((size_t)sourceY * levelWidth + sourceX) * 4], 4);
+				}
+			}
+#if defined(TEXTURE_CACHE_SSE2)
+			EncodeBC1BlockSSE2(block, output);
+#else
+			EncodeBC1BlockScalar(block, output);
+#endif
+			output += 8;
+		}
+	}
+}
+
+// Resample an RGBA8 image to size x size: halve with the box filter while that stays at or above
+// the target, then finish with a bilinear pass
+static std::vector<unsigned char> ResizeRGBA(std::vector<unsigned char> pixels, uint32_t& imageWidth, uint32_t& imageHeight, uint32_t size)
+{
+	while (imageWidth / 2 >= size && imageHeight / 2 >= size)
+	{
+		pixels = DownsampleRGBA(pixels, imageWidth, imageHeight);
+		imageWidth /= 2;
+		imageHeight /= 2;
+	}
+	if (imageWidth == size && imageHeight == size)
+		return pixels;
+
+	std::vector<unsigned char> resized((size_t)size * size * 4);
+	for (uint32_t y = 0; y < size; y++)
+	{
+		float sourceY = std::max(0.0f, ((float)y + 0.5f) * (float)imageHeight / (float)size - 0.5f);
+		uint32_t y0 = std::min((uint32_t)sourceY, imageHeight - 1), y1 = std::min(y0 + 1, imageHeight - 1);
+		float fy = sourceY - (float)y0;
+		for (uint32_t x = 0; x < size; x++)
+		{
+			float sourceX = std::max(0.0f, ((float)x + 0.5f) * (float)imageWidth / (float)size - 0.5f);
+			uint32_t x0 = std::min((uint32_t)sourceX, imageWidth - 1), x1 = std::min(x0 + 1, imageWidth - 1);
+			float fx = sourceX - (float)x0;
+			for (int c = 0; c < 4; c++)
+			{
+				float top = pixels[((size_t)y0 * imageWidth + x0) * 4 + c] * (1.0f - fx) + pixels[((size_t)y0 * imageWidth + x1) * 4 + c] * fx;
+				float bottom = pixels[((size_t)y1 * imageWidth + x0) * 4 + c] * (1.0f - fx) + pixels[((size_t)y1 * imageWidth + x1) * 4 + c] * fx;
+				resized[((size_t)y * size + x) * 4 + c] = (unsigned char)(top * (1.0f - fy) + bottom * fy + 0.5f);
+			}
+		}
+	}
+	imageWidth = imageHeight = size;
+	return resized;
+}
+
+// Lay out a header and full mip chain for an RGBA8 image exactly as it is stored on disk
+static void EncodeTextureImage(std::vector<unsigned char> level, uint32_t imageWidth, uint32_t imageHeight,
+	TextureCacheFormat format, uint64_t sourceHash, std::vector<unsigned char>& image)
+{
+	TextureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = TEXTURE_CACHE_MAGIC;
+	header.version = TEXTURE_CACHE_VERSION;
+	header.sourceHash = sourceHash;
+	header.format = format;
+	header.width = imageWidth;
+	header.height = imageHeight;
+
+	image.assign((sizeof(TextureCacheHeader) + 15) & ~(size_t)15, 0);
+	uint32_t levelWidth = imageWidth, levelHeight = imageHeight;
+	for (;;)
+	{
+		TextureCacheMip& mip = header.mips[header.mipCount++];
+		mip.width = levelWidth;
+		mip.height = levelHeight;
+		mip.offset = image.size();
+		mip.size = TextureLevelSize(format, levelWidth, levelHeight);
+		image.resize((size_t)((mip.offset + mip.size + 15) & ~(uint64_t)15), 0);
+
+		if (format == TEXTURE_CACHE_BC1)
+			EncodeBC1(level.data(), levelWidth, levelHeight, &image[(size_t)mip.offset]);
+		else
+			memcpy(&image[(size_t)mip.offset], level.data(), (size_t)mip.size);
+
+		if ((levelWidth == 1 && levelHeight == 1) || header.mipCount == TEXTURE_CACHE_MAX_MIPS)
+			break;
+		level = DownsampleRGBA(level, levelWidth, levelHeight);
+		levelWidth = std::max(1u, levelWidth / 2);
+		levelHeight = std::max(1u, levelHeight / 2);
+	}
+	memcpy(image.data(), &header, sizeof(header));
+}
+
+//SOIL keeps its last result in one global, so decoding and reading that result share a lock
+static std::mutex soilMutex;
+
+// Decode an image file to RGBA8 (free it with SOIL_free_image_data). On failure returns nullptr
+// and, if error is given, stores SOIL's reason in it.
+static unsigned char* DecodeImageRGBA(const std::string& path, int& width, int& height, std::string* error = nullptr)
+{
+	std::lock_guard<std::mutex> lock(soilMutex);
+	unsigned char* pixels = SOIL_load_image(path.c_str(), &width, &height, 0, SOIL_LOAD_RGBA);
+	if (!pixels && error)
+		*error = SOIL_last_result();
+	return pixels;
+}
+
+// Decode a source image (resized to size x size unless size is 0) into a cache image.
+// On failure, error (if given) says why.
+static bool BuildTextureImage(const std::string& sourcePath, TextureCacheFormat format, uint32_t size, std::vector<unsigned char>& image, std::string* error = nullptr)
+{
+	uint64_t sourceHash;
+	if (!HashFile(sourcePath, sourceHash))
+	{
+		if (error)
+			*error = "could not read the source file";
+		return false;
+	}
+
+	int imageWidth, imageHeight;
+	unsigned char* decoded = DecodeImageRGBA(sourcePath, imageWidth, imageHeight, error);
+	if (!decoded)
+		return false;
+	std::vector<unsigned char> pixels(decoded, decoded + (size_t)imageWidth * imageHeight * 4);
+	SOIL_free_image_data(decoded);
+
+	uint32_t levelWidth = (uint32_t)imageWidth, levelHeight = (uint32_t)imageHeight;
+	if (size)
+		pixels = ResizeRGBA(pixels, levelWidth, levelHeight, size);
+	EncodeTextureImage(pixels, levelWidth, levelHeight, format, sourceHash, image);
+	return true;
+}
+
+// Build a cache image and write it to disk (via a temporary file so a crash never leaves a
+// truncated cache behind)
+static bool BuildTextureCache(const std::string& sourcePath, TextureCacheFormat format, uint32_t size = 0)
+{
+	std::vector<unsigned char> image;
+	if (!BuildTextureImage(sourcePath, format, size, image))
+		return false;
+
+	return WriteFileReplacing(TextureCachePath(sourcePath, size), image.data(), image.size());
+}
+
+// Check that cache bytes are complete and in the expected format and size
+static bool ValidTextureImage(const unsigned char* data, size_t dataSize, TextureCacheFormat format, uint32_t size)
+{
+	const TextureCacheHeader* header = (const TextureCacheHeader*)data;
+	bool valid = dataSize >= sizeof(TextureCacheHeader)
+		&& header->magic == TEXTURE_CACHE_MAGIC
+		&& header->version == TEXTURE_CACHE_VERSION
+		&& header->format == (uint32_t)format
+		&& header->mipCount > 0 && header->mipCount <= TEXTURE_CACHE_MAX_MIPS
+		&& (size == 0 || (header->width == size && header->height == size));
+	for (uint32_t i = 0; valid && i < header->mipCount; i++)
+		valid = header->mips[i].offset + header->mips[i].size <= dataSize;
+	return valid;
+}
+
+// Map a cache file and check it against the format, size and source hash it must have.
+// A missing source file is not an error: shipped caches can be used without their sources.
+static bool OpenTextureCache(const std::string& sourcePath, TextureCacheFormat format, TextureCacheFile& cache, uint32_t size = 0)
+{
+	cache = TextureCacheFile();
+	if (!MapFile(TextureCachePath(sourcePath, size), cache.file))
+		return false;
+
+	bool valid = ValidTextureImage(cache.file.data, cache.file.size, format, size);
+	uint64_t sourceHash;
+	if (valid && HashFile(sourcePath, sourceHash))
+		valid = sourceHash == TextureCacheHeaderOf(cache).sourceHash;
+
+	if (!valid)
+	{
+		UnmapFile(cache.file);
+		return false;
+	}
+	return true;
+}
+
+// Open the cache for a source image, rebuilding it first if it is missing or stale
+static bool OpenOrBuildTextureCache(const std::string& sourcePath, TextureCacheFormat format, TextureCacheFile& cache, uint32_t size = 0)
+{
+	if (OpenTextureCache(sourcePath, format, cache, size))
+		return true;
+	return BuildTextureCache(sourcePath, format, size) && OpenTextureCache(sourcePath, format, cache, size);
+}
+
+// Same image as a cache file but kept in memory, for when cache files are turned off
+static bool BuildTextureCacheInMemory(const std::string& sourcePath, TextureCacheFormat format, TextureCacheFile& cache, uint32_t size = 0, std::string* error = nullptr)
+{
+	cache = TextureCacheFile();
+	return BuildTextureImage(sourcePath, format, size, cache.memory, error);
+}
+
+// Upload every stored level of a cache straight from its bytes into the bound GL_TEXTURE_2D.
+// Returns the number of bytes of texture memory the levels occupy.
+static size_t UploadTextureCache(const TextureCacheFile& cache)
+{
+	const TextureCacheHeader& header = TextureCacheHeaderOf(cache);
+	size_t bytes = 0;
+	for (uint32_t i = 0; i < header.mipCount; i++)
+	{
+		const TextureCacheMip& mip = header.mips[i];
+		const unsigned char* levelData = TextureCacheBytes(cache) + mip.offset;
+		if (header.format == TEXTURE_CACHE_BC1)
+			glCompressedTexImage2D(GL_TEXTURE_2D, i, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, mip.width, mip.height, 0, (GLsizei)mip.size, levelData);
+		else
+			glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, mip.width, mip.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, levelData);
+		bytes += (size_t)mip.size;
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.mipCount - 1);
+	return bytes;
+}
+
+// Upload a cache's levels into one layer of the bound GL_TEXTURE_2D_ARRAY, whose storage must
+// already match the cache's size, format and mip count
+static size_t UploadTextureCacheLayer(const TextureCacheFile& cache, GLint layer)
+{
+	const TextureCacheHeader& header = TextureCacheHeaderOf(cache);
+	size_t bytes = 0;
+	for (uint32_t i = 0; i < header.mipCount; i++)
+	{
+		const TextureCacheMip& mip = header.mips[i];
+		const unsigned char* levelData = TextureCacheBytes(cache) + mip.offset;
+		if (header.format == TEXTURE_CACHE_BC1)
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, mip.width, mip.height, 1, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, (GLsizei)mip.size, levelData);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, mip.width, mip.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, levelData);
+		bytes += (size_t)mip.size;
+	}
+	return bytes;
+}
+
+static void CloseTextureCache(TextureCacheFile& cache)
+{
+	UnmapFile(cache.file);
+	cache = TextureCacheFile();
+}
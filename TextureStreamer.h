@@ -0,0 +1,457 @@
+#pragma once
+
+// Asynchronous texture loading.
+// Image files are decoded by a small pool of worker threads; the render thread copies finished
+// images into a ring of pixel buffer objects and issues glTexImage2D from the PBO, so neither
+// decoding nor the client-memory copy inside the driver stalls a frame. Until a texture is
+// resident its handle resolves to a 1x1 placeholder, and reloading a handle keeps the old
+// image bound until the new one has been uploaded.
+// With a cache format set, workers instead map (building on first use) the texture's cache
+// file and its stored mip chain is uploaded directly from the mapping.
+// With a texture array, every texture is resized to the array's layer size and uploaded into its
+// own layer; the scene then binds one texture and selects layers per draw (layer 0 is the
+// placeholder).
+
+#include <GLEW/glew.h>
+#include <SOIL2/SOIL2.H>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "TextureCache.h"
+
+typedef GLuint TextureHandle;
+
+//Decode request and its result, passed between the render thread and the workers
+struct TextureJob
+{
+	TextureHandle handle;
+	GLuint generation;	//drops results of a load that was superseded by a newer reload
+	std::string path;
+	unsigned char* pixels = nullptr; //RGBA8, owned by SOIL until freed
+	int width = 0, height = 0;
+	TextureCacheFile cache;			//used instead of pixels when the streamer has a cache format
+	GLint layer = 0;				//texture array layer to fill, 0 for a standalone texture
+	std::string error;				//why decoding failed, copied on the worker that saw it
+};
+
+//One texture the scene refers to
+struct TextureSlot
+{
+	GLuint texture = 0;		//0 until the first upload finishes
+	GLuint generation = 0;
+	std::string path;
+	bool pending = false;
+	size_t bytes = 0;		//GPU memory of the resident image including mips
+	GLint layer = 0;		//texture array layer once resident, 0 (placeholder) until then
+};
+
+//Staging buffer the driver copies from, reused once its fence has signalled
+struct UploadBuffer
+{
+	GLuint pbo = 0;
+	GLsizeiptr capacity = 0;
+	GLsync fence = 0;
+};
+
+const int TEXTURE_UPLOAD_BUFFERS = 3;
+
+struct TextureStreamer
+{
+	std::vector<TextureSlot> slots;
+	GLuint placeholder = 0;
+	UploadBuffer uploadBuffers[TEXTURE_UPLOAD_BUFFERS];
+	int nextUploadBuffer = 0;
+	size_t uploadBudget = 8 * 1024 * 1024;	//bytes copied per PumpTextureUploads call, keeps big swaps from hitching one frame
+	TextureCacheFormat cacheFormat = TEXTURE_CACHE_OFF;	//set before the first load
+
+	//Optional GL_TEXTURE_2D_ARRAY every texture is packed into, see InitTextureArray
+	GLuint arrayTexture = 0;
+	GLuint arrayLayerSize = 0;
+	GLint arrayLayers = 0;
+	TextureCacheFormat arrayFormat = TEXTURE_CACHE_RGBA8;
+	size_t arrayBytes = 0;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<TextureJob> requests;	//waiting for a worker
+	std::deque<TextureJob> decoded;		//waiting for the render thread
+	bool stopping = false;
+};
+
+// Worker thread body: decode requests until the streamer shuts down
+static void TextureDecodeWorker(TextureStreamer* streamer)
+{
+	for (;;)
+	{
+		TextureJob job;
+		{
+			std::unique_lock<std::mutex> lock(streamer->mutex);
+			streamer->wake.wait(lock, [streamer] { return streamer->stopping || !streamer->requests.empty(); });
+			if (streamer->stopping)
+				return;
+			job = std::move(streamer->requests.front());
+			streamer->requests.pop_front();
+		}
+
+		TextureCacheFormat cacheFormat = streamer->cacheFormat;
+		if (job.layer)
+		{
+			//Array layers always go through a resized mip chain, on disk if caching is on
+			bool cached = cacheFormat != TEXTURE_CACHE_OFF
+				&& OpenOrBuildTextureCache(job.path, streamer->arrayFormat, job.cache, streamer->arrayLayerSize);
+			if (!cached)
+				BuildTextureCacheInMemory(job.path, streamer->arrayFormat, job.cache, streamer->arrayLayerSize, &job.error);
+		}
+		//Prefer the precompiled mip chain, and fall back to decoding if no cache can be made
+		else if (cacheFormat == TEXTURE_CACHE_OFF || !OpenOrBuildTextureCache(job.path, cacheFormat, job.cache))
+		{
+			//RGBA keeps every row 4-byte aligned and matches the GPU's native layout
+			job.pixels = DecodeImageRGBA(job.path, job.width, job.height, &job.error);
+		}
+
+		std::lock_guard<std::mutex> lock(streamer->mutex);
+		streamer->decoded.push_back(std::move(job));
+	}
+}
+
+// Create the placeholder texture, the upload ring and workerCount decode threads
+static void InitTextureStreamer(TextureStreamer& streamer, unsigned workerCount)
+{
+	const unsigned char grey[4] = { 128, 128, 128, 255 };
+	glGenTextures(1, &streamer.placeholder);
+	glBindTexture(GL_TEXTURE_2D, streamer.placeholder);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	for (int i = 0; i < TEXTURE_UPLOAD_BUFFERS; i++)
+		glGenBuffers(1, &streamer.uploadBuffers[i].pbo);
+
+	if (workerCount == 0)
+		workerCount = 1;
+	for (unsigned i = 0; i < workerCount; i++)
+		streamer.workers.push_back(std::thread(TextureDecodeWorker, &streamer));
+}
+
+// Pack textures into one GL_TEXTURE_2D_ARRAY of layerSize x layerSize layers with room for
+// maxTextures textures; call after InitTextureStreamer and before loading anything.
+// format is RGBA8 or BC1, with layers built in memory when cache files are off.
+static void InitTextureArray(TextureStreamer& streamer, GLuint layerSize, GLint maxTextures, TextureCacheFormat format)
+{
+	streamer.arrayLayerSize = layerSize;
+	streamer.arrayLayers = maxTextures + 1;
+	streamer.arrayFormat = format == TEXTURE_CACHE_BC1 ? TEXTURE_CACHE_BC1 : TEXTURE_CACHE_RGBA8;
+
+	//Layer 0 is the placeholder, a grey mip chain in the array's own format
+	TextureCacheFile placeholder;
+	std::vector<unsigned char> grey((size_t)layerSize * layerSize * 4, 128);
+	EncodeTextureImage(grey, layerSize, layerSize, streamer.arrayFormat, 0, placeholder.memory);
+	const TextureCacheHeader& header = TextureCacheHeaderOf(placeholder);
+
+	glGenTextures(1, &streamer.arrayTexture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.arrayTexture);
+	streamer.arrayBytes = 0;
+	for (uint32_t i = 0; i < header.mipCount; i++)
+	{
+		const TextureCacheMip& mip = header.mips[i];
+		GLsizei levelBytes = (GLsizei)mip.size * streamer.arrayLayers;
+		if (streamer.arrayFormat == TEXTURE_CACHE_BC1)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, mip.width, mip.height, streamer.arrayLayers, 0, levelBytes, nullptr);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_RGBA8, mip.width, mip.height, streamer.arrayLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		streamer.arrayBytes += (size_t)levelBytes;
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, header.mipCount - 1);
+	UploadTextureCacheLayer(placeholder, 0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// Queue a file for decoding into an existing handle, the current image stays bound until it lands
+static void ReloadTextureAsync(TextureStreamer& streamer, TextureHandle handle, const std::string& path)
+{
+	TextureSlot& slot = streamer.slots[handle];
+	slot.path = path;
+	slot.pending = true;
+	slot.generation++;
+
+	TextureJob job;
+	job.handle = handle;
+	job.generation = slot.generation;
+	job.path = path;
+	if (streamer.arrayTexture && (GLint)handle + 1 < streamer.arrayLayers)
+		job.layer = (GLint)handle + 1; //past the array's capacity textures stay standalone
+	{
+		std::lock_guard<std::mutex> lock(streamer.mutex);
+		streamer.requests.push_back(std::move(job));
+	}
+	streamer.wake.notify_one();
+}
+
+// Queue a file for decoding, returns immediately with a handle that draws the placeholder for now
+static TextureHandle LoadTextureAsync(TextureStreamer& streamer, const std::string& path)
+{
+	streamer.slots.push_back(TextureSlot());
+	TextureHandle handle = (TextureHandle)(streamer.slots.size() - 1);
+	ReloadTextureAsync(streamer, handle, path);
+	return handle;
+}
+
+// GL texture to bind for a handle this frame
+static GLuint ResolveTexture(const TextureStreamer& streamer, TextureHandle handle)
+{
+	GLuint texture = streamer.slots[handle].texture;
+	return texture ? texture : streamer.placeholder;
+}
+
+// Texture array layer to sample for a handle this frame
+static GLint ResolveTextureLayer(const TextureStreamer& streamer, TextureHandle handle)
+{
+	return streamer.slots[handle].layer;
+}
+
+// Next staging buffer the GPU has finished reading from, or nullptr if the whole ring is busy
+static UploadBuffer* AcquireUploadBuffer(TextureStreamer& streamer)
+{
+	for (int i = 0; i < TEXTURE_UPLOAD_BUFFERS; i++)
+	{
+		UploadBuffer& buffer = streamer.uploadBuffers[(streamer.nextUploadBuffer + i) % TEXTURE_UPLOAD_BUFFERS];
+		if (buffer.fence)
+		{
+			if (glClientWaitSync(buffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+				continue;
+			glDeleteSync(buffer.fence);
+			buffer.fence = 0;
+		}
+		streamer.nextUploadBuffer = (streamer.nextUploadBuffer + i + 1) % TEXTURE_UPLOAD_BUFFERS;
+		return &buffer;
+	}
+	return nullptr;
+}
+
+// Make a freshly uploaded texture the one a slot resolves to.
+// Commands are ordered, so draws issued after this point already see the new image.
+static void SwapSlotTexture(TextureStreamer& streamer, TextureHandle handle, GLuint texture, size_t bytes)
+{
+	TextureSlot& slot = streamer.slots[handle];
+	if (slot.texture)
+		glDeleteTextures(1, &slot.texture);
+	slot.texture = texture;
+	slot.bytes = bytes;
+	slot.pending = false;
+}
+
+// Copy one decoded image through a PBO into a fresh texture object and swap it into its slot
+static void UploadDecodedTexture(TextureStreamer& streamer, UploadBuffer& buffer, const TextureJob& job)
+{
+	GLsizeiptr size = (GLsizeiptr)job.width * job.height * 4;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.pbo);
+	if (size > buffer.capacity)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		buffer.capacity = size;
+	}
+	void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (mapped)
+	{
+		memcpy(mapped, job.pixels, (size_t)size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if (mapped)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, job.width, job.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!mapped)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, job.width, job.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, job.pixels);
+	glGenerateMipmap(GL_TEXTURE_2D); //handles resolution
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	//Full mip chain is a third larger than the base level
+	size_t bytes = 0;
+	for (GLsizeiptr w = job.width, h = job.height; ; w = std::max<GLsizeiptr>(1, w / 2), h = std::max<GLsizeiptr>(1, h / 2))
+	{
+		bytes += (size_t)(w * h * 4);
+		if (w == 1 && h == 1)
+			break;
+	}
+	SwapSlotTexture(streamer, job.handle, texture, bytes);
+}
+
+// Upload a mapped cache file's mip chain; the mapping itself is the staging memory, so no PBO copy
+static void UploadCachedTexture(TextureStreamer& streamer, const TextureJob& job)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	size_t bytes = UploadTextureCache(job.cache);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	SwapSlotTexture(streamer, job.handle, texture, bytes);
+}
+
+// Fill a texture's array layer from its resized mip chain; the layer is used from the next draw on
+static size_t UploadTextureLayer(TextureStreamer& streamer, const TextureJob& job)
+{
+	glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.arrayTexture);
+	size_t bytes = UploadTextureCacheLayer(job.cache, job.layer);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	TextureSlot& slot = streamer.slots[job.handle];
+	slot.layer = job.layer;
+	slot.pending = false;
+	return bytes;
+}
+
+static void ReleaseTextureJob(TextureJob& job)
+{
+	if (job.pixels)
+		SOIL_free_image_data(job.pixels);
+	job.pixels = nullptr;
+	CloseTextureCache(job.cache);
+}
+
+// Upload images the workers have finished, up to the per-call byte budget. Call once per frame
+// on the thread that owns the GL context; returns the number of textures that became resident.
+static int PumpTextureUploads(TextureStreamer& streamer)
+{
+	int uploaded = 0;
+	size_t bytes = 0;
+	while (bytes < streamer.uploadBudget)
+	{
+		TextureJob job;
+		{
+			std::lock_guard<std::mutex> lock(streamer.mutex);
+			if (streamer.decoded.empty())
+				break;
+			job = std::move(streamer.decoded.front());
+			streamer.decoded.pop_front();
+		}
+
+		TextureSlot& slot = streamer.slots[job.handle];
+		bool loaded = job.pixels || TextureCacheBytes(job.cache);
+		if (job.generation != slot.generation || !loaded)
+		{
+			//superseded by a newer reload, or the file failed to decode (placeholder stays)
+			if (!loaded && job.generation == slot.generation)
+			{
+				fprintf(stderr, "Failed to load texture %s: %s\n", job.path.c_str(), job.error.c_str());
+				slot.pending = false;
+			}
+			ReleaseTextureJob(job);
+			continue;
+		}
+
+		if (job.layer)
+		{
+			bytes += UploadTextureLayer(streamer, job);
+			ReleaseTextureJob(job);
+			uploaded++;
+			continue;
+		}
+
+		if (TextureCacheBytes(job.cache))
+		{
+			UploadCachedTexture(streamer, job);
+			bytes += slot.bytes;
+			ReleaseTextureJob(job);
+			uploaded++;
+			continue;
+		}
+
+		UploadBuffer* buffer = AcquireUploadBuffer(streamer);
+		if (!buffer)
+		{
+			//every staging buffer is still being read, try again next frame
+			std::lock_guard<std::mutex> lock(streamer.mutex);
+			streamer.decoded.push_front(std::move(job));
+			break;
+		}
+
+		UploadDecodedTexture(streamer, *buffer, job);
+		ReleaseTextureJob(job);
+		bytes += (size_t)job.width * job.height * 4;
+		uploaded++;
+	}
+	return uploaded;
+}
+
+// GPU memory held by every resident texture
+static size_t TextureMemoryBytes(const TextureStreamer& streamer)
+{
+	size_t bytes = streamer.arrayBytes;
+	for (const TextureSlot& slot : streamer.slots)
+		bytes += slot.bytes;
+	return bytes;
+}
+
+// True while any texture is waiting to be decoded or uploaded
+static bool TextureLoadsPending(const TextureStreamer& streamer)
+{
+	for (const TextureSlot& slot : streamer.slots)
+		if (slot.pending)
+			return true;
+	return false;
+}
+
+// Block until every queued texture is resident (headless runs want the final image from frame one)
+static void FinishTextureLoads(TextureStreamer& streamer)
+{
+	while (TextureLoadsPending(streamer))
+	{
+		if (PumpTextureUploads(streamer) == 0)
+			std::this_thread::yield();
+	}
+}
+
+// Stop the workers and release every GL object the streamer owns
+static void DestroyTextureStreamer(TextureStreamer& streamer)
+{
+	{
+		std::lock_guard<std::mutex> lock(streamer.mutex);
+		streamer.stopping = true;
+	}
+	streamer.wake.notify_all();
+	for (std::thread& worker : streamer.workers)
+		worker.join();
+	streamer.workers.clear();
+
+	for (TextureJob& job : streamer.decoded)
+		ReleaseTextureJob(job);
+	streamer.decoded.clear();
+	streamer.requests.clear();
+
+	for (TextureSlot& slot : streamer.slots)
+		if (slot.texture)
+			glDeleteTextures(1, &slot.texture);
+	streamer.slots.clear();
+
+	for (int i = 0; i < TEXTURE_UPLOAD_BUFFERS; i++)
+	{
+		UploadBuffer& buffer = streamer.uploadBuffers[i];
+		if (buffer.fence)
+			glDeleteSync(buffer.fence);
+		glDeleteBuffers(1, &buffer.pbo);
+		buffer = UploadBuffer();
+	}
+
+	glDeleteTextures(1, &streamer.placeholder);
+	streamer.placeholder = 0;
+	if (streamer.arrayTexture)
+		glDeleteTextures(1, &streamer.arrayTexture);
+	streamer.arrayTexture = 0;
+	streamer.arrayBytes = 0;
+}
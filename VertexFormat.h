@@ -0,0 +1,147 @@
+#pragma once
+
+// Vertex formats and the layout descriptors that set up their attribute pointers.
+// Meshes are authored as 11-float rows (position, unused color, uv, normal) and packed
+// to PackedVertex at load time, which drops the color and stores uv and normal in
+// normalized integer formats (44 bytes -> 20 bytes per vertex).
+
+#include <GLEW/glew.h>
+#include <glm/glm.hpp>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// Attribute locations shared by the scene shaders (location 1 was the unused color)
+const GLuint ATTRIB_POSITION = 0;
+const GLuint ATTRIB_TEXCOORD = 2;
+const GLuint ATTRIB_NORMAL = 3;
+
+//Position, 16-bit unorm uv and a GL_INT_2_10_10_10_REV normal
+struct PackedVertex
+{
+	GLfloat position[3];
+	GLushort uv[2];
+	GLuint normal;
+};
+
+//One vertex attribute inside an interleaved vertex
+struct VertexAttribute
+{
+	GLuint location;
+	GLint size;
+	GLenum type;
+	GLboolean normalized;
+	GLuint offset;
+	GLuint divisor; //0 per vertex, 1 per instance
+};
+
+//Interleaved vertex layout, applied to whatever buffer is bound to GL_ARRAY_BUFFER
+struct VertexLayout
+{
+	GLsizei stride;
+	GLuint attributeCount;
+	VertexAttribute attributes[4];
+};
+
+const VertexLayout packedVertexLayout = {
+	sizeof(PackedVertex), 3, {
+		{ ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, offsetof(PackedVertex, position), 0 },
+		{ ATTRIB_TEXCOORD, 2, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(PackedVertex, uv), 0 },
+		{ ATTRIB_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, offsetof(PackedVertex, normal), 0 }
+	}
+};
+
+//Per-instance model matrix, a mat4 takes four consecutive locations starting at 1
+const VertexLayout instanceMatrixLayout = {
+	sizeof(glm::mat4), 4, {
+		{ 1, 4, GL_FLOAT, GL_FALSE, 0 * sizeof(glm::vec4), 1 },
+		{ 2, 4, GL_FLOAT, GL_FALSE, 1 * sizeof(glm::vec4), 1 },
+		{ 3, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec4), 1 },
+		{ 4, 4, GL_FLOAT, GL_FALSE, 3 * sizeof(glm::vec4), 1 }
+	}
+};
+
+//Instanced stress meshes read each per-instance value from its own array: the model matrix at
+//locations 4-7, the normal matrix at 8-10 and the material selector at 1 (converted to float)
+const VertexLayout instanceModelLayout = {
+	sizeof(glm::mat4), 4, {
+		{ 4, 4, GL_FLOAT, GL_FALSE, 0 * sizeof(glm::vec4), 1 },
+		{ 5, 4, GL_FLOAT, GL_FALSE, 1 * sizeof(glm::vec4), 1 },
+		{ 6, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec4), 1 },
+		{ 7, 4, GL_FLOAT, GL_FALSE, 3 * sizeof(glm::vec4), 1 }
+	}
+};
+
+const VertexLayout instanceNormalLayout = {
+	sizeof(glm::mat3), 3, {
+		{ 8, 3, GL_FLOAT, GL_FALSE, 0 * sizeof(glm::vec3), 1 },
+		{ 9, 3, GL_FLOAT, GL_FALSE, 1 * sizeof(glm::vec3), 1 },
+		{ 10, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3), 1 }
+	}
+};
+
+const VertexLayout instanceMaterialLayout = {
+	sizeof(GLuint), 1, {
+		{ 1, 1, GL_UNSIGNED_INT, GL_FALSE, 0, 1 }
+	}
+};
+
+// Specify attribute locations and layout to the GPU for the bound VAO and GL_ARRAY_BUFFER.
+// baseOffset is the byte offset of the first vertex inside the buffer.
+static void ApplyVertexLayout(const VertexLayout& layout, size_t baseOffset = 0)
+{
+	for (GLuint i = 0; i < layout.attributeCount; i++)
+	{
+		const VertexAttribute& attribute = layout.attributes[i];
+		glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized,
+			layout.stride, (GLvoid*)(baseOffset + attribute.offset));
+		glEnableVertexAttribArray(attribute.location);
+		glVertexAttribDivisor(attribute.location, attribute.divisor);
+	}
+}
+
+// Signed normalized 10:10:10:2 normal, w left at 0
+static GLuint PackNormal(const glm::vec3& normal)
+{
+	GLuint packed = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		GLfloat component = glm::clamp(normal[i], -1.0f, 1.0f);
+		GLint value = (GLint)floorf(component * 511.0f + 0.5f);
+		packed |= ((GLuint)value & 0x3FFu) << (i * 10);
+	}
+	return packed;
+}
+
+// 16-bit unsigned normalized texture coordinate, authored uvs are all in [0, 1]
+static GLushort PackUV(GLfloat coordinate)
+{
+	return (GLushort)(glm::clamp(coordinate, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+static PackedVertex MakePackedVertex(const glm::vec3& position, const glm::vec2& uv, const glm::vec3& normal)
+{
+	PackedVertex vertex;
+	vertex.position[0] = position.x;
+	vertex.position[1] = position.y;
+	vertex.position[2] = position.z;
+	vertex.uv[0] = PackUV(uv.x);
+	vertex.uv[1] = PackUV(uv.y);
+	vertex.normal = PackNormal(normal);
+	return vertex;
+}
+
+// Convert authored rows of x,y,z, r,g,b (unused), u,v, nx,ny,nz to packed vertices
+static std::vector<PackedVertex> PackVertices(const GLfloat* source, size_t floatCount)
+{
+	const size_t authoredStride = 11;
+	std::vector<PackedVertex> packed;
+	packed.reserve(floatCount / authoredStride);
+
+	for (size_t i = 0; i + authoredStride <= floatCount; i += authoredStride)
+	{
+		const GLfloat* row = source + i;
+		packed.push_back(MakePackedVertex(glm::vec3(row[0], row[1], row[2]), glm::vec2(row[6], row[7]), glm::vec3(row[8], row[9], row[10])));
+	}
+	return packed;
+}